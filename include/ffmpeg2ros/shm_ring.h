@@ -0,0 +1,93 @@
+#ifndef FFMPEG2ROS_SHM_RING_H
+#define FFMPEG2ROS_SHM_RING_H
+
+// ring of image slots in POSIX shared memory (/dev/shm/<name>), written by ffmpeg2ros (shm=1), read by other processes
+// on the same host without serialization or socket copies; only a small ffmpeg2ros/ShmImage descriptor goes over ROS
+// every slot has a sequence number used as seqlock: odd while its frame is being written, even once it's complete,
+// a frame is valid as long as its slot still carries the sequence number descriptor gave
+// so readers never block writer: a reader too slow for the ring sees check fail and drops that frame
+//
+// layout, for readers that map the file themselves (Python mmap, numpy), all little endian, offsets in bytes:
+//   0   uint32 magic (FFMPEG2ROS_SHM_MAGIC)     4  uint32 version (FFMPEG2ROS_SHM_VERSION)
+//   8   uint32 slots                            12 uint32 header_size (slot header stride)
+//   16  uint64 slot_size (data bytes per slot)  24 uint64 data_offset
+//   32  uint64 written (frames written so far)
+//   64  slots x slot header, header_size apart: struct ffmpeg2ros_shm_slot
+//   data_offset + slot * slot_size: frame data, rows step bytes apart
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FFMPEG2ROS_SHM_MAGIC 0x4d485346	// "FSHM"
+#define FFMPEG2ROS_SHM_VERSION 1
+#define FFMPEG2ROS_SHM_ENCODING_SIZE 32
+
+// frame in a slot, as sensor_msgs/Image describes it
+struct ffmpeg2ros_shm_frame
+	{
+	uint64_t frame_number;		// header.seq of image
+	int64_t stamp_ns;			// header.stamp
+	uint32_t width;
+	uint32_t height;
+	uint32_t step;				// bytes per row
+	uint32_t size;				// bytes of data
+	char encoding[FFMPEG2ROS_SHM_ENCODING_SIZE];	// sensor_msgs encoding, 0 terminated
+	};
+
+// slot header in shared memory
+struct ffmpeg2ros_shm_slot
+	{
+	uint64_t sequence;			// seqlock, odd while frame is written
+	struct ffmpeg2ros_shm_frame frame;
+	};
+
+struct ffmpeg2ros_shm_ring;
+
+// writer: create ring of slots, each holding slot_size bytes, replaces a stale ring of same name (left by a crash)
+// name is a POSIX shm name ("/ffmpeg2ros_cam0_rgb"), returns NULL if it can't be created
+struct ffmpeg2ros_shm_ring* ffmpeg2ros_shm_ring_create(const char* name, int slots, size_t slot_size);
+
+// writer: unmap and unlink, readers keep their mappings until they close
+void ffmpeg2ros_shm_ring_destroy(struct ffmpeg2ros_shm_ring* ring);
+
+// writer: next slot in turn is marked busy, returns its data (slot_size bytes) to fill
+uint8_t* ffmpeg2ros_shm_ring_begin_write(struct ffmpeg2ros_shm_ring* ring, uint32_t* slot);
+
+// writer: slot is complete with frame's metadata, returns its new sequence number for descriptor
+uint64_t ffmpeg2ros_shm_ring_end_write(struct ffmpeg2ros_shm_ring* ring, uint32_t slot, const struct ffmpeg2ros_shm_frame* frame);
+
+// writer: slot didn't get a new frame after all (conversion failed), it's marked complete again with a new sequence number,
+// so readers of frame it held before see that one is gone, it's next in turn again
+void ffmpeg2ros_shm_ring_cancel_write(struct ffmpeg2ros_shm_ring* ring, uint32_t slot);
+
+size_t ffmpeg2ros_shm_ring_slot_size(const struct ffmpeg2ros_shm_ring* ring);
+
+// reader: map existing ring read-only, returns NULL if there is none or it isn't one of ours
+struct ffmpeg2ros_shm_ring* ffmpeg2ros_shm_ring_open(const char* name);
+
+void ffmpeg2ros_shm_ring_close(struct ffmpeg2ros_shm_ring* ring);
+
+// reader, zero copy: frame's data in place and its metadata, NULL if slot doesn't hold that frame (any more)
+// data may be overwritten any time after, use it, then ffmpeg2ros_shm_ring_check() tells if what was used is valid
+const uint8_t* ffmpeg2ros_shm_ring_peek(struct ffmpeg2ros_shm_ring* ring, uint32_t slot, uint64_t sequence,
+										struct ffmpeg2ros_shm_frame* frame);
+
+// reader: 1 if slot still holds frame with that sequence number, so data read since peek is consistent
+int ffmpeg2ros_shm_ring_check(struct ffmpeg2ros_shm_ring* ring, uint32_t slot, uint64_t sequence);
+
+// reader, one copy: frame into dst (up to size bytes) with its metadata, returns 0, or -1 if it was overwritten
+int ffmpeg2ros_shm_ring_read(struct ffmpeg2ros_shm_ring* ring, uint32_t slot, uint64_t sequence,
+							 void* dst, size_t size, struct ffmpeg2ros_shm_frame* frame);
+
+// reader without descriptors: newest complete frame's slot and sequence number, returns 0 if nothing was written yet
+int ffmpeg2ros_shm_ring_latest(struct ffmpeg2ros_shm_ring* ring, uint32_t* slot, uint64_t* sequence);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FFMPEG2ROS_SHM_RING_H
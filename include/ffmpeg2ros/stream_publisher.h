@@ -0,0 +1,189 @@
+#ifndef FFMPEG2ROS_STREAM_PUBLISHER_H
+#define FFMPEG2ROS_STREAM_PUBLISHER_H
+
+//publisher logic of ffmpeg2ros, shared by standalone node (ffmpeg2ros_rev3.cpp) and nodelet (ffmpeg2ros_nodelet.cpp)
+
+#include "ros/ros.h"
+#include "std_msgs/Header.h"
+#include "std_msgs/Empty.h"
+#include "std_srvs/Trigger.h"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+
+#include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_decoder_portable_noscaling.h"
+#include "ffmpeg2ros/shm_ring.h"
+
+namespace ffmpeg2ros
+{
+
+//one image topic of a stream, several of them can share one decode, each with its own crop, size and format
+struct stream_output
+	{
+	struct mt_ffmpeg_stream_output output;	//as decoder library takes it
+	std::string topic;						//name under ns, empty = format's own (rgb, grey, ...)
+	ros::Publisher pub;
+	int width_out,height_out;
+	ros::Publisher shm_pub;					//<topic>/shm descriptors, with shm=1
+	struct ffmpeg2ros_shm_ring* shm_ring;	//made on first frame somebody wants, anew when images outgrow its slots
+	std::string shm_name;
+	int shm_generation;						//suffix of next ring's name
+	size_t shm_failed_size;					//ring for images this big couldn't be made (/dev/shm full), 0 = none failed
+	double shm_retry_time;					//wall clock seconds, no new try at that size before
+	double convert_warned;					//wall clock seconds of last conversion failure warning
+	};
+
+//conversion of one output of lent frame into caller's buffer, result as mt_ffmpeg_stream_decoder_convert_output() gives it
+struct convert_job
+	{
+	int handle;
+	int output;
+	unsigned char* dst;
+	int dst_stride;
+	int result;							//< 0 = failed, nothing may be published from dst
+	};
+
+//threads of one stream converting its extra outputs while publishing thread does first one,
+//started once with the stream, so frames cost a wakeup per output, not a thread
+class ConvertWorkers
+	{
+public:
+	explicit ConvertWorkers(int count);
+	~ConvertWorkers();
+
+	//run jobs, first one on calling thread, others on workers, returns when all are done
+	void run(std::vector<convert_job>& jobs);
+
+private:
+	void work(size_t index);
+
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake,done;
+	std::vector<convert_job>* jobs;	//of current frame, workers take jobs[index+1]
+	uint64_t generation;					//frames handed out
+	int pending;							//jobs of current frame not finished by workers
+	bool stopping;
+	};
+
+//one camera served by this node: decoder handle, its settings and its publishers
+struct camera_stream
+	{
+	std::string uri;
+	std::string ns;							//topic namespace, image goes to <ns>/rgb or <ns>/grey (<ns>/packets in passthrough mode)
+	std::string frame_id;					//header.frame_id of published messages, empty = ns without leading '/'
+	int format;									//FFMPEG_STREAM_FORMAT_*, rgb8 by default
+	char full_halfbar;
+	char bt709;
+	double scale;								//0 = native resolution
+	int size_w,size_h;						//explicit output size, wins over scale
+	int scale_filter;							//-1 = pick default for the mode
+	int crop_x,crop_y,crop_w,crop_h;		//region of native picture, crop_w 0 = whole picture
+	std::string topic;						//image topic under ns, empty = named after format
+	std::vector<stream_output> outputs;	//from ~streams entry's outputs list, or just one made of settings above
+	std::shared_ptr<ConvertWorkers> workers;	//with more than one output, from start() to close()
+	struct mt_ffmpeg_stream_options options;	//decoder threading and ingest
+	int idle_decode;							//FFMPEG_STREAM_DECODE_* while nobody subscribes
+	double max_rate;							//Hz, frames beyond it are released unconverted, 0 = publish every frame
+	char adaptive;								//decoder discards non-reference frames while we fall behind
+	int queue_size;							//publisher queue, 0 = 1 image (100 with keep_all)
+	char shm;									//also offer images through shared memory ring, <topic>/shm carries descriptors
+	int shm_slots;								//images in ring, a reader has slots-1 frame times to use one
+	std::string preevent_dir;				//where pre-event dumps go, empty = working directory (ROS_HOME for roslaunch)
+	//
+	int handle;
+	ros::Publisher img_pub;					//<ns>/packets in passthrough mode
+	ros::Publisher latency_pub;			//<ns>/latency, per-frame latency next to every image
+	ros::Publisher preevent_pub;			//<ns>/preevent, replayed pre-event buffer
+	ros::ServiceServer dump_srv,replay_srv;	//<ns>/dump_preevent, <ns>/replay_preevent
+	uint32_t seq;								//header.seq of next message
+	//latency log
+	int latency_frames,glass_frames;
+	double receive_sum,receive_max,glass_sum,glass_max;
+	//stage counters at previous report, for interval histograms
+	struct mt_ffmpeg_stream_stage_stats stage_prev[FFMPEG_STREAM_STAGES];
+	uint64_t reconnects_seen;				//reported so far
+	uint64_t not_recorded_seen;
+	double error_warned;						//wall clock seconds of last error state warning, every stream is warned about on its own
+	//load shedding
+	double next_publish;						//wall clock seconds, max_rate pacing
+	uint64_t rate_limited;					//frames released unpublished because of max_rate
+	bool shedding;								//decoding in FFMPEG_STREAM_DECODE_REFERENCE mode
+	double adapt_time,calm_since;			//last check, last time we were behind
+	uint64_t overwritten_seen,acquired_seen,limited_seen;	//counters at last check
+	};
+
+//output format as named by format= arg, its sensor_msgs encoding and topic name under ns
+struct output_format
+	{
+	const char* name;
+	int format;								//FFMPEG_STREAM_FORMAT_*
+	const char* encoding;
+	const char* topic;
+	};
+
+//entry for FFMPEG_STREAM_FORMAT_* value
+const output_format& find_output_format(int format);
+
+//defaults for every stream, before command line and per-stream parameters are applied
+void init_camera_stream(camera_stream* s);
+
+//apply one setting, given as command line arg (key or key=value) or as member of a ~streams entry
+//returns 0 if key isn't known
+int parse_stream_arg(camera_stream* s, const char* key, const char* value);
+
+//apply members of one ~streams entry, its outputs list last, so outputs inherit every other member
+void parse_stream_param(camera_stream* s, XmlRpc::XmlRpcValue& entry);
+
+//opens configured streams, publishes their frames and closes them again
+//images are published as shared pointers that are never touched after publish(),
+//so subscribers in the same process (nodelet manager) get the very same message, without serialization or copy
+class StreamPublisher
+	{
+public:
+	StreamPublisher();
+	~StreamPublisher();
+
+	//read args (conventional key=value, not ROS ones) and ~ params from pn, open streams, advertise topics under n
+	//returns false if no stream could be opened
+	bool start(ros::NodeHandle& n, ros::NodeHandle& pn, const std::vector<std::string>& args);
+
+	//publish frames as they come until ROS shuts down or stop() is called, blocks calling thread
+	void run();
+
+	//make run() return soon, can be called from any thread
+	void stop();
+
+	//close streams, after run() has returned
+	void close();
+
+private:
+	void publish_frame(camera_stream& s);
+	void publish_packets(camera_stream& s);
+	void adapt_decode(camera_stream& s);
+	void add_latency(camera_stream& s, const struct mt_ffmpeg_stream_frame_times& times);
+	void publish_latency(camera_stream& s, const std_msgs::Header& header, const struct mt_ffmpeg_stream_frame_times& times);
+	void log_latency();
+	void report_stages();
+	bool dump_preevent(camera_stream& s, std::string& message);
+	bool replay_preevent(camera_stream& s, std::string& message);
+	bool on_dump_preevent(size_t k, std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res);
+	bool on_replay_preevent(size_t k, std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res);
+	void on_preevent_trigger(const std_msgs::Empty::ConstPtr& msg);
+
+	std::vector<camera_stream> streams;
+	std::vector<int> handles;				//of open streams, to wait on them only
+	ros::Publisher diag_pub;				//stage timing and counters of all streams on /diagnostics
+	ros::Subscriber preevent_sub;			//~dump_preevent, dumps every stream's pre-event buffer
+	std::mutex preevent_mutex;				//pre-event requests come on ROS callback threads, answered one at a time
+	std::atomic<bool> stopping;
+	bool started;								//decoder library initialised by us
+	};
+
+} //namespace ffmpeg2ros
+
+#endif //FFMPEG2ROS_STREAM_PUBLISHER_H
@@ -1,24 +1,294 @@
 #ifndef FFMPEG_STREAM_DECODER_H
 #define FFMPEG_STREAM_DECODER_H
 
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// init() and done() are counted, so several users in one process (e.g. nodelets) can each call them once
 void mt_ffmpeg_stream_decoder_init();
 void mt_ffmpeg_stream_decoder_done();
 
+// optional shared decode pool of given number of threads (0 = one per CPU core), returns number started
+// streams opened afterwards keep their own thread only for reading packets, decoding is spread over pool threads,
+// so CPU use follows core count instead of camera count; call after init() and before opening streams
+// pooled streams decode single threaded unless their options ask for more
+int mt_ffmpeg_stream_decoder_start_pool(int workers);
+
+// set width and height to 0 to grab frames in native resolution
 int mt_ffmpeg_stream_decoder_open(const char* uri, int width, int height);
 void mt_ffmpeg_stream_decoder_close(int handle);
 
+// decoder threading, values match libavcodec FF_THREAD_* flags
+
+#define FFMPEG_STREAM_THREAD_DEFAULT 0		// whatever codec supports, frame threading preferred
+#define FFMPEG_STREAM_THREAD_FRAME 1		// one frame per thread, best throughput, adds (thread_count - 1) frames of delay
+#define FFMPEG_STREAM_THREAD_SLICE 2		// slices of one frame in parallel, no extra delay, needs sliced streams (default)
+
+// RTSP transport
+
+#define FFMPEG_STREAM_TRANSPORT_DEFAULT 0	// ffmpeg's choice, UDP falling back to TCP
+#define FFMPEG_STREAM_TRANSPORT_UDP 1
+#define FFMPEG_STREAM_TRANSPORT_TCP 2		// interleaved in RTSP connection, no packet loss or reordering
+
+// options that must be known before stream is opened
+struct mt_ffmpeg_stream_options
+	{
+	int thread_count;		// decoder threads, 0 = one per CPU core, 1 = no threading
+	int thread_type;		// FFMPEG_STREAM_THREAD_*, slice by default, frame threading only when asked for
+
+	// low latency mode: decoder uses slice threading only with AV_CODEC_FLAG_LOW_DELAY (overrides thread_type),
+	// demuxer doesn't buffer (fflags=nobuffer) and probing below falls back to small values
+	int low_latency;
+
+	int transport;			// FFMPEG_STREAM_TRANSPORT_*
+	int probesize;			// bytes read to detect stream layout, 0 = ffmpeg default (5 MB) or 32 KB in low latency mode
+	int analyzeduration;	// microseconds of stream analysed, 0 = ffmpeg default (5 s) or 100 ms in low latency mode
+	int reorder_queue_size;	// RTP packets held to reorder UDP, -1 = ffmpeg default or 0 in low latency mode
+	int max_delay;			// microseconds demuxer may wait for late packets, -1 = ffmpeg default or 0 in low latency mode
+	char codec_name[32];	// known decoder name like "h264" or "hevc" skips avformat_find_stream_info(), empty = probe
+	int listen;				// wait for sender to connect to URI instead of connecting to camera, e.g. RTSP ANNOUNCE/RECORD
+							// push from ffmpeg -f rtsp (rtsp_flags=listen), or tcp:// / rtmp:// servers
+	char input_format[16];	// demuxer by name, e.g. "lavfi" with a filter graph as URI, empty = guess from URI
+							// (device inputs like lavfi need avdevice_register_all() from application)
+
+	// no decoding at all, compressed packets are handed to application with mt_ffmpeg_stream_decoder_acquire_packet()
+	// frame functions don't apply then, NEW_FRAME status means packets are waiting
+	int passthrough;
+
+	// lost or failed connection is opened again (status goes back to CONNECTING meanwhile) instead of ending in ERROR
+	// -1 = only for network URIs, not files, devices or lavfi; decoder is kept if stream comes back with same codec
+	int reconnect;
+	int reconnect_delay_ms;		// wait before first attempt, doubles on each failed one up to max (defaults 250 ms / 8 s)
+	int reconnect_max_delay_ms;
+	int io_timeout_ms;			// network reads and connects fail after this long without data, 0 = ffmpeg default (forever)
+
+	// every decoded frame is queued for application (up to 16) instead of only latest one, for lossless recording;
+	// when queue is full decoding waits for application, so stream decodes on its own thread, not in decode pool
+	int keep_all_frames;
+
+	// compressed video is also recorded to segmented files as it's read, whatever the decode mode, see ffmpeg_stream_recorder.h
+	char record_path[512];		// file name prefix with directory, e.g. "/data/cam0", empty = no recording
+	char record_format[8];		// "mp4" (fragmented, survives crashes) or "mkv"
+	int record_segment_s;		// new file at first keyframe after this many seconds, 0 = one file per connection
+	int record_max_files;		// oldest files are deleted beyond this many, 0 = keep all
+	int record_queue_size;		// packets waiting for recorder's writer thread, 0 = default (1024)
+
+	// pre-event buffer: last seconds of compressed video kept in memory, always from a keyframe on,
+	// for dumping or replaying what led up to an event, see mt_ffmpeg_stream_decoder_preevent_snapshot()
+	int preevent_s;				// at least this many seconds are kept (up to a keyframe interval more), 0 = no buffer
+	int preevent_max_kb;		// memory limit, oldest keyframe intervals go first, 0 = default (64 MB)
+	};
+
+// fill options with defaults: slice threads on all cores, no low latency, ffmpeg's ingest defaults,
+// reconnect for network streams with 5 s I/O timeout, no recording (one minute MP4 files once record_path is set),
+// no pre-event buffer
+void mt_ffmpeg_stream_decoder_default_options(struct mt_ffmpeg_stream_options* options);
+
+// same as mt_ffmpeg_stream_decoder_open() with explicit options, NULL means defaults
+int mt_ffmpeg_stream_decoder_open_ex(const char* uri, int width, int height, const struct mt_ffmpeg_stream_options* options);
+
 // status codes
 
-#define FFMPEG_STREAM_STATUS_CONNECTING 0
-#define FFMPEG_STREAM_STATUS_ERROR 1
+#define FFMPEG_STREAM_STATUS_CONNECTING 0	// also while reconnecting
+#define FFMPEG_STREAM_STATUS_ERROR 1		// stream ended for good: end of file, closed, or failed without reconnect
 #define FFMPEG_STREAM_STATUS_OK 2
 #define FFMPEG_STREAM_STATUS_NEW_FRAME 3
 
 int mt_ffmpeg_stream_decoder_get_status(int handle);
 
+// blocks until new frame, error or timeout (in milliseconds, < 0 waits forever)
+// returns stream status, so caller can sleep instead of polling get_status()
+int mt_ffmpeg_stream_decoder_wait_frame(int handle, int timeout_ms);
+
+// same for all open streams at once: blocks until any of them got new frame or error, returns 0 on timeout
+// caller then checks each stream with mt_ffmpeg_stream_decoder_get_status()
+int mt_ffmpeg_stream_decoder_wait_any(int timeout_ms);
+
+// same, but only listed streams count and only their events are consumed, for users sharing decoder with others
+int mt_ffmpeg_stream_decoder_wait_some(const int* handles, int count, int timeout_ms);
+
+// timing of lent frame, wall clock in microseconds (as av_gettime()), 0 if unknown
+struct mt_ffmpeg_stream_frame_times
+	{
+	int64_t capture_time;	// when camera took the frame: its best effort timestamp mapped to wall clock by RTCP sender reports,
+							// meaningful only if camera clock is synced, 0 until first sender report (and for non-RTSP inputs)
+	int64_t receive_time;	// when packet carrying the frame was read from network
+	int64_t decode_time;	// when decoder returned the frame
+	};
+
+// returns 0 and fills times if a frame is lent (see mt_ffmpeg_stream_decoder_acquire_frame()), -1 otherwise
+int mt_ffmpeg_stream_decoder_get_frame_times(int handle, struct mt_ffmpeg_stream_frame_times* times);
+
+// per-stream counters since open, all only ever grow
+struct mt_ffmpeg_stream_stats
+	{
+	uint64_t packets;				// video packets read from stream
+	uint64_t frames_decoded;		// frames returned by decoder
+	uint64_t frames_dropped;		// lost to decode errors (packets refused or failed by decoder)
+	uint64_t frames_overwritten;	// decoded but replaced by newer frame before application acquired them
+	uint64_t frames_acquired;		// taken by application with mt_ffmpeg_stream_decoder_acquire_frame() (or _packet())
+	uint64_t packets_skipped;		// read but not decoded, see mt_ffmpeg_stream_decoder_set_decode()
+	uint64_t reconnects;			// attempts to open stream again after it was lost (or failed to open)
+	uint64_t frames_discarded;		// left out by decoder in FFMPEG_STREAM_DECODE_REFERENCE mode (estimate, frames still inside decoder count too)
+	uint64_t packets_recorded;		// written to record files
+	uint64_t packets_not_recorded;	// dropped by recorder, its queue was full (disk too slow) or writing failed
+	uint64_t record_files;			// record segments started
+	};
+
+void mt_ffmpeg_stream_decoder_get_stats(int handle, struct mt_ffmpeg_stream_stats* stats);
+
+// pipeline stages timed per frame (or per packet), to tell network bound from decode bound from application bound
+
+#define FFMPEG_STREAM_STAGE_DEMUX 0			// waiting in av_read_frame() for next video packet
+#define FFMPEG_STREAM_STAGE_DECODE 1		// feeding one packet to decoder and taking frames out
+#define FFMPEG_STREAM_STAGE_HANDOFF 2		// decoded frame (or passthrough packet) waiting for application to acquire it
+#define FFMPEG_STREAM_STAGE_CONVERT 3		// mt_ffmpeg_stream_decoder_convert_frame(), swscale or pixel kernels
+#define FFMPEG_STREAM_STAGE_POSTPROCESS 4	// application's own work on frame, reported by application
+#define FFMPEG_STREAM_STAGE_PUBLISH 5		// handing result on (e.g. ROS publish and serialization), reported by application
+#define FFMPEG_STREAM_STAGES 6
+
+#define FFMPEG_STREAM_HISTOGRAM_BUCKETS 128	// log scale, 4 buckets per power of two microseconds
+
+struct mt_ffmpeg_stream_stage_stats
+	{
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[FFMPEG_STREAM_HISTOGRAM_BUCKETS];
+	};
+
+// add one sample, from any thread, lock-free
+void mt_ffmpeg_stream_decoder_add_stage_time(int handle, int stage, int64_t microseconds);
+
+// counters since open, subtract older snapshot's count, total_us and buckets for an interval
+void mt_ffmpeg_stream_decoder_get_stage_stats(int handle, int stage, struct mt_ffmpeg_stream_stage_stats* stats);
+
+// e.g. fraction 0.99 gives 99th percentile in microseconds, 0 if there are no samples
+int64_t mt_ffmpeg_stream_decoder_stage_percentile(const struct mt_ffmpeg_stream_stage_stats* stats, double fraction);
+
+// how much of stream is decoded, for streams nobody currently watches (or watches but can't keep up with)
+// connection stays open in every mode, after skipped packets decoding resumes at next keyframe
+
+#define FFMPEG_STREAM_DECODE_ALL 0
+#define FFMPEG_STREAM_DECODE_KEYFRAMES 1	// keeps a recent frame ready at a fraction of the cost
+#define FFMPEG_STREAM_DECODE_NONE 2		// only reads packets, drops frame waiting for application
+#define FFMPEG_STREAM_DECODE_REFERENCE 3	// decoder discards non-reference frames, lower frame rate when application can't keep up
+
+// can be called from any thread, e.g. from subscriber connect callbacks; applies to passthrough packets too
+void mt_ffmpeg_stream_decoder_set_decode(int handle, int mode);
+int mt_ffmpeg_stream_decoder_get_decode(int handle);
+
 int mt_ffmpeg_stream_decoder_get_frame_width(int handle);
 int mt_ffmpeg_stream_decoder_get_frame_height(int handle);
 
 void mt_ffmpeg_stream_decoder_grab_frame(int handle, unsigned char* framebuf);
 
+// output frame formats
+
+#define FFMPEG_STREAM_FORMAT_RGB24 0
+#define FFMPEG_STREAM_FORMAT_GREY 1		// luma plane of YUV sources, weighted luma for RGB sources
+#define FFMPEG_STREAM_FORMAT_BGR24 2
+#define FFMPEG_STREAM_FORMAT_UYVY 3		// packed YUV 4:2:2, U Y0 V Y1 (ROS yuv422)
+#define FFMPEG_STREAM_FORMAT_YUYV 4		// packed YUV 4:2:2, Y0 U Y1 V (ROS yuv422_yuy2)
+#define FFMPEG_STREAM_FORMAT_NV12 5		// luma rows, then (height + 1) / 2 rows of interleaved U V at half resolution
+
+// YUV formats keep decoder's samples as they are (matrix and range of the stream), when decoder already produces
+// requested layout at output size, or one that only needs repacking (planar 4:2:0 to NV12, planar 4:2:2 to UYVY / YUYV),
+// frames are copied into caller's buffer without swscale
+
+// bytes per row needed for width pixels in format, and number of such rows in an image of height pixels
+int mt_ffmpeg_stream_decoder_format_stride(int format, int width);
+int mt_ffmpeg_stream_decoder_format_rows(int format, int height);
+
+// luma weights for grey output from non-YUV sources
+
+#define FFMPEG_STREAM_LUMA_BT601 0
+#define FFMPEG_STREAM_LUMA_BT709 1
+
+// scale filters, done by swscale in the same pass as colour conversion
+
+#define FFMPEG_STREAM_SCALE_FAST_BILINEAR 0
+#define FFMPEG_STREAM_SCALE_BILINEAR 1
+#define FFMPEG_STREAM_SCALE_AREA 2			// box average, best for integer downscale like half size
+#define FFMPEG_STREAM_SCALE_POINT 3
+#define FFMPEG_STREAM_SCALE_BICUBIC 4
+
+struct mt_ffmpeg_stream_output
+	{
+	int format;			// FFMPEG_STREAM_FORMAT_*, RGB24 by default
+	int luma_weights;	// FFMPEG_STREAM_LUMA_*, BT.601 by default
+	int width;			// output size, 0 = derive from native resolution
+	int height;			// (open() width and height end up here)
+	double scale;		// used if width/height are 0, e.g. 0.5 for half size, 0 = native resolution
+	int scale_filter;	// FFMPEG_STREAM_SCALE_*
+
+	// region of native picture output is made from, size 0 = whole picture; width, height and scale above
+	// apply to it, left and top edge are rounded down to even, rectangle is clipped to picture
+	int crop_x;
+	int crop_y;
+	int crop_width;
+	int crop_height;
+	};
+
+void mt_ffmpeg_stream_decoder_set_output(int handle, const struct mt_ffmpeg_stream_output* output);
+
+// several outputs from one decode, each with own format, size and crop, returns -1 if count is out of range
+// output 0 is what _convert_frame() and _get_frame_width() / _height() refer to, set_output() leaves only that one
+#define FFMPEG_STREAM_MAX_OUTPUTS 8
+
+int mt_ffmpeg_stream_decoder_set_outputs(int handle, const struct mt_ffmpeg_stream_output* outputs, int count);
+int mt_ffmpeg_stream_decoder_get_num_outputs(int handle);
+int mt_ffmpeg_stream_decoder_get_output_width(int handle, int index);
+int mt_ffmpeg_stream_decoder_get_output_height(int handle, int index);
+
+// zero-copy access: acquire lends latest decoded frame (oldest queued with keep_all_frames, returns 1 if there was one),
+// convert writes it in selected output format straight into caller's memory, release hands frame back to decoder
+// caller's buffer holds mt_ffmpeg_stream_decoder_format_rows() rows of dst_stride bytes
+int mt_ffmpeg_stream_decoder_acquire_frame(int handle);
+int mt_ffmpeg_stream_decoder_convert_frame(int handle, unsigned char* dst, int dst_stride);
+// output at index, outputs can be converted at once by different threads while frame is lent
+int mt_ffmpeg_stream_decoder_convert_output(int handle, int index, unsigned char* dst, int dst_stride);
+void mt_ffmpeg_stream_decoder_release_frame(int handle);
+
+// compressed video packet in passthrough mode, as it came from camera
+// H.264 / H.265 always as Annex B byte stream, keyframes carry parameter sets even if camera or container
+// sends them out of band only (SDP sprop-parameter-sets, MP4 avcC)
+struct mt_ffmpeg_stream_packet
+	{
+	const uint8_t* data;		// valid until mt_ffmpeg_stream_decoder_release_packet()
+	int size;
+	int keyframe;
+	int64_t pts;				// in time_base units, INT64_MIN if unknown
+	int64_t dts;
+	int time_base_num;
+	int time_base_den;
+	const char* codec_name;	// "h264", "hevc", ...
+	struct mt_ffmpeg_stream_frame_times times;	// decode_time is 0
+	};
+
+// passthrough mode: acquire lends oldest waiting packet (returns 1 if there was one), release hands it back
+// every packet is needed for decoding later ones, so call acquire until it returns 0 whenever stream signals
+int mt_ffmpeg_stream_decoder_acquire_packet(int handle, struct mt_ffmpeg_stream_packet* packet);
+void mt_ffmpeg_stream_decoder_release_packet(int handle);
+
+// pre-event buffer (options.preevent_s): snapshot references packets buffered right now, starting with a keyframe,
+// returns their number (0 if buffer is empty or stream has none); snapshot stays until next one or close,
+// it's taken and used by one thread at a time, stream keeps filling buffer meanwhile
+// packets are as demuxer gave them (Annex B from RTSP), buffer carries on over reconnects if codec stays the same
+int mt_ffmpeg_stream_decoder_preevent_snapshot(int handle);
+
+// packet at index of snapshot, returns 0 if there is no such packet; data stays valid until next snapshot
+int mt_ffmpeg_stream_decoder_preevent_packet(int handle, int index, struct mt_ffmpeg_stream_packet* packet);
+
+// write snapshot to file on calling thread, MKV if name ends in .mkv, MP4 otherwise, with CSV index as recorder writes it
+// returns packets written, -1 if snapshot is empty or file can't be created
+int mt_ffmpeg_stream_decoder_preevent_dump(int handle, const char* filename);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // FFMPEG_STREAM_DECODER_H
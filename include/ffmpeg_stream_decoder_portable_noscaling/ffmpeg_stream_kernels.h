@@ -0,0 +1,61 @@
+#ifndef FFMPEG_STREAM_KERNELS_H
+#define FFMPEG_STREAM_KERNELS_H
+
+// small pixel kernels for the paths swscale doesn't cover well
+// every kernel has plain C reference version and SSE2 / AVX2 / NEON versions, picked at runtime from CPU features
+// all versions produce bit-exact same output as the reference one
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// colour matrices for YUV to RGB kernels
+
+#define FFMPEG_STREAM_KERNEL_BT601 0
+#define FFMPEG_STREAM_KERNEL_BT709 1
+
+struct mt_ffmpeg_stream_kernels
+	{
+	const char* name;	// "scalar", "sse2", "avx2" or "neon"
+
+	// 8-bit YUV 4:2:0 (planar or NV12) to packed 24-bit RGB, bgr != 0 swaps R and B
+	// chroma is taken from nearest sample, full_range != 0 for JPEG range (yuvj420p) sources
+	void (*yuv420p_to_rgb)(const uint8_t* y, int y_stride, const uint8_t* u, int u_stride, const uint8_t* v, int v_stride,
+						   uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range);
+	void (*nv12_to_rgb)(const uint8_t* y, int y_stride, const uint8_t* uv, int uv_stride,
+						uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range);
+
+	// packed 24-bit RGB to luma, weights are scaled so that wr + wg + wb == 256
+	void (*rgb_to_grey)(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride,
+						int width, int height, int wr, int wg, int wb);
+
+	// 2x2 and 4x4 box average with rounding, width and height are output size, channels is 1 or 3
+	void (*box_2x)(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels);
+	void (*box_4x)(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels);
+
+	// copy width x height rectangle at x,y out of src, bpp is bytes per pixel
+	// mono output from YUV sources is just crop of luma plane
+	void (*crop)(const uint8_t* src, int src_stride, int bpp, int x, int y,
+				 uint8_t* dst, int dst_stride, int width, int height);
+	};
+
+// fastest implementation for this CPU
+const struct mt_ffmpeg_stream_kernels* mt_ffmpeg_stream_kernels_get(void);
+
+// plain C reference implementation
+const struct mt_ffmpeg_stream_kernels* mt_ffmpeg_stream_kernels_scalar(void);
+
+// implementation by name, NULL if it isn't compiled in or CPU doesn't support it
+const struct mt_ffmpeg_stream_kernels* mt_ffmpeg_stream_kernels_by_name(const char* name);
+
+// make mt_ffmpeg_stream_kernels_get() return implementation by name from now on, e.g. "scalar" to compare against
+// returns -1 (and changes nothing) if that implementation isn't available
+int mt_ffmpeg_stream_kernels_select(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FFMPEG_STREAM_KERNELS_H
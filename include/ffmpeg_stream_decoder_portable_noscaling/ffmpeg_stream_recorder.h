@@ -0,0 +1,68 @@
+#ifndef FFMPEG_STREAM_RECORDER_H
+#define FFMPEG_STREAM_RECORDER_H
+
+// segmented recording of compressed video as it comes from camera, remuxed into MP4 or MKV files without re-encoding
+// stream decoder feeds it from stream's own thread, all file I/O happens on recorder's own writer thread,
+// so a slow or stalled disk costs recorded packets (counted), never a late frame on the live side
+// every file gets a CSV index next to it (<file>.csv), one line per packet:
+//   pts,pts_time,stamp,receive_time,capture_time,keyframe
+// pts in stream time base and pts_time in seconds are as in the file, times are wall clock seconds (capture_time 0 if unknown),
+// stamp is capture time if known, receive time otherwise, the same rule ffmpeg2ros stamps image headers with
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct AVCodecParameters;
+struct AVPacket;
+struct mt_ffmpeg_stream_recorder;
+
+// counters since recorder was opened
+struct mt_ffmpeg_stream_record_stats
+	{
+	uint64_t packets_written;
+	uint64_t packets_dropped;	// queue full (disk too slow) or write failed, recording resumes at next keyframe
+	uint64_t files;				// segments started
+	};
+
+// path is file name prefix with directory, files are named <path>_YYYYMMDD_HHMMSS_mmm.<format> after local time of
+// their first packet; format is "mp4" or "mkv"; new file starts at first keyframe after segment_seconds (0 = one file
+// per connection); beyond max_files oldest ones are deleted with their index (0 = keep all); queue_size packets
+// can wait for writer thread (0 = 1024); returns NULL if recorder can't be set up
+struct mt_ffmpeg_stream_recorder* mt_ffmpeg_stream_recorder_open(const char* path, const char* format,
+																   int segment_seconds, int max_files, int queue_size);
+
+// writes out packets still queued, finishes current file and ends writer thread
+void mt_ffmpeg_stream_recorder_close(struct mt_ffmpeg_stream_recorder* recorder);
+
+// stream (re)connected: packets from now on go to a new file with these stream parameters (copied)
+void mt_ffmpeg_stream_recorder_start(struct mt_ffmpeg_stream_recorder* recorder, const struct AVCodecParameters* par,
+									 int time_base_num, int time_base_den);
+
+// queue new reference to packet, never blocks; times are wall clock in microseconds (capture_time 0 if unknown)
+// returns 0, or -1 if packet was dropped
+int mt_ffmpeg_stream_recorder_write(struct mt_ffmpeg_stream_recorder* recorder, const struct AVPacket* packet,
+									int64_t receive_time, int64_t capture_time);
+
+void mt_ffmpeg_stream_recorder_get_stats(struct mt_ffmpeg_stream_recorder* recorder, struct mt_ffmpeg_stream_record_stats* stats);
+
+// packet with its wall clock times, as kept in pre-event buffer
+struct mt_ffmpeg_stream_record_packet
+	{
+	struct AVPacket* packet;
+	int64_t receive_time;
+	int64_t capture_time;
+	};
+
+// write packets into one file with its index, on calling thread, MKV if file name ends in .mkv, MP4 otherwise
+// file starts at first keyframe; returns packets written, -1 if there is no keyframe or file can't be created
+int mt_ffmpeg_stream_recorder_write_file(const char* filename, const struct AVCodecParameters* par, int time_base_num, int time_base_den,
+										 const struct mt_ffmpeg_stream_record_packet* packets, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FFMPEG_STREAM_RECORDER_H
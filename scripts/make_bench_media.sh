@@ -0,0 +1,35 @@
+#!/bin/sh
+# make_bench_media.sh -local test clips for ffmpeg2ros_bench, made from lavfi testsrc2 with ffmpeg command line tool
+# 720p / 1080p / 4K, H.264 and H.265, several pixel formats, MP4 and MKV containers, 10 s at 30 fps each
+# usage: scripts/make_bench_media.sh [output dir, default bench_media] [seconds, default 10]
+# then:  ffmpeg2ros_bench bench_media/*
+
+OUT=${1:-bench_media}
+DURATION=${2:-10}
+GOP=30		# keyframe every second, like a typical IP camera
+
+command -v ffmpeg >/dev/null 2>&1 || { echo "ffmpeg command line tool not found"; exit 1; }
+mkdir -p "$OUT"
+
+# args: size codec encoder pix_fmt container
+make_clip() {
+	file="$OUT/testsrc2_$1_$2_$4.$5"
+	if [ -f "$file" ]; then
+		echo "$file exists, skipped"
+		return
+	fi
+	echo "making $file"
+	ffmpeg -hide_banner -loglevel error -y -f lavfi -i "testsrc2=size=$1:rate=30:duration=$DURATION" \
+		-c:v "$3" -pix_fmt "$4" -g $GOP -bf 0 -preset veryfast "$file" || echo "  failed, encoder $3 or format $4 missing?"
+}
+
+for size in 1280x720 1920x1080 3840x2160; do
+	make_clip $size h264 libx264 yuv420p mp4
+	make_clip $size hevc libx265 yuv420p mkv
+done
+
+# other pixel formats at 1080p: full range (JPEG) 4:2:0 as many cameras send, 4:2:2 and 4:4:4 take swscale paths
+make_clip 1920x1080 h264 libx264 yuvj420p mp4
+make_clip 1920x1080 h264 libx264 yuv422p mkv
+make_clip 1920x1080 h264 libx264 yuv444p mkv
+make_clip 1920x1080 hevc libx265 yuv420p10le mkv
@@ -0,0 +1,84 @@
+#!/bin/sh
+# rtsp_loopback_test.sh -end to end check of decoder library over RTSP, with synthetic camera instead of a real one
+# ffmpeg2ros_bench listens on local RTSP URL (decoder's listen option), ffmpeg command line tool pushes lavfi test
+# pattern to it in real time, the way a camera would stream it
+#  1. static colour bars, lossless H.264: every frame must match checksum of same clip decoded from local file
+#  2. moving testsrc2 720p30: frame count, size, sustained frames/s and CPU budget per frame
+#  3. sender killed midway and started again: decoder has to reconnect and carry on
+# usage: scripts/rtsp_loopback_test.sh [path to ffmpeg2ros_bench] [port] [CPU ms per frame budget]
+# exits with 1 on first failed step, 0 if all pass
+
+BENCH=${1:-ffmpeg2ros_bench}
+PORT=${2:-8554}
+CPU_BUDGET=${3:-20}
+URL=rtsp://127.0.0.1:$PORT/cam
+TMP=$(mktemp -d)
+SENDER=
+
+cleanup() {
+	[ -n "$SENDER" ] && kill $SENDER 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAILED: $1"
+	exit 1
+}
+
+command -v ffmpeg >/dev/null 2>&1 || fail "ffmpeg command line tool not found"
+
+# push lavfi graph to listening bench in real time, extra args go to encoder
+push() {
+	graph=$1
+	shift
+	ffmpeg -hide_banner -loglevel error -re -f lavfi -i "$graph" -c:v libx264 -g 30 -bf 0 "$@" \
+		-f rtsp -rtsp_transport tcp "$URL" &
+	SENDER=$!
+}
+
+# start bench listening with given args, give it a moment to bind port before sender connects
+listen() {
+	"$BENCH" listen modes=rgb8 "$@" "$URL" > "$TMP/bench.txt" 2>&1 &
+	BENCH_PID=$!
+	sleep 1
+}
+
+finish() {
+	wait $BENCH_PID
+	status=$?
+	cat "$TMP/bench.txt"
+	wait $SENDER 2>/dev/null
+	SENDER=
+	[ $status -eq 0 ] || fail "$1"
+}
+
+echo "== 1. pixel checksums"
+BARS="smptehdbars=size=1280x720:rate=30"
+ffmpeg -hide_banner -loglevel error -y -f lavfi -i "$BARS:duration=2" -c:v libx264 -g 30 -bf 0 -qp 0 -pix_fmt yuv420p \
+	"$TMP/bars.mkv" || fail "can't make reference clip, libx264 missing?"
+REF=$("$BENCH" csv checksum modes=rgb8 "$TMP/bars.mkv" | awk -F, 'NR==1{for(i=1;i<=NF;i++) if($i=="checksum") c=i} NR==2{print $c}')
+[ -n "$REF" ] && [ "$REF" != "0" ] || fail "no reference checksum from file"
+echo "reference checksum $REF"
+listen reconnect=0 expect_checksum=$REF expect_frames=60 expect_size=1280x720
+push "$BARS" -t 3 -qp 0 -pix_fmt yuv420p
+finish "checksums over RTSP differ from file"
+
+echo "== 2. sustained frame rate under CPU budget"
+listen reconnect=0 expect_frames=250 expect_size=1280x720 min_fps=27 max_cpu_ms=$CPU_BUDGET
+push "testsrc2=size=1280x720:rate=30" -t 10 -preset ultrafast -tune zerolatency -pix_fmt yuv420p
+finish "frame count, rate or CPU budget"
+
+echo "== 3. reconnect after sender is lost"
+START=$(date +%s)
+listen reconnect=1 frames=200 expect_frames=150 expect_reconnects=1
+push "testsrc2=size=1280x720:rate=30" -preset ultrafast -tune zerolatency -pix_fmt yuv420p
+sleep 4
+kill -9 $SENDER
+wait $SENDER 2>/dev/null
+sleep 1		# bench notices lost connection and listens again
+push "testsrc2=size=1280x720:rate=30" -t 8 -preset ultrafast -tune zerolatency -pix_fmt yuv420p
+finish "no recovery after sender came back"
+[ $(( $(date +%s) - START )) -lt 30 ] || fail "recovery took too long"
+
+echo "all loopback checks passed"
@@ -0,0 +1,513 @@
+// ffmpeg2ros_bench.c -offline benchmark of the decoder library, needs neither ROS nor network
+// drives mt_ffmpeg_stream_decoder_* the way ffmpeg2ros node does (wait for frame, acquire, convert into freshly
+// allocated buffer, release) against local files and lavfi test sources, once per output mode
+// for every run it prints decoded and converted frames/s, CPU time per frame, memory and per-stage latency,
+// so changes to conversion and copy paths can be compared on any Linux box
+//
+// usage: ffmpeg2ros_bench [key=value ...] input [input ...]
+//   input				file path (scripts/make_bench_media.sh makes a set) or lavfi:<filter graph>, e.g.
+//						lavfi:testsrc2=size=1920x1080:rate=30:duration=10,format=yuv420p
+//   modes=rgb8,mono8,half	output modes each input is run with, default these three, bgr8, uyvy, yuyv and nv12 on request
+//   frames=N			stop after N decoded frames, 0 = run to end of input (default), endless lavfi graphs need duration= then
+//   kernels=NAME		pixel kernel set: scalar, sse2, avx2 or neon, default is fastest one for this CPU
+//   threads=N			decoder threads, 0 = one per CPU core (default)
+//   decode_workers=N	shared decode pool like node's, -1 = off (default), 0 = one thread per core
+//   reconnect=0|1		reopen lost input, default only for network URLs (as in library), then frames= or checks end run
+//   keep_all			every decoded frame is converted, decoder waits for conversion instead of overwriting frames
+//   listen				wait for a sender to push to input URL (e.g. ffmpeg -f rtsp), see scripts/rtsp_loopback_test.sh
+//   checksum			Adler-32 of every converted frame, reports first one and how many frames differ from it
+//   csv				print comma separated values instead of table
+//
+// checks, exit status is 2 if any run fails one:
+//   expect_frames=N	at least N frames converted
+//   expect_size=WxH	output size
+//   min_fps=F			converted frames/s at least F
+//   max_cpu_ms=T		process CPU time per decoded frame at most T ms
+//   expect_checksum=X	every converted frame has this (hex) checksum, static patterns through lossless codec only
+//   expect_reconnects=N	at least N reconnect attempts, for tests that cut connection on purpose
+// stalled input (nothing for 10 s) fails too
+//
+// files are read as fast as decoder goes, so decoded frames/s is decoder throughput; converted frames/s lower than that
+// means conversion (main thread) can't keep up and frames got overwritten, as they would be on a live camera
+// frames/s count from first frame on, time to connect and probe is reported separately
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <libavutil/time.h>
+#ifdef HAVE_AVDEVICE
+ #include <libavdevice/avdevice.h>
+#endif
+
+#include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_decoder_portable_noscaling.h"
+#include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_kernels.h"
+
+#define MAX_INPUTS 64
+#define STALL_TIMEOUT_MS 10000		// give up on input that delivers nothing for this long
+
+// output modes, same as node's rgb8 / mono8 (grey) / half topics and its other format= values
+struct bench_mode
+	{
+	const char* name;
+	int format;
+	double scale;
+	int scale_filter;
+	int by_default;		// run when modes= isn't given
+	};
+
+static const struct bench_mode bench_modes[] =
+	{
+	{ "rgb8",	FFMPEG_STREAM_FORMAT_RGB24,	0.0, FFMPEG_STREAM_SCALE_FAST_BILINEAR, 1 },
+	{ "mono8",	FFMPEG_STREAM_FORMAT_GREY,	0.0, FFMPEG_STREAM_SCALE_FAST_BILINEAR, 1 },
+	{ "half",	FFMPEG_STREAM_FORMAT_RGB24,	0.5, FFMPEG_STREAM_SCALE_AREA, 1 },
+	{ "bgr8",	FFMPEG_STREAM_FORMAT_BGR24,	0.0, FFMPEG_STREAM_SCALE_FAST_BILINEAR, 0 },
+	{ "uyvy",	FFMPEG_STREAM_FORMAT_UYVY,	0.0, FFMPEG_STREAM_SCALE_FAST_BILINEAR, 0 },
+	{ "yuyv",	FFMPEG_STREAM_FORMAT_YUYV,	0.0, FFMPEG_STREAM_SCALE_FAST_BILINEAR, 0 },
+	{ "nv12",	FFMPEG_STREAM_FORMAT_NV12,	0.0, FFMPEG_STREAM_SCALE_FAST_BILINEAR, 0 },
+	};
+
+#define NUM_BENCH_MODES ((int)(sizeof(bench_modes) / sizeof(bench_modes[0])))
+
+static const char* stage_names[FFMPEG_STREAM_STAGES] = { "demux", "decode", "handoff", "convert", "postprocess", "publish" };
+
+// stages that get a column, publish is never used here
+#define REPORTED_STAGES FFMPEG_STREAM_STAGE_PUBLISH
+
+// pass / fail limits, 0 = not checked
+struct bench_checks
+	{
+	long frames;
+	int width, height;
+	double min_fps;
+	double max_cpu_ms;
+	long reconnects;
+	int has_checksum;
+	uint32_t checksum;
+	};
+
+struct bench_result
+	{
+	int width, height;
+	int opened;
+	int stalled;						// gave up waiting, sender is stuck or gone without closing connection
+	uint32_t checksum;					// of first converted frame, if asked for
+	long checksum_mismatches;			// frames after it with different checksum
+	double seconds;						// open to end of input
+	double first_frame_ms;				// open to first converted frame, connection and probing
+	double cpu_seconds;					// user + system time of whole process, decoder threads included
+	double rss_mb;						// largest resident set seen during run
+	struct mt_ffmpeg_stream_stats stats;
+	struct mt_ffmpeg_stream_stage_stats stages[FFMPEG_STREAM_STAGES];
+	};
+
+static double cpu_time()
+	{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	}
+
+// current resident set in MB, Linux only, 0 if unknown
+static double resident_mb()
+	{
+	long size = 0, pages = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+
+	if(f == 0)
+		return 0;
+	if(fscanf(f, "%ld %ld", &size, &pages) != 2)
+		pages = 0;
+	fclose(f);
+	return pages * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+	}
+
+// Adler-32 of image rows, padding excluded
+static uint32_t adler32(const unsigned char* image, int row_bytes, int stride, int height)
+	{
+	uint32_t a = 1, b = 0;
+	int x, y;
+
+	for(y = 0; y < height; y++)
+		{
+		const unsigned char* row = image + (size_t)y * stride;
+		for(x = 0; x < row_bytes; x++)
+			{
+			a = (a + row[x]) % 65521;
+			b = (b + a) % 65521;
+			}
+		}
+	return (b << 16) | a;
+	}
+
+// one input in one output mode, from open to end of input (or frame limit)
+static void bench_run(const char* input, const struct bench_mode* mode, const struct mt_ffmpeg_stream_options* base_options,
+					  long frame_limit, int checksum, struct bench_result* result)
+	{
+	struct mt_ffmpeg_stream_options options = *base_options;
+	struct mt_ffmpeg_stream_output output;
+	const char* uri = input;
+	int handle;
+	int stage;
+	long converted = 0;
+	int64_t start;
+	int64_t last_frame;
+	double cpu_start;
+
+	memset(result, 0, sizeof(*result));
+
+	// lavfi inputs are filter graphs, demuxer can't be guessed from them
+	if(strncmp(input, "lavfi:", 6) == 0)
+		{
+		strcpy(options.input_format, "lavfi");
+		uri = input + 6;
+		}
+
+	cpu_start = cpu_time();
+	start = last_frame = av_gettime_relative();
+
+	handle = mt_ffmpeg_stream_decoder_open_ex(uri, 0, 0, &options);
+	if(handle < 0)
+		return;
+
+	memset(&output, 0, sizeof(output));
+	output.format = mode->format;
+	output.luma_weights = FFMPEG_STREAM_LUMA_BT601;
+	output.scale = mode->scale;
+	output.scale_filter = mode->scale_filter;
+	mt_ffmpeg_stream_decoder_set_output(handle, &output);
+
+	for(;;)
+		{
+		int status = mt_ffmpeg_stream_decoder_wait_frame(handle, 1000);
+
+		if(status == FFMPEG_STREAM_STATUS_NEW_FRAME && mt_ffmpeg_stream_decoder_acquire_frame(handle))
+			{
+			// buffer is allocated and cleared per frame like node's message, that's part of the copy path too
+			int64_t post_start = av_gettime_relative();
+			int width = mt_ffmpeg_stream_decoder_get_frame_width(handle);
+			int height = mt_ffmpeg_stream_decoder_get_frame_height(handle);
+			int stride = mt_ffmpeg_stream_decoder_format_stride(mode->format, width);
+			int rows = mt_ffmpeg_stream_decoder_format_rows(mode->format, height);
+			unsigned char* buf = (unsigned char*)calloc((size_t)stride * rows, 1);
+			mt_ffmpeg_stream_decoder_add_stage_time(handle, FFMPEG_STREAM_STAGE_POSTPROCESS, av_gettime_relative() - post_start);
+
+			if(buf != 0)
+				mt_ffmpeg_stream_decoder_convert_frame(handle, buf, stride);
+			mt_ffmpeg_stream_decoder_release_frame(handle);
+
+			// outside of timed path, any cost here shows up as handoff of next frame
+			if(checksum && buf != 0)
+				{
+				uint32_t sum = adler32(buf, stride, stride, rows);
+				if(converted == 0)
+					result->checksum = sum;
+				else if(sum != result->checksum)
+					result->checksum_mismatches++;
+				}
+			free(buf);
+
+			last_frame = av_gettime_relative();
+			if(result->opened == 0)
+				result->first_frame_ms = (last_frame - start) / 1000.0;
+			result->opened = 1;
+			result->width = width;
+			result->height = height;
+			if(converted++ % 30 == 0)
+				{
+				double rss = resident_mb();
+				if(rss > result->rss_mb)
+					result->rss_mb = rss;
+				}
+			}
+		else if(status == FFMPEG_STREAM_STATUS_ERROR)
+			break;	// end of input, or it couldn't be opened
+		else if(av_gettime_relative() - last_frame > STALL_TIMEOUT_MS * 1000LL)
+			{
+			printf("%s: no frame for %d s, giving up\n", input, STALL_TIMEOUT_MS / 1000);
+			result->stalled = 1;
+			break;
+			}
+
+		mt_ffmpeg_stream_decoder_get_stats(handle, &result->stats);
+		if(frame_limit > 0 && result->stats.frames_decoded >= (uint64_t)frame_limit)
+			break;
+		}
+
+	mt_ffmpeg_stream_decoder_get_stats(handle, &result->stats);
+	for(stage = 0; stage < FFMPEG_STREAM_STAGES; stage++)
+		mt_ffmpeg_stream_decoder_get_stage_stats(handle, stage, &result->stages[stage]);
+	result->seconds = (av_gettime_relative() - start) / 1e6;
+
+	mt_ffmpeg_stream_decoder_close(handle);
+	result->cpu_seconds = cpu_time() - cpu_start;
+	}
+
+static void print_header(int csv)
+	{
+	int stage;
+
+	if(csv)
+		{
+		printf("input,mode,width,height,decoded,converted,overwritten,dropped,reconnects,decoded_fps,converted_fps,cpu_ms_per_frame,rss_mb,first_frame_ms");
+		for(stage = 0; stage < REPORTED_STAGES; stage++)
+			printf(",%s_mean_ms,%s_p50_ms,%s_p99_ms", stage_names[stage], stage_names[stage], stage_names[stage]);
+		printf(",checksum,checksum_mismatches\n");
+		return;
+		}
+
+	printf("%-40s %-5s %9s %6s %6s %6s %8s %8s %7s %7s", "input", "mode", "size", "dec", "conv", "lost", "dec/s", "conv/s", "cpu ms", "rss MB");
+	for(stage = 0; stage < REPORTED_STAGES; stage++)
+		printf(" %13s", stage_names[stage]);
+	printf("\n");
+	printf("%-40s %-5s %9s %6s %6s %6s %8s %8s %7s %7s", "", "", "", "", "", "", "", "", "/frame", "");
+	for(stage = 0; stage < REPORTED_STAGES; stage++)
+		printf(" %13s", "p50/p99 ms");
+	printf("\n");
+	}
+
+// frames/s from first frame on
+static double result_fps(const struct bench_result* r, uint64_t frames)
+	{
+	double active = r->seconds - r->first_frame_ms / 1000.0;
+	return active > 0 ? frames / active : 0;
+	}
+
+static void print_result(int csv, const char* input, const struct bench_mode* mode, const struct bench_result* r)
+	{
+	double decoded_fps = result_fps(r, r->stats.frames_decoded);
+	double converted_fps = result_fps(r, r->stats.frames_acquired);
+	double cpu_ms = r->stats.frames_decoded > 0 ? r->cpu_seconds * 1000.0 / r->stats.frames_decoded : 0;
+	const char* name = input;
+	char text[32];
+	int stage;
+
+	if(!r->opened)
+		{
+		if(csv)
+			{
+			printf("%s,%s,0,0,0,0,0,0,0,0,0,0,0,0", input, mode->name);
+			for(stage = 0; stage < REPORTED_STAGES; stage++)
+				printf(",0,0,0");
+			printf(",0,0\n");
+			}
+		else
+			printf("%-40s %-5s failed to open or decode\n", input, mode->name);
+		return;
+		}
+
+	if(csv)
+		{
+		printf("%s,%s,%d,%d,%llu,%llu,%llu,%llu,%llu,%.1f,%.1f,%.3f,%.1f,%.1f", input, mode->name, r->width, r->height,
+			   (unsigned long long)r->stats.frames_decoded, (unsigned long long)r->stats.frames_acquired,
+			   (unsigned long long)r->stats.frames_overwritten, (unsigned long long)r->stats.frames_dropped,
+			   (unsigned long long)r->stats.reconnects,
+			   decoded_fps, converted_fps, cpu_ms, r->rss_mb, r->first_frame_ms);
+		for(stage = 0; stage < REPORTED_STAGES; stage++)
+			{
+			const struct mt_ffmpeg_stream_stage_stats* s = &r->stages[stage];
+			printf(",%.3f,%.3f,%.3f", s->count ? s->total_us / 1000.0 / s->count : 0.0,
+				   mt_ffmpeg_stream_decoder_stage_percentile(s, 0.5) / 1000.0, mt_ffmpeg_stream_decoder_stage_percentile(s, 0.99) / 1000.0);
+			}
+		printf(",%08x,%ld\n", r->checksum, r->checksum_mismatches);
+		return;
+		}
+
+	// long paths keep their end, that's where resolution and codec are
+	if(strlen(name) > 40)
+		name += strlen(name) - 40;
+	snprintf(text, sizeof(text), "%dx%d", r->width, r->height);
+	printf("%-40s %-5s %9s %6llu %6llu %6llu %8.1f %8.1f %7.2f %7.1f", name, mode->name, text,
+		   (unsigned long long)r->stats.frames_decoded, (unsigned long long)r->stats.frames_acquired,
+		   (unsigned long long)(r->stats.frames_overwritten + r->stats.frames_dropped),
+		   decoded_fps, converted_fps, cpu_ms, r->rss_mb);
+	for(stage = 0; stage < REPORTED_STAGES; stage++)
+		{
+		snprintf(text, sizeof(text), "%.2f/%.2f", mt_ffmpeg_stream_decoder_stage_percentile(&r->stages[stage], 0.5) / 1000.0,
+				 mt_ffmpeg_stream_decoder_stage_percentile(&r->stages[stage], 0.99) / 1000.0);
+		printf(" %13s", text);
+		}
+	printf("\n");
+	if(r->checksum != 0)
+		printf("%-40s %-5s checksum %08x, %ld frames differ\n", "", mode->name, r->checksum, r->checksum_mismatches);
+	}
+
+// returns number of failed checks, each one is printed
+static int check_result(const struct bench_checks* checks, const char* input, const struct bench_mode* mode, const struct bench_result* r)
+	{
+	double converted_fps = result_fps(r, r->stats.frames_acquired);
+	double cpu_ms = r->stats.frames_decoded > 0 ? r->cpu_seconds * 1000.0 / r->stats.frames_decoded : 0;
+	int failed = 0;
+
+	if(r->stalled)
+		{
+		printf("FAIL %s %s: stalled\n", input, mode->name);
+		failed++;
+		}
+	if(checks->frames > 0 && r->stats.frames_acquired < (uint64_t)checks->frames)
+		{
+		printf("FAIL %s %s: %llu frames converted, expected at least %ld\n", input, mode->name,
+			   (unsigned long long)r->stats.frames_acquired, checks->frames);
+		failed++;
+		}
+	if(checks->width > 0 && (r->width != checks->width || r->height != checks->height))
+		{
+		printf("FAIL %s %s: size %dx%d, expected %dx%d\n", input, mode->name, r->width, r->height, checks->width, checks->height);
+		failed++;
+		}
+	if(checks->min_fps > 0 && converted_fps < checks->min_fps)
+		{
+		printf("FAIL %s %s: %.1f frames/s, expected at least %.1f\n", input, mode->name, converted_fps, checks->min_fps);
+		failed++;
+		}
+	if(checks->max_cpu_ms > 0 && cpu_ms > checks->max_cpu_ms)
+		{
+		printf("FAIL %s %s: %.2f ms CPU per frame, budget %.2f\n", input, mode->name, cpu_ms, checks->max_cpu_ms);
+		failed++;
+		}
+	if(checks->reconnects > 0 && r->stats.reconnects < (uint64_t)checks->reconnects)
+		{
+		printf("FAIL %s %s: %llu reconnects, expected at least %ld\n", input, mode->name,
+			   (unsigned long long)r->stats.reconnects, checks->reconnects);
+		failed++;
+		}
+	if(checks->has_checksum && (r->checksum != checks->checksum || r->checksum_mismatches > 0 || !r->opened))
+		{
+		printf("FAIL %s %s: checksum %08x with %ld frames differing, expected %08x on every frame\n", input, mode->name,
+			   r->checksum, r->checksum_mismatches, checks->checksum);
+		failed++;
+		}
+	return failed;
+	}
+
+int main(int argc, char** argv)
+	{
+	const char* inputs[MAX_INPUTS];
+	int num_inputs = 0;
+	int use_mode[NUM_BENCH_MODES];
+	struct mt_ffmpeg_stream_options options;
+	struct bench_checks checks;
+	long frame_limit = 0;
+	int decode_workers = -1;
+	int checksum = 0;
+	int csv = 0;
+	int failed = 0;
+	int i, m;
+
+	memset(&checks, 0, sizeof(checks));
+	mt_ffmpeg_stream_decoder_default_options(&options);
+	for(m = 0; m < NUM_BENCH_MODES; m++)
+		use_mode[m] = bench_modes[m].by_default;
+
+	for(i = 1; i < argc; i++)
+		{
+		const char* arg = argv[i];
+		const char* eq = strchr(arg, '=');
+		const char* value = eq ? eq + 1 : "";
+
+		// lavfi graphs have '=' in them too, but start with their prefix
+		if(eq != 0 && strncmp(arg, "lavfi:", 6) != 0)
+			{
+			if(strncmp(arg, "modes=", 6) == 0)
+				{
+				for(m = 0; m < NUM_BENCH_MODES; m++)
+					{
+					const char* p = strstr(value, bench_modes[m].name);
+					size_t len = strlen(bench_modes[m].name);
+					use_mode[m] = p != 0 && (p == value || p[-1] == ',') && (p[len] == 0 || p[len] == ',');
+					}
+				}
+			else if(strncmp(arg, "frames=", 7) == 0)
+				frame_limit = atol(value);
+			else if(strncmp(arg, "kernels=", 8) == 0)
+				{
+				if(mt_ffmpeg_stream_kernels_select(value) < 0)
+					{
+					printf("kernels '%s' not available on this CPU or build\n", value);
+					return 1;
+					}
+				}
+			else if(strncmp(arg, "threads=", 8) == 0)
+				options.thread_count = atoi(value);
+			else if(strncmp(arg, "decode_workers=", 15) == 0)
+				decode_workers = atoi(value);
+			else if(strncmp(arg, "reconnect=", 10) == 0)
+				options.reconnect = atoi(value);
+			else if(strncmp(arg, "expect_reconnects=", 18) == 0)
+				checks.reconnects = atol(value);
+			else if(strncmp(arg, "expect_frames=", 14) == 0)
+				checks.frames = atol(value);
+			else if(strncmp(arg, "expect_size=", 12) == 0)
+				sscanf(value, "%dx%d", &checks.width, &checks.height);
+			else if(strncmp(arg, "min_fps=", 8) == 0)
+				checks.min_fps = atof(value);
+			else if(strncmp(arg, "max_cpu_ms=", 11) == 0)
+				checks.max_cpu_ms = atof(value);
+			else if(strncmp(arg, "expect_checksum=", 16) == 0)
+				{
+				checks.has_checksum = 1;
+				checks.checksum = (uint32_t)strtoul(value, 0, 16);
+				checksum = 1;
+				}
+			else
+				{
+				printf("unknown arg %s\n", arg);
+				return 1;
+				}
+			}
+		else if(strcmp(arg, "csv") == 0)
+			csv = 1;
+		else if(strcmp(arg, "checksum") == 0)
+			checksum = 1;
+		else if(strcmp(arg, "listen") == 0)
+			options.listen = 1;
+		else if(strcmp(arg, "keep_all") == 0)
+			options.keep_all_frames = 1;
+		else if(num_inputs < MAX_INPUTS)
+			inputs[num_inputs++] = arg;
+		}
+
+	if(num_inputs == 0)
+		{
+		printf("usage: %s [modes=rgb8,mono8,half,bgr8,uyvy,yuyv,nv12] [frames=N] [kernels=scalar|sse2|avx2|neon] [threads=N] [decode_workers=N]\n"
+			   "       [reconnect=0|1] [listen] [keep_all] [checksum] [csv] [expect_frames=N] [expect_reconnects=N] [expect_size=WxH] [min_fps=F] [max_cpu_ms=T] [expect_checksum=X]\n"
+			   "       input [input ...]\n"
+			   "input is a video file or lavfi:<graph>, e.g. lavfi:testsrc2=size=1280x720:rate=30:duration=10,format=yuv420p\n", argv[0]);
+		return 1;
+		}
+
+#ifdef HAVE_AVDEVICE
+	avdevice_register_all();	// lavfi input lives in libavdevice
+#endif
+
+	mt_ffmpeg_stream_decoder_init();
+	if(decode_workers >= 0)
+		printf("decode pool of %d threads\n", mt_ffmpeg_stream_decoder_start_pool(decode_workers));
+
+	if(!csv)
+		printf("pixel kernels: %s, decoder threads: %d (0 = one per core), frame limit: %ld (0 = whole input)\n",
+			   mt_ffmpeg_stream_kernels_get()->name, options.thread_count, frame_limit);
+	print_header(csv);
+
+	// one stream at a time, so figures aren't shared between runs
+	for(i = 0; i < num_inputs; i++)
+		{
+		for(m = 0; m < NUM_BENCH_MODES; m++)
+			{
+			struct bench_result result;
+			if(!use_mode[m])
+				continue;
+			bench_run(inputs[i], &bench_modes[m], &options, frame_limit, checksum, &result);
+			print_result(csv, inputs[i], &bench_modes[m], &result);
+			failed += check_result(&checks, inputs[i], &bench_modes[m], &result);
+			fflush(stdout);
+			}
+		}
+
+	mt_ffmpeg_stream_decoder_done();
+
+	return failed > 0 ? 2 : 0;
+	}
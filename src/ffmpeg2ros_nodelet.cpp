@@ -0,0 +1,43 @@
+//ffmpeg2ros_nodelet.cpp -ffmpeg2ros as nodelet, load it into the manager of image consumers:
+//									rosrun nodelet nodelet load ffmpeg2ros/ffmpeg2ros <manager> [args like grey half ...]
+//									images then reach nodelets in the same manager as shared pointers, no serialization or copy
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <boost/thread.hpp>
+#include "ffmpeg2ros/stream_publisher.h"
+
+namespace ffmpeg2ros
+{
+
+class Ffmpeg2RosNodelet : public nodelet::Nodelet
+	{
+public:
+	virtual ~Ffmpeg2RosNodelet()
+		{
+		publisher.stop();
+		if(thread)
+			thread->join();
+		publisher.close();
+		}
+
+private:
+	//onInit() must return quickly, so frames are published from our own thread
+	//params come from private namespace of nodelet, topics go under its namespace (absolute ns values ignore it)
+	virtual void onInit()
+		{
+		if(!publisher.start(getNodeHandle(),getPrivateNodeHandle(),getMyArgv()))
+			{
+			NODELET_ERROR("no stream could be opened");
+			return;
+			}
+		thread.reset(new boost::thread(boost::bind(&StreamPublisher::run,&publisher)));
+		}
+
+	StreamPublisher publisher;
+	boost::shared_ptr<boost::thread> thread;
+	};
+
+} //namespace ffmpeg2ros
+
+PLUGINLIB_EXPORT_CLASS(ffmpeg2ros::Ffmpeg2RosNodelet, nodelet::Nodelet)
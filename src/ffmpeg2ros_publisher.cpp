@@ -0,0 +1,1232 @@
+//ffmpeg2ros_publisher.cpp -receives IP video streams and publishes them as sensor_msgs/Image
+//									moved out of ffmpeg2ros_rev3.cpp main() so the same code runs as standalone node and as nodelet
+
+#include "ffmpeg2ros/stream_publisher.h"
+#include "sensor_msgs/Image.h"
+#include "ffmpeg2ros/VideoPacket.h"
+#include "ffmpeg2ros/FrameLatency.h"
+#include "ffmpeg2ros/ShmImage.h"
+#include "diagnostic_msgs/DiagnosticArray.h"
+#include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_kernels.h"
+#include <string.h>
+#include <time.h>
+
+extern "C" {
+			  #include <libavutil/time.h>
+			  }
+
+namespace ffmpeg2ros
+{
+
+//header stamp for frame or packet: camera's capture time mapped to wall clock by RTCP sender reports,
+//time packet came from network until camera sent first report (or if it never does), publish time if neither is known
+static ros::Time stamp_from_times(const struct mt_ffmpeg_stream_frame_times& times)
+{
+int64_t us=times.capture_time>0 ? times.capture_time : times.receive_time;
+if(us<=0)
+	us=av_gettime();
+ros::Time stamp;
+stamp.fromNSec(us*1000);
+return stamp;
+}
+
+//format= values, first entry is default; YUV ones keep decoder's samples and skip colour conversion
+static const output_format output_formats[]=
+	{
+	{"rgb8",		FFMPEG_STREAM_FORMAT_RGB24,	"rgb8",			"/rgb"},
+	{"mono8",	FFMPEG_STREAM_FORMAT_GREY,		"mono8",			"/grey"},
+	{"bgr8",		FFMPEG_STREAM_FORMAT_BGR24,	"bgr8",			"/bgr"},
+	{"uyvy",		FFMPEG_STREAM_FORMAT_UYVY,		"yuv422",		"/yuv422"},
+	{"yuyv",		FFMPEG_STREAM_FORMAT_YUYV,		"yuv422_yuy2",	"/yuyv"},
+	{"nv12",		FFMPEG_STREAM_FORMAT_NV12,		"nv12",			"/nv12"},
+	};
+
+const output_format& find_output_format(int format)
+{
+for(size_t i=0;i<sizeof(output_formats)/sizeof(output_formats[0]);i++)
+	if(output_formats[i].format==format)
+		return output_formats[i];
+return output_formats[0];
+}
+
+//defaults for every stream, before command line and per-stream parameters are applied
+void init_camera_stream(camera_stream* s)
+{
+s->format=FFMPEG_STREAM_FORMAT_RGB24;
+s->full_halfbar=1;
+s->bt709=0;
+s->scale=0.0;
+s->size_w=s->size_h=0;
+s->scale_filter=-1;
+s->crop_x=s->crop_y=s->crop_w=s->crop_h=0;
+s->topic.clear();
+s->outputs.clear();
+mt_ffmpeg_stream_decoder_default_options(&s->options);
+s->idle_decode=FFMPEG_STREAM_DECODE_NONE;
+s->max_rate=0.0;
+s->adaptive=1;
+s->queue_size=0;
+s->shm=0;
+s->shm_slots=4;
+s->handle=-1;
+s->seq=0;
+s->latency_frames=s->glass_frames=0;
+s->receive_sum=s->receive_max=s->glass_sum=s->glass_max=0;
+memset(s->stage_prev,0,sizeof(s->stage_prev));
+s->reconnects_seen=0;
+s->not_recorded_seen=0;
+s->error_warned=0.0;
+s->next_publish=0.0;
+s->rate_limited=0;
+s->shedding=false;
+s->adapt_time=s->calm_since=0.0;
+s->overwritten_seen=s->acquired_seen=s->limited_seen=0;
+}
+
+//apply one setting, given as command line arg (key or key=value) or as member of a ~streams entry
+//returns 0 if key isn't known
+int parse_stream_arg(camera_stream* s, const char* key, const char* value)
+{
+if((strcmp(key,"grey")==0)||(strcmp(key,"GREY")==0))
+	{
+	s->format=FFMPEG_STREAM_FORMAT_GREY;
+	printf("command line arg GREY detected\n");
+	}
+else if(strcmp(key,"format")==0)	//format=rgb8|bgr8|mono8|uyvy|yuyv|nv12, older rgb, grey, mono and yuv422 still work
+	{
+	if((strcmp(value,"grey")==0)||(strcmp(value,"mono")==0))	s->format=FFMPEG_STREAM_FORMAT_GREY;
+	else if(strcmp(value,"rgb")==0)									s->format=FFMPEG_STREAM_FORMAT_RGB24;
+	else if(strcmp(value,"bgr")==0)									s->format=FFMPEG_STREAM_FORMAT_BGR24;
+	else if(strcmp(value,"yuv422")==0)								s->format=FFMPEG_STREAM_FORMAT_UYVY;
+	else
+		{
+		size_t i;
+		for(i=0;i<sizeof(output_formats)/sizeof(output_formats[0]);i++)
+			if(strcmp(value,output_formats[i].name)==0)
+				break;
+		if(i<sizeof(output_formats)/sizeof(output_formats[0]))	s->format=output_formats[i].format;
+		else printf("unknown format <%s>, expected rgb8, bgr8, mono8, uyvy, yuyv or nv12\n",value);
+		}
+	}
+else if((strcmp(key,"half")==0)||(strcmp(key,"HALF")==0))
+	{
+	s->full_halfbar=0;
+	s->scale=0.5;
+	printf("command line arg HALF detected\n");
+	}
+else if(strcmp(key,"scale")==0)
+	{
+	s->scale=atof(value);
+	if(s->scale!=1.0) s->full_halfbar=0;
+	printf("command line arg SCALE=%g detected\n",s->scale);
+	}
+else if(strcmp(key,"size")==0)
+	{
+	if(sscanf(value,"%dx%d",&s->size_w,&s->size_h)==2)
+		{
+		s->full_halfbar=0;
+		printf("command line arg SIZE=%dx%d detected\n",s->size_w,s->size_h);
+		}
+	}
+else if(strcmp(key,"filter")==0)
+	{
+	if(strcmp(value,"fast_bilinear")==0)	s->scale_filter=FFMPEG_STREAM_SCALE_FAST_BILINEAR;
+	else if(strcmp(value,"bilinear")==0)	s->scale_filter=FFMPEG_STREAM_SCALE_BILINEAR;
+	else if(strcmp(value,"area")==0)		s->scale_filter=FFMPEG_STREAM_SCALE_AREA;
+	else if(strcmp(value,"point")==0)		s->scale_filter=FFMPEG_STREAM_SCALE_POINT;
+	else if(strcmp(value,"bicubic")==0)	s->scale_filter=FFMPEG_STREAM_SCALE_BICUBIC;
+	else printf("unknown filter <%s>, expected fast_bilinear, bilinear, area, point or bicubic\n",value);
+	}
+else if(strcmp(key,"crop")==0)	//crop=x,y,w,h of native picture, size/scale/half then apply to that rectangle
+	{
+	if(sscanf(value,"%d,%d,%d,%d",&s->crop_x,&s->crop_y,&s->crop_w,&s->crop_h)==4)
+		printf("command line arg CROP=%d,%d,%d,%d detected\n",s->crop_x,s->crop_y,s->crop_w,s->crop_h);
+	else
+		printf("unknown crop <%s>, expected x,y,w,h\n",value);
+	}
+else if(strcmp(key,"topic")==0)	s->topic=value;	//image topic under ns instead of rgb, grey, ...
+else if((strcmp(key,"bt709")==0)||(strcmp(key,"BT709")==0))
+	{
+	s->bt709=1;
+	printf("command line arg BT709 detected\n");
+	}
+else if(strcmp(key,"threads")==0)
+	{
+	s->options.thread_count=atoi(value);
+	printf("command line arg THREADS=%d detected (0 = one per core)\n",s->options.thread_count);
+	}
+else if(strcmp(key,"thread_type")==0)
+	{
+	if(strcmp(value,"frame")==0)		s->options.thread_type=FFMPEG_STREAM_THREAD_FRAME;
+	else if(strcmp(value,"slice")==0)	s->options.thread_type=FFMPEG_STREAM_THREAD_SLICE;
+	else if(strcmp(value,"auto")==0)	s->options.thread_type=FFMPEG_STREAM_THREAD_DEFAULT;
+	else printf("unknown thread_type <%s>, expected frame, slice or auto\n",value);
+	}
+else if((strcmp(key,"lowlatency")==0)||(strcmp(key,"LOWLATENCY")==0))
+	{
+	s->options.low_latency=1;		//slice threads only, no demuxer buffering, short probing
+	printf("command line arg LOWLATENCY detected\n");
+	}
+else if(strcmp(key,"transport")==0)
+	{
+	if(strcmp(value,"udp")==0)			s->options.transport=FFMPEG_STREAM_TRANSPORT_UDP;
+	else if(strcmp(value,"tcp")==0)	s->options.transport=FFMPEG_STREAM_TRANSPORT_TCP;
+	else printf("unknown transport <%s>, expected udp or tcp\n",value);
+	}
+else if(strcmp(key,"probesize")==0)			s->options.probesize=atoi(value);
+else if(strcmp(key,"analyzeduration")==0)	s->options.analyzeduration=atoi(value);
+else if(strcmp(key,"reorder")==0)			s->options.reorder_queue_size=atoi(value);
+else if(strcmp(key,"max_delay")==0)			s->options.max_delay=atoi(value);
+else if(strcmp(key,"reconnect")==0)			s->options.reconnect=atoi(value);			//0 = stay in error state when stream is lost
+else if(strcmp(key,"reconnect_delay")==0)	s->options.reconnect_delay_ms=atoi(value);	//milliseconds before first attempt
+else if(strcmp(key,"reconnect_max")==0)		s->options.reconnect_max_delay_ms=atoi(value);	//backoff limit
+else if(strcmp(key,"io_timeout")==0)		s->options.io_timeout_ms=atoi(value);		//milliseconds without data = lost
+else if((strcmp(key,"listen")==0)||(strcmp(key,"LISTEN")==0))
+	{
+	s->options.listen=1;			//uri is where we wait for sender, e.g. ffmpeg -f rtsp rtsp://<this host>:8554/cam
+	printf("command line arg LISTEN detected\n");
+	}
+else if(strcmp(key,"codec")==0)	//e.g. codec=h264, skips stream probing
+	{
+	strncpy(s->options.codec_name,value,sizeof(s->options.codec_name)-1);
+	printf("command line arg CODEC=%s detected\n",s->options.codec_name);
+	}
+else if((strcmp(key,"keep_all")==0)||(strcmp(key,"KEEP_ALL")==0))
+	{
+	s->options.keep_all_frames=1;	//publish every decoded frame, decoder waits for us instead of overwriting (recording)
+	printf("command line arg KEEP_ALL detected\n");
+	}
+else if((strcmp(key,"passthrough")==0)||(strcmp(key,"PASSTHROUGH")==0))
+	{
+	s->options.passthrough=1;		//no decoding, camera's H.264/H.265 packets go to <ns>/packets
+	printf("command line arg PASSTHROUGH detected\n");
+	}
+else if(strcmp(key,"idle")==0)	//what decoder does while nobody subscribes
+	{
+	if(strcmp(value,"none")==0)				s->idle_decode=FFMPEG_STREAM_DECODE_NONE;		//just keep connection
+	else if(strcmp(value,"keyframes")==0)	s->idle_decode=FFMPEG_STREAM_DECODE_KEYFRAMES;	//recent frame ready for new subscriber
+	else if(strcmp(value,"all")==0)			s->idle_decode=FFMPEG_STREAM_DECODE_ALL;
+	else printf("unknown idle <%s>, expected none, keyframes or all\n",value);
+	}
+else if(strcmp(key,"max_rate")==0)	//Hz, camera may send faster, extra frames aren't converted
+	{
+	s->max_rate=atof(value);
+	printf("command line arg MAX_RATE=%g detected\n",s->max_rate);
+	}
+else if(strcmp(key,"adaptive")==0)		s->adaptive=atoi(value)!=0;	//0 = always decode every frame, even when we fall behind
+else if(strcmp(key,"queue_size")==0)	s->queue_size=atoi(value);		//images held for slow subscribers
+else if((strcmp(key,"shm")==0)||(strcmp(key,"SHM")==0))	//images for other processes on this host through shared memory
+	{
+	s->shm=(*value==0) ? 1 : atoi(value)!=0;
+	printf("command line arg SHM=%d detected\n",s->shm);
+	}
+else if(strcmp(key,"shm_slots")==0)		s->shm_slots=atoi(value)>2 ? atoi(value) : 2;
+else if(strcmp(key,"record")==0)	//record=/data/rec/cam0 (file name prefix), or directory ending in '/' to name files after ns
+	{
+	snprintf(s->options.record_path,sizeof(s->options.record_path),"%s",value);
+	printf("command line arg RECORD=%s detected\n",s->options.record_path);
+	}
+else if(strcmp(key,"record_format")==0)	snprintf(s->options.record_format,sizeof(s->options.record_format),"%s",value);	//mp4 or mkv
+else if(strcmp(key,"record_segment")==0)	s->options.record_segment_s=atoi(value);	//seconds per file, 0 = one file per connection
+else if(strcmp(key,"record_keep")==0)		s->options.record_max_files=atoi(value);	//newest files kept, 0 = all
+else if(strcmp(key,"preevent")==0)	//seconds of compressed video kept in memory, dumped or replayed on trigger
+	{
+	s->options.preevent_s=atoi(value);
+	printf("command line arg PREEVENT=%d detected\n",s->options.preevent_s);
+	}
+else if(strcmp(key,"preevent_mb")==0)		s->options.preevent_max_kb=atoi(value)*1024;	//memory limit of buffer, 0 = 64 MB
+else if(strcmp(key,"preevent_dir")==0)		s->preevent_dir=value;		//directory of dumps
+else if(strcmp(key,"uri")==0)	s->uri=value;
+else if(strcmp(key,"ns")==0)	s->ns=value;
+else if(strcmp(key,"frame_id")==0)	s->frame_id=value;
+else
+	return 0;
+return 1;
+}
+
+//image output made of stream's format, size and crop settings
+static stream_output make_stream_output(const camera_stream& s)
+{
+stream_output o;
+memset(&o.output,0,sizeof(o.output));
+o.output.format=s.format;
+o.output.luma_weights=s.bt709 ? FFMPEG_STREAM_LUMA_BT709 : FFMPEG_STREAM_LUMA_BT601;
+o.output.width=s.size_w;
+o.output.height=s.size_h;
+o.output.scale=s.scale;
+if(s.scale_filter>=0)	o.output.scale_filter=s.scale_filter;
+else							o.output.scale_filter=s.full_halfbar ? FFMPEG_STREAM_SCALE_FAST_BILINEAR : FFMPEG_STREAM_SCALE_AREA;
+o.output.crop_x=s.crop_x;
+o.output.crop_y=s.crop_y;
+o.output.crop_width=s.crop_w;
+o.output.crop_height=s.crop_h;
+o.topic=s.topic;
+o.width_out=o.height_out=0;
+o.shm_ring=0;
+o.shm_generation=0;
+o.shm_failed_size=0;
+o.shm_retry_time=0.0;
+o.convert_warned=0.0;
+return o;
+}
+
+//apply members of one ~streams entry, e.g. { uri: "rtsp://...", ns: "/cam0", format: grey, scale: 0.5 }
+//true booleans act like bare command line args (half: true), false ones are ignored
+//outputs: [ {crop: "640,360,640,360", topic: gripper}, {half: true, topic: overview} ] makes one image topic per entry
+//from a single decode, each entry starts from stream's own settings
+void parse_stream_param(camera_stream* s, XmlRpc::XmlRpcValue& entry)
+{
+for(XmlRpc::XmlRpcValue::iterator it=entry.begin();it!=entry.end();++it)
+	{
+	char value[256];
+	XmlRpc::XmlRpcValue& v=it->second;
+	value[0]=0;
+	if(it->first=="outputs")
+		continue;
+	switch(v.getType())
+		{
+		case XmlRpc::XmlRpcValue::TypeBoolean:	if(!(bool)v) continue;											break;
+		case XmlRpc::XmlRpcValue::TypeInt:		snprintf(value,sizeof(value),"%d",(int)v);					break;
+		case XmlRpc::XmlRpcValue::TypeDouble:	snprintf(value,sizeof(value),"%g",(double)v);				break;
+		case XmlRpc::XmlRpcValue::TypeString:	snprintf(value,sizeof(value),"%s",((std::string&)v).c_str());	break;
+		default:											continue;
+		}
+	if(!parse_stream_arg(s,it->first.c_str(),value))
+		ROS_WARN("unknown stream parameter <%s>",it->first.c_str());
+	}
+
+if(!entry.hasMember("outputs"))
+	return;
+XmlRpc::XmlRpcValue& list=entry["outputs"];
+if(list.getType()!=XmlRpc::XmlRpcValue::TypeArray)
+	{
+	ROS_WARN("outputs of stream %s is not a list, ignored",s->uri.c_str());
+	return;
+	}
+for(int i=0;i<list.size() && (int)s->outputs.size()<FFMPEG_STREAM_MAX_OUTPUTS;i++)
+	{
+	if(list[i].getType()!=XmlRpc::XmlRpcValue::TypeStruct)
+		continue;
+	camera_stream o=*s;
+	o.outputs.clear();
+	parse_stream_param(&o,list[i]);
+	s->outputs.push_back(make_stream_output(o));
+	}
+}
+
+//somebody wants what this stream publishes
+static bool has_subscribers(const camera_stream& s)
+{
+if(s.options.passthrough)
+	return s.img_pub.getNumSubscribers()>0;
+for(size_t i=0;i<s.outputs.size();i++)
+	if(s.outputs[i].pub.getNumSubscribers()>0 || s.outputs[i].shm_pub.getNumSubscribers()>0)
+		return true;
+return false;
+}
+
+//max_rate pacing, publish slots are one period apart and a frame a little early still takes its slot,
+//so a camera slightly faster than max_rate isn't cut down to every other frame; after a stall slots start over
+static bool publish_due(camera_stream& s)
+{
+if(s.max_rate<=0.0)
+	return true;
+double period=1.0/s.max_rate;
+double now=ros::WallTime::now().toSec();
+if(now<s.next_publish-0.2*period)
+	return false;
+if(now-s.next_publish>period)
+	s.next_publish=now;
+s.next_publish+=period;
+return true;
+}
+
+ConvertWorkers::ConvertWorkers(int count)
+	: jobs(0), generation(0), pending(0), stopping(false)
+{
+	for(int i=0;i<count;i++)
+		threads.push_back(std::thread(&ConvertWorkers::work,this,(size_t)i));
+}
+
+ConvertWorkers::~ConvertWorkers()
+{
+	{
+	std::lock_guard<std::mutex> lock(mutex);
+	stopping=true;
+	}
+	wake.notify_all();
+	for(size_t i=0;i<threads.size();i++)
+		threads[i].join();
+}
+
+void ConvertWorkers::run(std::vector<convert_job>& frame_jobs)
+{
+	if(frame_jobs.empty())
+		return;
+
+	//only as many workers as there are extra jobs have something to do, others just note the frame
+	int extra=(int)std::min(frame_jobs.size()-1,threads.size());
+	if(extra>0)
+		{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs=&frame_jobs;
+		pending=extra;
+		generation++;
+		}
+	if(extra>0)
+		wake.notify_all();
+
+	convert_job& first=frame_jobs[0];
+	first.result=mt_ffmpeg_stream_decoder_convert_output(first.handle,first.output,first.dst,first.dst_stride);
+
+	if(extra>0)
+		{
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock,[this]{ return pending==0; });
+		jobs=0;
+		}
+}
+
+void ConvertWorkers::work(size_t index)
+{
+	uint64_t seen=0;
+	std::unique_lock<std::mutex> lock(mutex);
+
+	for(;;)
+		{
+		wake.wait(lock,[&]{ return stopping || generation!=seen; });
+		if(stopping)
+			return;
+		seen=generation;
+		if(jobs==0 || index+1>=jobs->size())
+			continue;
+
+		convert_job& job=(*jobs)[index+1];
+		lock.unlock();
+		job.result=mt_ffmpeg_stream_decoder_convert_output(job.handle,job.output,job.dst,job.dst_stride);
+		lock.lock();
+		if(--pending==0)
+			done.notify_one();
+		}
+}
+
+StreamPublisher::StreamPublisher()
+	: stopping(false), started(false)
+{
+}
+
+StreamPublisher::~StreamPublisher()
+{
+close();
+}
+
+bool StreamPublisher::start(ros::NodeHandle& n, ros::NodeHandle& pn, const std::vector<std::string>& args)
+{
+	camera_stream defaults;
+	int decode_workers=-1;	//-1 = each stream decodes in its own thread, 0 = shared pool with one thread per core
+
+	//conventional (not ROS) command line params, they are defaults for all streams
+	init_camera_stream(&defaults);
+	//strcpy(rtsp_stream_address, "rtsp://192.168.0.164:554/live/av0");
+	//strcpy(rtsp_stream_address,"rtsp://10.0.0.67:554/user=admin_password=ssafd4F_channel=0_stream=1.sdp?real_stream");
+	//strcpy(rtsp_stream_address,"rtsp://10.0.0.204:554/user=admin_password=ssafd4F_channel=0_stream=0.sdp?real_stream");
+	defaults.uri="rtsp://192.168.1.11:8554/inhand";
+	defaults.ns="/ffmpeg2ros";
+	for(size_t i=0;i<args.size();i++)
+		{
+		char key[64];
+		const char* arg=args[i].c_str();
+		const char* eq=strchr(arg,'=');
+		int len=eq ? (int)(eq-arg) : (int)strlen(arg);
+		if(len>=(int)sizeof(key)) len=sizeof(key)-1;
+		memcpy(key,arg,len);
+		key[len]=0;
+		if(strcmp(key,"decode_workers")==0)
+			{
+			decode_workers=atoi(eq ? eq+1 : "0");
+			printf("command line arg DECODE_WORKERS=%d detected (0 = one per core)\n",decode_workers);
+			}
+		else if(!parse_stream_arg(&defaults,key,eq ? eq+1 : ""))
+			printf("unknown command line arg <%s>\n",arg);
+		}
+
+	//one process serves all cameras, each stream has its own reading thread inside decoder library
+	//decoding runs there too, or in a shared pool sized to CPU cores if decode_workers is given
+	pn.param("decode_workers",decode_workers,decode_workers);
+	XmlRpc::XmlRpcValue stream_list;
+	if(pn.getParam("streams",stream_list) && stream_list.getType()==XmlRpc::XmlRpcValue::TypeArray)
+		{
+		for(int i=0;i<stream_list.size();i++)
+			{
+			camera_stream s=defaults;
+			char ns[64];
+			snprintf(ns,sizeof(ns),"/ffmpeg2ros/stream%d",i);
+			s.ns=ns;
+			if(stream_list[i].getType()==XmlRpc::XmlRpcValue::TypeString)
+				s.uri=(std::string&)stream_list[i];		//plain list of URIs
+			else if(stream_list[i].getType()==XmlRpc::XmlRpcValue::TypeStruct)
+				parse_stream_param(&s,stream_list[i]);
+			else
+				{
+				ROS_WARN("~streams[%d] is neither URI nor struct, skipped",i);
+				continue;
+				}
+			streams.push_back(s);
+			}
+		}
+	else
+		streams.push_back(defaults);
+
+	diag_pub = n.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics",10);
+
+	//decoder library is shared by everyone in this process (other nodelets too), init() and done() are counted
+	mt_ffmpeg_stream_decoder_init();
+	started=true;
+	if(decode_workers>=0)
+		ROS_INFO("decoding %d streams on %d shared threads",(int)streams.size(),mt_ffmpeg_stream_decoder_start_pool(decode_workers));
+
+	for(size_t k=0;k<streams.size();k++)
+		{
+		camera_stream& s=streams[k];
+
+		//record=<dir>/ records every stream into that directory, files named after ns (/cam/front -> cam_front_<time>.mp4)
+		size_t record_len=strlen(s.options.record_path);
+		if(record_len>0 && s.options.record_path[record_len-1]=='/')
+			{
+			std::string name=(!s.ns.empty() && s.ns[0]=='/') ? s.ns.substr(1) : s.ns;
+			for(size_t i=0;i<name.size();i++)
+				if(name[i]=='/') name[i]='_';
+			std::string path=std::string(s.options.record_path)+(name.empty() ? "stream" : name);
+			snprintf(s.options.record_path,sizeof(s.options.record_path),"%s",path.c_str());
+			}
+		if(s.options.record_path[0]!=0)
+			printf(" %s: recording to %s_*.%s\n",s.uri.c_str(),s.options.record_path,s.options.record_format);
+
+		s.handle=mt_ffmpeg_stream_decoder_open_ex(s.uri.c_str(),0,0,&s.options);
+		if(s.handle<0)
+			{
+			ROS_ERROR("can't open stream %s, out of decoder handles",s.uri.c_str());
+			continue;
+			}
+		handles.push_back(s.handle);
+
+		if(s.frame_id.empty())
+			s.frame_id=(!s.ns.empty() && s.ns[0]=='/') ? s.ns.substr(1) : s.ns;
+
+		//nothing is decoded until somebody subscribes, first subscriber switches decoding on from ROS callback thread
+		//(decoding resumes at next keyframe), run() switches it off again when last one leaves
+		mt_ffmpeg_stream_decoder_set_decode(s.handle,s.idle_decode);
+		ros::SubscriberStatusCallback connect_cb=boost::bind(&mt_ffmpeg_stream_decoder_set_decode,s.handle,FFMPEG_STREAM_DECODE_ALL);
+
+		//compressed packets are published as they come, without decoder, scaling or conversion
+		//queue is deep since subscriber needs every packet between keyframes to decode any of them
+		if(s.options.passthrough)
+			{
+			std::string topic=s.ns+"/packets";
+			s.img_pub = n.advertise<ffmpeg2ros::VideoPacket>(topic,100,connect_cb,ros::SubscriberStatusCallback());
+			printf(" %s: advertising compressed video topic %s\n",s.uri.c_str(),topic.c_str());
+			continue;
+			}
+
+		//grey comes straight from decoded luma plane (or weighted RGB for non-YUV sources), no RGB pass
+		//YUV formats are copied as decoded when layout allows, otherwise swscale repacks them without RGB pass too
+		//any resizing is done by swscale together with colour conversion, area filter averages like the old 2x2 box
+		//several outputs share one decode, crops are read straight out of decoded picture
+		if(s.outputs.empty())
+			s.outputs.push_back(make_stream_output(s));
+		std::vector<struct mt_ffmpeg_stream_output> outputs;
+		for(size_t i=0;i<s.outputs.size();i++)
+			outputs.push_back(s.outputs[i].output);
+		mt_ffmpeg_stream_decoder_set_outputs(s.handle,&outputs[0],(int)outputs.size());
+		if(s.outputs.size()>1)
+			s.workers.reset(new ConvertWorkers((int)s.outputs.size()-1));
+
+		//advertise available topics, by default holding just the latest image for a slow subscriber:
+		//a deeper queue only adds lag, slow subscribers get fewer frames instead (keep_all streams want every one)
+		int queue_size=s.queue_size>0 ? s.queue_size : (s.options.keep_all_frames ? 100 : 1);
+		for(size_t i=0;i<s.outputs.size();i++)
+			{
+			stream_output& o=s.outputs[i];
+			const output_format& format=find_output_format(o.output.format);
+			std::string topic=o.topic.empty() ? s.ns+format.topic : s.ns+"/"+o.topic;
+			o.pub = n.advertise<sensor_msgs::Image>(topic,queue_size,connect_cb,ros::SubscriberStatusCallback());
+			printf(" %s: advertising %s%s %s image topic (video) %s\n",s.uri.c_str(),
+					o.output.crop_width>0 ? "cropped " : "",(o.output.scale>0.0 || o.output.width>0) ? "scaled" : "full size",
+					format.encoding,topic.c_str());
+			//same images for other processes on this host: only descriptors go over ROS, pixels through shared memory
+			if(s.shm)
+				{
+				o.shm_pub = n.advertise<ffmpeg2ros::ShmImage>(topic+"/shm",10,connect_cb,ros::SubscriberStatusCallback());
+				printf(" %s: advertising shared memory descriptors %s/shm\n",s.uri.c_str(),topic.c_str());
+				}
+			}
+		s.latency_pub = n.advertise<ffmpeg2ros::FrameLatency>(s.ns+"/latency",5);
+		}
+
+	//pre-event buffer: dump to file or replay on topic per stream, ~dump_preevent topic dumps all of them at once
+	//(e.g. from a fault monitor), answered on ROS callback threads while run() goes on
+	bool preevent=false;
+	for(size_t k=0;k<streams.size();k++)
+		{
+		camera_stream& s=streams[k];
+		if(s.handle<0 || s.options.preevent_s<=0)
+			continue;
+		preevent=true;
+		//replay is a burst of one buffer's packets, queue takes all of them (ring holds up to 120 per second)
+		s.preevent_pub = n.advertise<ffmpeg2ros::VideoPacket>(s.ns+"/preevent",s.options.preevent_s*120);
+		s.dump_srv = n.advertiseService<std_srvs::Trigger::Request,std_srvs::Trigger::Response>(s.ns+"/dump_preevent",
+						boost::bind(&StreamPublisher::on_dump_preevent,this,k,_1,_2));
+		s.replay_srv = n.advertiseService<std_srvs::Trigger::Request,std_srvs::Trigger::Response>(s.ns+"/replay_preevent",
+						boost::bind(&StreamPublisher::on_replay_preevent,this,k,_1,_2));
+		printf(" %s: keeping last %d s in memory, services %s/dump_preevent and %s/replay_preevent\n",
+				s.uri.c_str(),s.options.preevent_s,s.ns.c_str(),s.ns.c_str());
+		}
+	if(preevent)
+		preevent_sub = pn.subscribe("dump_preevent",1,&StreamPublisher::on_preevent_trigger,this);
+
+	return !handles.empty();
+}
+
+void StreamPublisher::run()
+{
+	//latency is logged every few seconds: network receive to publish always,
+	//camera capture (glass) to publish if RTSP sender reports give it and camera clock is synced with ours
+	ros::WallTime latency_log_time=ros::WallTime::now();
+
+	if(handles.empty())
+		return;
+
+while(ros::ok() && !stopping)
+   {
+   //block until one of our decoder threads signals a new frame, wake up periodically to notice shutdown
+   //streams of other users of decoder library (nodelets in same manager) don't wake us
+   if(!mt_ffmpeg_stream_decoder_wait_some(&handles[0],(int)handles.size(),100))
+      continue;
+
+   for(size_t k=0;k<streams.size();k++)
+      {
+      camera_stream& s=streams[k];
+      if(s.handle<0)
+         continue;
+
+      int status=mt_ffmpeg_stream_decoder_get_status(s.handle);
+      if(status == FFMPEG_STREAM_STATUS_ERROR)
+         {
+         //stream is dead (ended, or lost with reconnect=0), it doesn't wake us up again
+         //ROS_WARN_THROTTLE would throttle all streams together, so only one of several dead ones would ever show up
+         double now=ros::WallTime::now().toSec();
+         if(now-s.error_warned>=5.0)
+            {
+            ROS_WARN("stream %s is in error state",s.uri.c_str());
+            s.error_warned=now;
+            }
+         if(s.options.passthrough && s.img_pub.getNumSubscribers()>0)
+            publish_packets(s);		//packets queued before stream ended are still there
+         continue;
+         }
+
+      //nobody subscribed: decoder library skips packets (or decodes keyframes only) and we skip conversion and copies
+      //falling behind: decoder leaves out non-reference frames, fps goes down instead of latency going up
+      int mode=s.idle_decode;
+      if(has_subscribers(s))
+         {
+         adapt_decode(s);
+         mode=s.shedding ? FFMPEG_STREAM_DECODE_REFERENCE : FFMPEG_STREAM_DECODE_ALL;
+         }
+      if(mode!=mt_ffmpeg_stream_decoder_get_decode(s.handle))
+         mt_ffmpeg_stream_decoder_set_decode(s.handle,mode);
+      if(mode!=FFMPEG_STREAM_DECODE_ALL && mode!=FFMPEG_STREAM_DECODE_REFERENCE)
+         continue;
+
+      if(s.options.passthrough)
+         publish_packets(s);
+      else if(status == FFMPEG_STREAM_STATUS_NEW_FRAME)
+         {
+         //keep_all streams may have queued several frames since last wakeup, they are published in order
+         //frames over max_rate go straight back to decoder, never converted
+         while(mt_ffmpeg_stream_decoder_acquire_frame(s.handle))
+            {
+            if(publish_due(s))
+               publish_frame(s);
+            else
+               {
+               mt_ffmpeg_stream_decoder_release_frame(s.handle);
+               s.rate_limited++;
+               }
+            if(!s.options.keep_all_frames)
+               break;
+            }
+         }
+      }//for(streams)
+
+   if((ros::WallTime::now()-latency_log_time).toSec()>=5.0)
+      {
+      log_latency();
+      report_stages();
+      latency_log_time=ros::WallTime::now();
+      }
+   }//while(ros::ok())
+}
+
+void StreamPublisher::stop()
+{
+stopping=true;
+}
+
+void StreamPublisher::close()
+{
+if(!started)
+	return;
+
+//no pre-event request may come in while streams go away, shutdown() waits for one being answered
+preevent_sub.shutdown();
+for(size_t k=0;k<streams.size();k++)
+	{
+	streams[k].dump_srv.shutdown();
+	streams[k].replay_srv.shutdown();
+	}
+
+//stop our cameras, library itself is released by its last user
+for(size_t k=0;k<streams.size();k++)
+	{
+	if(streams[k].handle>=0)
+		mt_ffmpeg_stream_decoder_close(streams[k].handle);
+	streams[k].handle=-1;
+	streams[k].workers.reset();
+	}
+handles.clear();
+mt_ffmpeg_stream_decoder_done();
+
+//readers keep what they have mapped, names are gone
+for(size_t k=0;k<streams.size();k++)
+	for(size_t i=0;i<streams[k].outputs.size();i++)
+		{
+		ffmpeg2ros_shm_ring_destroy(streams[k].outputs[i].shm_ring);
+		streams[k].outputs[i].shm_ring=0;
+		}
+started=false;
+}
+
+//shared memory ring of output with slots for images of size bytes, made anew under next name when they outgrow it
+//name follows image topic: /cam0/rgb -> /ffmpeg2ros_cam0_rgb_<n> (/dev/shm/ffmpeg2ros_cam0_rgb_<n>)
+//if it can't be made, shm output of images that big pauses for a while instead of every frame trying again
+static bool make_shm_ring(const camera_stream& s, stream_output& o, size_t size)
+{
+	if(o.shm_ring!=0 && ffmpeg2ros_shm_ring_slot_size(o.shm_ring)>=size)
+		return true;
+	double now=ros::WallTime::now().toSec();
+	if(o.shm_failed_size!=0 && size>=o.shm_failed_size && now<o.shm_retry_time)
+		return false;
+	ffmpeg2ros_shm_ring_destroy(o.shm_ring);
+
+	std::string topic=o.pub.getTopic();
+	for(size_t i=0;i<topic.size();i++)
+		if(topic[i]=='/') topic[i]='_';
+	char generation[16];
+	snprintf(generation,sizeof(generation),"_%d",o.shm_generation);
+	o.shm_name="/ffmpeg2ros"+topic+generation;
+	o.shm_ring=ffmpeg2ros_shm_ring_create(o.shm_name.c_str(),s.shm_slots,size);
+	if(o.shm_ring==0)
+		{
+		o.shm_failed_size=size;
+		o.shm_retry_time=now+10.0;
+		ROS_WARN("%s: can't create shared memory ring %s for %zu byte images, next try in 10 s",s.ns.c_str(),o.shm_name.c_str(),size);
+		return false;
+		}
+	o.shm_generation++;
+	o.shm_failed_size=0;
+	printf("%s: shared memory ring %s, %d slots of %zu bytes\n",s.uri.c_str(),o.shm_name.c_str(),s.shm_slots,size);
+	return true;
+}
+
+//convert and publish frame lent by decoder, gives it back
+//every output somebody subscribed to gets its own message, outputs are converted in parallel
+//shm readers get the same pixels in a ring slot, converted straight into it if nobody wants the message
+void StreamPublisher::publish_frame(camera_stream& s)
+{
+	std::vector<sensor_msgs::ImagePtr> msgs(s.outputs.size());
+	std::vector<size_t> wanted;
+	std::vector<uint8_t*> dst(s.outputs.size());			//where each wanted output is converted to
+	std::vector<int> dst_step(s.outputs.size());
+	std::vector<size_t> dst_size(s.outputs.size());
+	std::vector<uint8_t*> shm_data(s.outputs.size());		//ring slot being written, NULL if no shm reader
+	std::vector<uint32_t> shm_slot(s.outputs.size());
+
+	//message allocation and filling count as post-processing, conversion is timed by decoder library itself
+	int64_t post_start=av_gettime_relative();
+	int64_t post_us;
+
+	for(size_t i=0;i<s.outputs.size();i++)
+		{
+		stream_output& o=s.outputs[i];
+		bool want_image=o.pub.getNumSubscribers()>0;
+		bool want_shm=o.shm_pub.getNumSubscribers()>0;
+		if(!want_image && !want_shm)
+			continue;
+
+		// received new video frame, decoder lends it to us until mt_ffmpeg_stream_decoder_release_frame()
+		// output size is derived from frame's native resolution, so check it on every frame
+		int w = mt_ffmpeg_stream_decoder_get_output_width(s.handle,(int)i);
+		int h = mt_ffmpeg_stream_decoder_get_output_height(s.handle,(int)i);
+		if((w != o.width_out)||(h != o.height_out))
+			{
+			o.width_out = w;
+			o.height_out = h;
+			printf("%s: will publish %s at w,h=%d,%d\n",s.uri.c_str(),o.pub.getTopic().c_str(),o.width_out,o.height_out);
+			}
+
+		//nv12 carries its chroma rows below height rows of luma, like nv21 in image_encodings
+		dst_step[i] = mt_ffmpeg_stream_decoder_format_stride(o.output.format, o.width_out);
+		dst_size[i] = (size_t)dst_step[i]*mt_ffmpeg_stream_decoder_format_rows(o.output.format, o.height_out);
+		if(want_shm && make_shm_ring(s,o,dst_size[i]))
+			shm_data[i] = ffmpeg2ros_shm_ring_begin_write(o.shm_ring,&shm_slot[i]);
+		else if(!want_image)
+			continue;
+
+		//message is handed to publisher by shared pointer, so it's never copied again after we fill it
+		//(intra-process subscribers get this very buffer, remote ones get it serialized straight from here)
+		if(want_image)
+			{
+			sensor_msgs::ImagePtr img_msg(new sensor_msgs::Image);
+			img_msg->header.seq = s.seq;
+			img_msg->header.frame_id = s.frame_id;
+			img_msg->height = o.height_out;
+			img_msg->width =  o.width_out;
+			img_msg->is_bigendian = 0;
+			img_msg->encoding = find_output_format(o.output.format).encoding;	//see /opt/ros/noetic/include/sensor_msgs/image_encodings.h
+			img_msg->step = dst_step[i];
+			img_msg->data.resize(dst_size[i]);
+			msgs[i]=img_msg;
+			dst[i]=&img_msg->data[0];
+			}
+		else
+			dst[i]=shm_data[i];
+		wanted.push_back(i);
+		}
+	uint32_t seq=s.seq++;
+
+	//decoder converts and scales directly into messages in one pass per output
+	//outputs have conversion state of their own, extra ones run on stream's worker threads while this one does first
+	post_us=av_gettime_relative()-post_start;
+	std::vector<convert_job> jobs(wanted.size());
+	for(size_t j=0;j<wanted.size();j++)
+		{
+		jobs[j].handle=s.handle;
+		jobs[j].output=(int)wanted[j];
+		jobs[j].dst=dst[wanted[j]];
+		jobs[j].dst_stride=dst_step[wanted[j]];
+		jobs[j].result=-1;
+		}
+	if(s.workers)
+		s.workers->run(jobs);
+	else if(!jobs.empty())
+		jobs[0].result=mt_ffmpeg_stream_decoder_convert_output(s.handle,jobs[0].output,jobs[0].dst,jobs[0].dst_stride);
+	post_start=av_gettime_relative();
+	//failed output (e.g. frame it can't crop) publishes nothing, its shm slot goes back unchanged
+	for(size_t j=0;j<wanted.size();j++)
+		{
+		size_t i=wanted[j];
+		if(jobs[j].result>=0)
+			continue;
+		double now=ros::WallTime::now().toSec();
+		if(now-s.outputs[i].convert_warned>=5.0)
+			{
+			ROS_WARN("%s: can't convert frame for %s",s.ns.c_str(),s.outputs[i].pub.getTopic().c_str());
+			s.outputs[i].convert_warned=now;
+			}
+		msgs[i].reset();
+		if(shm_data[i]!=0)
+			ffmpeg2ros_shm_ring_cancel_write(s.outputs[i].shm_ring,shm_slot[i]);
+		shm_data[i]=0;
+		}
+	//outputs wanted both ways were converted into message, shm slot gets a copy
+	for(size_t j=0;j<wanted.size();j++)
+		if(shm_data[wanted[j]]!=0 && dst[wanted[j]]!=shm_data[wanted[j]])
+			memcpy(shm_data[wanted[j]],dst[wanted[j]],dst_size[wanted[j]]);
+	struct mt_ffmpeg_stream_frame_times times;
+	int have_times=mt_ffmpeg_stream_decoder_get_frame_times(s.handle,&times)==0;
+	mt_ffmpeg_stream_decoder_release_frame(s.handle);
+	if(!have_times)
+		memset(&times,0,sizeof(times));
+	std_msgs::Header header;
+	header.seq=seq;
+	header.stamp=stamp_from_times(times);
+	header.frame_id=s.frame_id;
+	std::vector<ffmpeg2ros::ShmImagePtr> descs(s.outputs.size());
+	for(size_t j=0;j<wanted.size();j++)
+		{
+		size_t i=wanted[j];
+		stream_output& o=s.outputs[i];
+		if(msgs[i])
+			msgs[i]->header.stamp = header.stamp;
+		if(shm_data[i]==0)
+			continue;
+
+		//slot is complete, readers may take it from now on
+		struct ffmpeg2ros_shm_frame frame;
+		memset(&frame,0,sizeof(frame));
+		frame.frame_number=seq;
+		frame.stamp_ns=header.stamp.toNSec();
+		frame.width=o.width_out;
+		frame.height=o.height_out;
+		frame.step=dst_step[i];
+		frame.size=dst_size[i];
+		snprintf(frame.encoding,sizeof(frame.encoding),"%s",find_output_format(o.output.format).encoding);
+		ffmpeg2ros::ShmImagePtr desc(new ffmpeg2ros::ShmImage);
+		desc->header=header;
+		desc->shm_name=o.shm_name;
+		desc->slot=shm_slot[i];
+		desc->sequence=ffmpeg2ros_shm_ring_end_write(o.shm_ring,shm_slot[i],&frame);
+		desc->height=frame.height;
+		desc->width=frame.width;
+		desc->encoding=frame.encoding;
+		desc->step=frame.step;
+		desc->size=frame.size;
+		descs[i]=desc;
+		}
+	post_us+=av_gettime_relative()-post_start;
+	mt_ffmpeg_stream_decoder_add_stage_time(s.handle,FFMPEG_STREAM_STAGE_POSTPROCESS,post_us);
+
+	// Publish the images, as const messages so nodelet subscribers can share them
+	// serialization for remote subscribers happens inside publish(), so it's part of publish stage
+	int64_t publish_start=av_gettime_relative();
+	for(size_t j=0;j<wanted.size();j++)
+		{
+		size_t i=wanted[j];
+		if(msgs[i])
+			s.outputs[i].pub.publish(sensor_msgs::ImageConstPtr(msgs[i]));
+		if(descs[i])
+			s.outputs[i].shm_pub.publish(ffmpeg2ros::ShmImageConstPtr(descs[i]));
+		}
+	mt_ffmpeg_stream_decoder_add_stage_time(s.handle,FFMPEG_STREAM_STAGE_PUBLISH,av_gettime_relative()-publish_start);
+
+	if(have_times)
+		{
+		add_latency(s,times);
+		if(s.latency_pub.getNumSubscribers()>0)
+			publish_latency(s,header,times);
+		}
+}
+
+//per-frame latency for tuning pipeline, same header as image so the two can be matched
+void StreamPublisher::publish_latency(camera_stream& s, const std_msgs::Header& header, const struct mt_ffmpeg_stream_frame_times& times)
+{
+	int64_t now=av_gettime();
+	ffmpeg2ros::FrameLatencyPtr msg(new ffmpeg2ros::FrameLatency);
+	msg->header=header;
+	msg->capture_to_publish=times.capture_time>0 ? (now-times.capture_time)/1000.0f : -1.0f;
+	msg->receive_to_publish=(now-times.receive_time)/1000.0f;
+	msg->receive_to_decode=(times.decode_time-times.receive_time)/1000.0f;
+	msg->decode_to_publish=(now-times.decode_time)/1000.0f;
+	s.latency_pub.publish(ffmpeg2ros::FrameLatencyConstPtr(msg));
+}
+
+//once a second: frames decoded but overwritten before we took them mean we can't keep up,
+//and frames mostly released unpublished because of max_rate mean decoding them was wasted too,
+//either way decoder discards non-reference frames until things have been calm for a few seconds
+void StreamPublisher::adapt_decode(camera_stream& s)
+{
+	double now=ros::WallTime::now().toSec();
+	if(now-s.adapt_time<1.0)
+		return;
+	s.adapt_time=now;
+
+	struct mt_ffmpeg_stream_stats stats;
+	mt_ffmpeg_stream_decoder_get_stats(s.handle,&stats);
+	uint64_t overwritten=stats.frames_overwritten-s.overwritten_seen;
+	uint64_t limited=s.rate_limited-s.limited_seen;
+	uint64_t published=(stats.frames_acquired-s.acquired_seen)-limited;
+	s.overwritten_seen=stats.frames_overwritten;
+	s.acquired_seen=stats.frames_acquired;
+	s.limited_seen=s.rate_limited;
+
+	//keep_all streams never overwrite, they want every frame anyway
+	if(!s.adaptive || s.options.keep_all_frames)
+		{
+		s.shedding=false;
+		return;
+		}
+	if(overwritten>0 || limited>published)
+		{
+		if(!s.shedding)
+			ROS_INFO("%s: falling behind (%llu frames overwritten, %llu over max_rate in last second), decoding reference frames only",
+						s.ns.c_str(),(unsigned long long)overwritten,(unsigned long long)limited);
+		s.shedding=true;
+		s.calm_since=now;
+		}
+	else if(s.shedding && now-s.calm_since>=5.0)
+		{
+		ROS_INFO("%s: keeping up again, decoding every frame",s.ns.c_str());
+		s.shedding=false;
+		}
+}
+
+//publish every compressed packet decoder library has queued for passthrough stream
+void StreamPublisher::publish_packets(camera_stream& s)
+{
+	struct mt_ffmpeg_stream_packet packet;
+
+	while(mt_ffmpeg_stream_decoder_acquire_packet(s.handle,&packet))
+		{
+		ffmpeg2ros::VideoPacketPtr msg(new ffmpeg2ros::VideoPacket);
+		msg->header.seq=s.seq++;
+		msg->header.stamp=stamp_from_times(packet.times);
+		msg->header.frame_id=s.frame_id;
+		msg->codec=packet.codec_name;
+		msg->keyframe=packet.keyframe!=0;
+		msg->pts=packet.pts;
+		msg->dts=packet.dts;
+		msg->time_base_num=packet.time_base_num;
+		msg->time_base_den=packet.time_base_den;
+		msg->data.assign(packet.data,packet.data+packet.size);
+		mt_ffmpeg_stream_decoder_release_packet(s.handle);
+
+		int64_t publish_start=av_gettime_relative();
+		s.img_pub.publish(ffmpeg2ros::VideoPacketConstPtr(msg));
+		mt_ffmpeg_stream_decoder_add_stage_time(s.handle,FFMPEG_STREAM_STAGE_PUBLISH,av_gettime_relative()-publish_start);
+		add_latency(s,packet.times);
+		}
+}
+
+//write what pre-event buffer holds right now to <preevent_dir><ns>_preevent_YYYYMMDD_HHMMSS.<record_format>
+//(with CSV index as recordings have), preevent_mutex held
+bool StreamPublisher::dump_preevent(camera_stream& s, std::string& message)
+{
+	if(s.handle<0 || mt_ffmpeg_stream_decoder_preevent_snapshot(s.handle)==0)
+		{
+		message=s.ns+": pre-event buffer is empty";
+		return false;
+		}
+
+	char date[32];
+	time_t now=time(0);
+	struct tm local;
+	localtime_r(&now,&local);
+	strftime(date,sizeof(date),"%Y%m%d_%H%M%S",&local);
+	std::string name=(!s.ns.empty() && s.ns[0]=='/') ? s.ns.substr(1) : s.ns;
+	for(size_t i=0;i<name.size();i++)
+		if(name[i]=='/') name[i]='_';
+	std::string dir=s.preevent_dir;
+	if(!dir.empty() && dir[dir.size()-1]!='/')
+		dir+='/';
+	std::string filename=dir+(name.empty() ? "stream" : name)+"_preevent_"+date+"."+s.options.record_format;
+
+	int written=mt_ffmpeg_stream_decoder_preevent_dump(s.handle,filename.c_str());
+	if(written<0)
+		{
+		message=s.ns+": can't write "+filename;
+		return false;
+		}
+	message=filename;
+	ROS_INFO("%s: %d packets of pre-event buffer written to %s",s.ns.c_str(),written,filename.c_str());
+	return true;
+}
+
+//publish what pre-event buffer holds right now on <ns>/preevent, keyframe first, stamped as packets were, preevent_mutex held
+bool StreamPublisher::replay_preevent(camera_stream& s, std::string& message)
+{
+	int count=s.handle<0 ? 0 : mt_ffmpeg_stream_decoder_preevent_snapshot(s.handle);
+	if(count==0)
+		{
+		message=s.ns+": pre-event buffer is empty";
+		return false;
+		}
+
+	struct mt_ffmpeg_stream_packet packet;
+	for(int i=0;i<count && mt_ffmpeg_stream_decoder_preevent_packet(s.handle,i,&packet);i++)
+		{
+		ffmpeg2ros::VideoPacketPtr msg(new ffmpeg2ros::VideoPacket);
+		msg->header.seq=i;
+		msg->header.stamp=stamp_from_times(packet.times);
+		msg->header.frame_id=s.frame_id;
+		msg->codec=packet.codec_name;
+		msg->keyframe=packet.keyframe!=0;
+		msg->pts=packet.pts;
+		msg->dts=packet.dts;
+		msg->time_base_num=packet.time_base_num;
+		msg->time_base_den=packet.time_base_den;
+		msg->data.assign(packet.data,packet.data+packet.size);
+		s.preevent_pub.publish(ffmpeg2ros::VideoPacketConstPtr(msg));
+		}
+	char text[64];
+	snprintf(text,sizeof(text),"%d packets replayed on ",count);
+	message=text+s.ns+"/preevent";
+	return true;
+}
+
+bool StreamPublisher::on_dump_preevent(size_t k, std_srvs::Trigger::Request&, std_srvs::Trigger::Response& res)
+{
+	std::lock_guard<std::mutex> lock(preevent_mutex);
+	res.success=dump_preevent(streams[k],res.message);
+	return true;
+}
+
+bool StreamPublisher::on_replay_preevent(size_t k, std_srvs::Trigger::Request&, std_srvs::Trigger::Response& res)
+{
+	std::lock_guard<std::mutex> lock(preevent_mutex);
+	res.success=replay_preevent(streams[k],res.message);
+	return true;
+}
+
+//~dump_preevent: every stream with a buffer writes its file
+void StreamPublisher::on_preevent_trigger(const std_msgs::Empty::ConstPtr&)
+{
+	std::lock_guard<std::mutex> lock(preevent_mutex);
+	for(size_t k=0;k<streams.size();k++)
+		{
+		std::string message;
+		if(streams[k].options.preevent_s>0 && !dump_preevent(streams[k],message))
+			ROS_WARN("%s",message.c_str());
+		}
+}
+
+//collect receive->publish and glass->publish latency of one frame or packet for periodic log
+void StreamPublisher::add_latency(camera_stream& s, const struct mt_ffmpeg_stream_frame_times& times)
+{
+	int64_t now=av_gettime();
+	double receive_ms=(now-times.receive_time)/1000.0;
+	s.latency_frames++;
+	s.receive_sum+=receive_ms;
+	if(receive_ms>s.receive_max) s.receive_max=receive_ms;
+	if(times.capture_time>0)
+		{
+		double glass_ms=(now-times.capture_time)/1000.0;
+		s.glass_frames++;
+		s.glass_sum+=glass_ms;
+		if(glass_ms>s.glass_max) s.glass_max=glass_ms;
+		}
+}
+
+void StreamPublisher::log_latency()
+{
+for(size_t k=0;k<streams.size();k++)
+	{
+	camera_stream& s=streams[k];
+	if(s.handle<0 || s.latency_frames==0)
+		continue;
+	if(s.glass_frames>0)
+		ROS_INFO("%s latency over %d frames: receive->publish avg %.1f max %.1f ms, glass->publish avg %.1f max %.1f ms",s.ns.c_str(),
+					s.latency_frames,s.receive_sum/s.latency_frames,s.receive_max,s.glass_sum/s.glass_frames,s.glass_max);
+	else
+		ROS_INFO("%s latency over %d frames: receive->publish avg %.1f max %.1f ms (no capture time from stream)",s.ns.c_str(),
+					s.latency_frames,s.receive_sum/s.latency_frames,s.receive_max);
+	struct mt_ffmpeg_stream_stats stats;
+	mt_ffmpeg_stream_decoder_get_stats(s.handle,&stats);
+	ROS_INFO("%s frames since start: %llu decoded, %llu dropped, %llu overwritten, %llu discarded by decoder, %llu over max_rate, %llu published",
+				s.ns.c_str(),(unsigned long long)stats.frames_decoded,(unsigned long long)stats.frames_dropped,
+				(unsigned long long)stats.frames_overwritten,(unsigned long long)stats.frames_discarded,
+				(unsigned long long)s.rate_limited,(unsigned long long)(stats.frames_acquired-s.rate_limited));
+	s.latency_frames=s.glass_frames=0;
+	s.receive_sum=s.receive_max=s.glass_sum=s.glass_max=0;
+	}
+}
+
+//per-stage timing since previous report: one log line per stream and a DiagnosticStatus per stream on /diagnostics
+//tells network bound (demux), decode bound, slow main loop (handoff) and slow conversion or publishing apart
+void StreamPublisher::report_stages()
+{
+static const char* stage_names[FFMPEG_STREAM_STAGES]={"demux","decode","handoff","convert","postprocess","publish"};
+diagnostic_msgs::DiagnosticArrayPtr diag(new diagnostic_msgs::DiagnosticArray);
+diag->header.stamp=ros::Time::now();
+
+for(size_t k=0;k<streams.size();k++)
+	{
+	camera_stream& s=streams[k];
+	if(s.handle<0)
+		continue;
+
+	diagnostic_msgs::DiagnosticStatus status;
+	status.name="ffmpeg2ros: "+s.ns;
+	status.hardware_id=s.uri;
+	int decoder_status=mt_ffmpeg_stream_decoder_get_status(s.handle);
+	if(decoder_status==FFMPEG_STREAM_STATUS_ERROR)
+		{
+		status.level=diagnostic_msgs::DiagnosticStatus::ERROR;
+		status.message="stream in error state";
+		}
+	else if(decoder_status==FFMPEG_STREAM_STATUS_CONNECTING)
+		{
+		status.level=diagnostic_msgs::DiagnosticStatus::WARN;
+		status.message="connecting";
+		}
+	else if(mt_ffmpeg_stream_decoder_get_decode(s.handle)==FFMPEG_STREAM_DECODE_REFERENCE)
+		{
+		status.level=diagnostic_msgs::DiagnosticStatus::WARN;
+		status.message="falling behind, reference frames only";
+		}
+	else
+		{
+		status.level=diagnostic_msgs::DiagnosticStatus::OK;
+		status.message=mt_ffmpeg_stream_decoder_get_decode(s.handle)==FFMPEG_STREAM_DECODE_ALL ? "streaming" : "idle, no subscribers";
+		}
+
+	std::string line;
+	for(int stage=0;stage<FFMPEG_STREAM_STAGES;stage++)
+		{
+		struct mt_ffmpeg_stream_stage_stats now,interval;
+		mt_ffmpeg_stream_decoder_get_stage_stats(s.handle,stage,&now);
+		interval=now;
+		interval.count-=s.stage_prev[stage].count;
+		interval.total_us-=s.stage_prev[stage].total_us;
+		for(int b=0;b<FFMPEG_STREAM_HISTOGRAM_BUCKETS;b++)
+			interval.buckets[b]-=s.stage_prev[stage].buckets[b];
+		s.stage_prev[stage]=now;
+		if(interval.count==0)
+			continue;
+
+		double mean_ms=interval.total_us/1000.0/interval.count;
+		double p50_ms=mt_ffmpeg_stream_decoder_stage_percentile(&interval,0.5)/1000.0;
+		double p99_ms=mt_ffmpeg_stream_decoder_stage_percentile(&interval,0.99)/1000.0;
+		char text[128];
+		snprintf(text,sizeof(text)," %s %.2f/%.2f/%.2f",stage_names[stage],mean_ms,p50_ms,p99_ms);
+		line+=text;
+
+		diagnostic_msgs::KeyValue kv;
+		snprintf(text,sizeof(text),"%llu",(unsigned long long)interval.count);
+		kv.key=std::string(stage_names[stage])+" count";		kv.value=text;	status.values.push_back(kv);
+		snprintf(text,sizeof(text),"%.3f",mean_ms);
+		kv.key=std::string(stage_names[stage])+" mean ms";		kv.value=text;	status.values.push_back(kv);
+		snprintf(text,sizeof(text),"%.3f",p50_ms);
+		kv.key=std::string(stage_names[stage])+" p50 ms";		kv.value=text;	status.values.push_back(kv);
+		snprintf(text,sizeof(text),"%.3f",p99_ms);
+		kv.key=std::string(stage_names[stage])+" p99 ms";		kv.value=text;	status.values.push_back(kv);
+		snprintf(text,sizeof(text),"%.3f",now.max_us/1000.0);
+		kv.key=std::string(stage_names[stage])+" max ms (since start)";	kv.value=text;	status.values.push_back(kv);
+		}
+	if(!line.empty())
+		ROS_INFO("%s stages mean/p50/p99 ms:%s",s.ns.c_str(),line.c_str());
+
+	struct mt_ffmpeg_stream_stats stats;
+	mt_ffmpeg_stream_decoder_get_stats(s.handle,&stats);
+	if(stats.reconnects>s.reconnects_seen)
+		ROS_WARN("%s: stream lost, %llu reconnect attempts so far",s.ns.c_str(),(unsigned long long)stats.reconnects);
+	s.reconnects_seen=stats.reconnects;
+	if(stats.packets_not_recorded>s.not_recorded_seen)
+		ROS_WARN("%s: %llu packets could not be recorded so far, disk too slow or full?",s.ns.c_str(),(unsigned long long)stats.packets_not_recorded);
+	s.not_recorded_seen=stats.packets_not_recorded;
+	const char* counter_names[]={"packets","frames decoded","frames dropped","frames overwritten","frames discarded","frames rate limited",
+										"frames published","packets skipped","reconnects","packets recorded","packets not recorded","record files"};
+	uint64_t counters[]={stats.packets,stats.frames_decoded,stats.frames_dropped,stats.frames_overwritten,stats.frames_discarded,s.rate_limited,
+								stats.frames_acquired-s.rate_limited,stats.packets_skipped,stats.reconnects,
+								stats.packets_recorded,stats.packets_not_recorded,stats.record_files};
+	for(int c=0;c<(int)(sizeof(counters)/sizeof(counters[0]));c++)
+		{
+		char text[32];
+		diagnostic_msgs::KeyValue kv;
+		snprintf(text,sizeof(text),"%llu",(unsigned long long)counters[c]);
+		kv.key=counter_names[c];
+		kv.value=text;
+		status.values.push_back(kv);
+		}
+	diagnostic_msgs::KeyValue kv;
+	kv.key="pixel kernels";
+	kv.value=mt_ffmpeg_stream_kernels_get()->name;
+	status.values.push_back(kv);
+
+	diag->status.push_back(status);
+	}
+
+diag_pub.publish(diag);
+}
+
+} //namespace ffmpeg2ros
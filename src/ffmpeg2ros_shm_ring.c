@@ -0,0 +1,258 @@
+// shared-memory image ring for same-host consumers in other processes, see shm_ring.h
+// one writer (ffmpeg2ros publishing thread) and any number of read-only readers, nobody ever waits for anyone:
+// writer marks slot odd, fills it, marks it even again; reader checks sequence number before and after using data
+// POSIX only (shm_open, mmap), like ROS1 itself
+//
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ffmpeg2ros/shm_ring.h"
+
+#define SHM_RING_HEADER_SIZE 64
+#define SHM_SLOT_HEADER_SIZE 128
+#define SHM_ALIGN(x, a) (((x) + (a) - 1) / (a) * (a))
+
+// start of shared memory, SHM_RING_HEADER_SIZE bytes, slot headers follow
+struct RingHeader
+	{
+	uint32_t magic;		// stored last by writer, so readers never see a half made ring
+	uint32_t version;
+	uint32_t slots;
+	uint32_t header_size;
+	uint64_t slot_size;
+	uint64_t data_offset;
+	uint64_t written;
+	};
+
+struct ffmpeg2ros_shm_ring
+	{
+	char name[256];
+	int writer;				// created it, unlinks it again
+	uint8_t* base;
+	size_t map_size;
+	struct RingHeader* header;
+	};
+
+static struct ffmpeg2ros_shm_slot* ring_slot(struct ffmpeg2ros_shm_ring* ring, uint32_t slot)
+	{
+	return (struct ffmpeg2ros_shm_slot*)(ring->base + SHM_RING_HEADER_SIZE + (size_t)slot * ring->header->header_size);
+	}
+
+static uint8_t* ring_data(struct ffmpeg2ros_shm_ring* ring, uint32_t slot)
+	{
+	return ring->base + ring->header->data_offset + (size_t)slot * ring->header->slot_size;
+	}
+
+struct ffmpeg2ros_shm_ring* ffmpeg2ros_shm_ring_create(const char* name, int slots, size_t slot_size)
+	{
+	struct ffmpeg2ros_shm_ring* ring;
+	size_t data_offset;
+	int fd;
+
+	if(slots < 2 || slot_size == 0 || strlen(name) >= sizeof(ring->name))
+		return 0;
+
+	ring = calloc(1, sizeof(*ring));
+	if(ring == 0)
+		return 0;
+	snprintf(ring->name, sizeof(ring->name), "%s", name);
+	ring->writer = 1;
+
+	// rows are copied in whole cache lines, data starts on a page
+	slot_size = SHM_ALIGN(slot_size, 64);
+	data_offset = SHM_ALIGN(SHM_RING_HEADER_SIZE + (size_t)slots * SHM_SLOT_HEADER_SIZE, 4096);
+	ring->map_size = data_offset + (size_t)slots * slot_size;
+
+	// a ring left by a crashed run is replaced, its readers keep old mapping
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0)
+		{
+		fprintf(stderr, "shm ring: can't create %s\n", name);
+		free(ring);
+		return 0;
+		}
+	// tmpfs pages are reserved now: a /dev/shm too small for the ring (64 MB in Docker) fails here,
+	// not with SIGBUS halfway through writing a frame
+	if(posix_fallocate(fd, 0, ring->map_size) == 0)
+		ring->base = mmap(0, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(ring->base == 0 || ring->base == MAP_FAILED)
+		{
+		fprintf(stderr, "shm ring: can't reserve and map %zu bytes of %s\n", ring->map_size, name);
+		shm_unlink(name);
+		free(ring);
+		return 0;
+		}
+
+	// new memory is zero: every slot starts even and empty
+	ring->header = (struct RingHeader*)ring->base;
+	ring->header->version = FFMPEG2ROS_SHM_VERSION;
+	ring->header->slots = slots;
+	ring->header->header_size = SHM_SLOT_HEADER_SIZE;
+	ring->header->slot_size = slot_size;
+	ring->header->data_offset = data_offset;
+	__atomic_store_n(&ring->header->magic, FFMPEG2ROS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return ring;
+	}
+
+void ffmpeg2ros_shm_ring_destroy(struct ffmpeg2ros_shm_ring* ring)
+	{
+	if(ring == 0)
+		return;
+	munmap(ring->base, ring->map_size);
+	if(ring->writer)
+		shm_unlink(ring->name);
+	free(ring);
+	}
+
+uint8_t* ffmpeg2ros_shm_ring_begin_write(struct ffmpeg2ros_shm_ring* ring, uint32_t* slot)
+	{
+	struct ffmpeg2ros_shm_slot* s;
+	uint64_t sequence;
+
+	*slot = (uint32_t)(ring->header->written % ring->header->slots);
+	s = ring_slot(ring, *slot);
+	sequence = __atomic_load_n(&s->sequence, __ATOMIC_RELAXED);
+
+	// odd before any byte of data changes, a reader that sees new data sees it odd (or newer) afterwards
+	__atomic_store_n(&s->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return ring_data(ring, *slot);
+	}
+
+uint64_t ffmpeg2ros_shm_ring_end_write(struct ffmpeg2ros_shm_ring* ring, uint32_t slot, const struct ffmpeg2ros_shm_frame* frame)
+	{
+	struct ffmpeg2ros_shm_slot* s = ring_slot(ring, slot);
+	uint64_t sequence = __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) + 1;
+
+	s->frame = *frame;
+	s->frame.encoding[FFMPEG2ROS_SHM_ENCODING_SIZE - 1] = 0;
+	__atomic_store_n(&s->sequence, sequence, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->header->written, ring->header->written + 1, __ATOMIC_RELEASE);
+
+	return sequence;
+	}
+
+void ffmpeg2ros_shm_ring_cancel_write(struct ffmpeg2ros_shm_ring* ring, uint32_t slot)
+	{
+	struct ffmpeg2ros_shm_slot* s = ring_slot(ring, slot);
+
+	// written stays, ffmpeg2ros_shm_ring_latest() keeps pointing at previous slot
+	__atomic_store_n(&s->sequence, __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+	}
+
+size_t ffmpeg2ros_shm_ring_slot_size(const struct ffmpeg2ros_shm_ring* ring)
+	{
+	return ring->header->slot_size;
+	}
+
+struct ffmpeg2ros_shm_ring* ffmpeg2ros_shm_ring_open(const char* name)
+	{
+	struct ffmpeg2ros_shm_ring* ring;
+	struct RingHeader* header;
+	struct stat st;
+	int fd;
+
+	if(strlen(name) >= sizeof(ring->name))
+		return 0;
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0)
+		return 0;
+
+	ring = calloc(1, sizeof(*ring));
+	if(ring != 0 && fstat(fd, &st) == 0 && st.st_size >= SHM_RING_HEADER_SIZE)
+		{
+		ring->map_size = st.st_size;
+		ring->base = mmap(0, ring->map_size, PROT_READ, MAP_SHARED, fd, 0);
+		}
+	close(fd);
+	if(ring == 0 || ring->base == 0 || ring->base == MAP_FAILED)
+		{
+		free(ring);
+		return 0;
+		}
+	snprintf(ring->name, sizeof(ring->name), "%s", name);
+	ring->header = header = (struct RingHeader*)ring->base;
+
+	// slots have to be where header says, inside what was mapped
+	if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != FFMPEG2ROS_SHM_MAGIC || header->version != FFMPEG2ROS_SHM_VERSION ||
+	   header->slots == 0 || header->header_size < sizeof(struct ffmpeg2ros_shm_slot) ||
+	   SHM_RING_HEADER_SIZE + (uint64_t)header->slots * header->header_size > header->data_offset ||
+	   header->data_offset + header->slots * header->slot_size > ring->map_size)
+		{
+		fprintf(stderr, "shm ring: %s isn't a ring of version %d\n", name, FFMPEG2ROS_SHM_VERSION);
+		munmap(ring->base, ring->map_size);
+		free(ring);
+		return 0;
+		}
+
+	return ring;
+	}
+
+void ffmpeg2ros_shm_ring_close(struct ffmpeg2ros_shm_ring* ring)
+	{
+	ffmpeg2ros_shm_ring_destroy(ring);
+	}
+
+int ffmpeg2ros_shm_ring_check(struct ffmpeg2ros_shm_ring* ring, uint32_t slot, uint64_t sequence)
+	{
+	if(slot >= ring->header->slots)
+		return 0;
+
+	// everything read before has to be done before sequence number is looked at again
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&ring_slot(ring, slot)->sequence, __ATOMIC_RELAXED) == sequence;
+	}
+
+const uint8_t* ffmpeg2ros_shm_ring_peek(struct ffmpeg2ros_shm_ring* ring, uint32_t slot, uint64_t sequence,
+										struct ffmpeg2ros_shm_frame* frame)
+	{
+	struct ffmpeg2ros_shm_slot* s;
+
+	if(slot >= ring->header->slots || (sequence & 1) != 0)
+		return 0;
+	s = ring_slot(ring, slot);
+	if(__atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE) != sequence)
+		return 0;
+
+	*frame = s->frame;
+	if(!ffmpeg2ros_shm_ring_check(ring, slot, sequence) || frame->size > ring->header->slot_size)
+		return 0;
+	frame->encoding[FFMPEG2ROS_SHM_ENCODING_SIZE - 1] = 0;
+
+	return ring_data(ring, slot);
+	}
+
+int ffmpeg2ros_shm_ring_read(struct ffmpeg2ros_shm_ring* ring, uint32_t slot, uint64_t sequence,
+							 void* dst, size_t size, struct ffmpeg2ros_shm_frame* frame)
+	{
+	const uint8_t* data = ffmpeg2ros_shm_ring_peek(ring, slot, sequence, frame);
+
+	if(data == 0)
+		return -1;
+	memcpy(dst, data, size < frame->size ? size : frame->size);
+
+	return ffmpeg2ros_shm_ring_check(ring, slot, sequence) ? 0 : -1;
+	}
+
+int ffmpeg2ros_shm_ring_latest(struct ffmpeg2ros_shm_ring* ring, uint32_t* slot, uint64_t* sequence)
+	{
+	uint64_t written = __atomic_load_n(&ring->header->written, __ATOMIC_ACQUIRE);
+
+	if(written == 0)
+		return 0;
+	*slot = (uint32_t)((written - 1) % ring->header->slots);
+	*sequence = __atomic_load_n(&ring_slot(ring, *slot)->sequence, __ATOMIC_ACQUIRE);
+
+	// odd: writer has gone round the ring meanwhile and is filling it again
+	return (*sequence & 1) == 0;
+	}
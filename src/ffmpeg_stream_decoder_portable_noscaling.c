@@ -8,12 +8,18 @@
 // include ffmpeg headers
 
 #include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavutil/dict.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <libavutil/cpu.h>
 #include <libswscale/swscale.h> 
 
+#include <time.h>
+
 // keep all multi-threading related stuff in #ifdef/#endif blocks specific to Windows
 // _WIN32 macro is defined for both x86 and x64 target in Visual Studio
 
@@ -37,6 +43,8 @@
 // include declarations for our functions 
 //#include "ffmpeg_stream_decoder_portable.h"	//fixed rescaled image for OpenGL purposes only version
 #include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_decoder_portable_noscaling.h"	//merging V's July 24 addition of native resolution
+#include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_kernels.h"
+#include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_recorder.h"
 
 // add ffmpeg libraries to linker -can only do in Windows, in Linux must do on command line gcc (or in Makefile)
 #ifdef _WIN32
@@ -49,6 +57,51 @@
 // our stream decoder library can work with MAX_STREAMS simultaneously
 #define MAX_STREAMS 32
 
+// packets whose receive time is remembered until decoder returns their frame
+// must cover decoder delay (reordering plus frame threads)
+#define RECEIVE_TIME_SLOTS 64
+
+// decode pool limits: pool threads, packets queued per stream, packets decoded per turn before next stream gets its turn
+#define MAX_DECODE_WORKERS 64
+#define PACKET_QUEUE_SIZE 64
+#define DECODE_QUANTUM 4
+
+// decoded frames between worker thread and application: 3 slots form triple buffer of latest frame mode,
+// keep_all_frames mode queues up to all of them (power of two)
+#define FRAME_QUEUE_SIZE 16
+#define FRAME_SLOT_FRESH 0x100	// or'ed to slot index: slot holds frame application didn't take yet
+#define FRAME_SLOT_INDEX 0xff
+
+// pre-event buffer size in packets per second asked for, ring is sized for this frame rate (memory limit applies too)
+#define PREEVENT_PACKETS_PER_SECOND 120
+#define PREEVENT_DEFAULT_KB 65536
+
+// packet on its way from stream thread to decode pool, NULL packet asks for decoder flush
+// in passthrough mode packet on its way to application instead
+struct PacketEntry
+	{
+	AVPacket* packet;
+	int64_t receive_time;
+	int64_t start_time_realtime;
+	};
+
+// one output of stream with its own conversion state, so several outputs can convert same lent frame at once
+struct OutputContext
+	{
+	struct mt_ffmpeg_stream_output output;
+	struct SwsContext* conversion_ctx;	// reads only cropped rectangle of lent frame
+	uint8_t* convert_buf;				// intermediate RGB frame, for grey output from non-YUV sources and box downscale
+	int convert_buf_size;
+	AVFrame* view;						// cropped reference to lent frame while converting
+	};
+
+// decoded frame on its way from worker thread to application, references decoder buffers, pixels are never copied
+struct FrameSlot
+	{
+	AVFrame* frame;
+	struct mt_ffmpeg_stream_frame_times times;
+	};
+
 // StreamContext structure holds all ffmpeg stuff needed to receive and decode IP video stream
 // open() / close() functions will operate on integer 'handles' instead of pointers to this structures
 struct StreamContext
@@ -56,25 +109,145 @@ struct StreamContext
 	int is_open;
 	char URI[1024];
 
-	uint8_t* framebuf;
-	int target_width;
-	int target_height;
+	// decoded frames, worker thread moves references to decoded pictures here instead of copying pixels
+	// and main thread takes them over into frame_lent to convert directly into its own memory, without locks:
+	// latest frame mode is triple buffer in slots 0..2, worker thread fills slot_back and swaps it with slot_middle,
+	// main thread swaps its empty slot_spare with slot_middle when that is fresh, so neither side ever waits for other one
+	// keep_all_frames mode is single producer single consumer ring over all slots, worker thread waits while it is full
+	struct FrameSlot slot[FRAME_QUEUE_SIZE];
+	int slot_back;						// worker thread only
+	int slot_middle;					// atomic, slot index | FRAME_SLOT_FRESH
+	int slot_spare;						// main thread only
+	int ring_head;						// atomic, next slot to take, modulo 2 * FRAME_QUEUE_SIZE, written by main thread
+	int ring_tail;						// atomic, next slot to fill, modulo 2 * FRAME_QUEUE_SIZE, written by worker thread
+	AVFrame* frame_lent;
+	struct OutputContext outputs[FFMPEG_STREAM_MAX_OUTPUTS];	// used only by application to convert lent frame
+	int num_outputs;
+	struct mt_ffmpeg_stream_options options;
+	int source_width;					// native resolution of latest decoded frame
+	int source_height;
+	struct mt_ffmpeg_stream_frame_times times_lent;	// travel with frame_lent
+	struct mt_ffmpeg_stream_stats stats;				// guarded by cs_lock_frame
+	struct mt_ffmpeg_stream_recorder* recorder;			// NULL unless options ask for recording, lives from open() to close()
+
+	// pre-event buffer, ring of packets starting with a keyframe, filled by stream's own thread, guarded by cs_lock_preevent
+	struct mt_ffmpeg_stream_record_packet* preevent;	// NULL unless options ask for it
+	int preevent_size;
+	int preevent_head;
+	int preevent_count;
+	int* preevent_keys;					// ring of preevent indexes holding keyframes, first one is preevent_head
+	int preevent_key_head;
+	int preevent_key_count;
+	int64_t preevent_bytes;
+	int64_t preevent_shift;				// added to pts/dts, so packets of a new connection carry on from buffered ones
+	int preevent_rebase;				// new connection, shift is worked out from its first packet
+	AVCodecParameters* preevent_par;	// of connection buffered packets came from
+	AVRational preevent_time_base;
+
+	// snapshot of pre-event buffer with references of its own, application only
+	struct mt_ffmpeg_stream_record_packet* snapshot;
+	int snapshot_count;
+	AVCodecParameters* snapshot_par;
+	AVRational snapshot_time_base;
+	struct mt_ffmpeg_stream_stage_stats stages[FFMPEG_STREAM_STAGES];	// updated with atomic adds, no lock
+
+	// decoder state, used by stream's own thread or by decode pool, never by both
+	AVCodecContext* codec_ctx;
+	AVFrame* picture;
+	AVRational time_base;				// of video elementary stream
+	AVCodecParameters* codec_par;		// what decoder (or bitstream filter) was set up for, kept over reconnects
+	int64_t receive_pts[RECEIVE_TIME_SLOTS];	// receive times of packets in flight inside decoder, matched to frames by pts
+	int64_t receive_time[RECEIVE_TIME_SLOTS];
+	int receive_slot;
+	int64_t last_receive_time;
+
+	// passthrough mode, no decoder: compressed packets go to application through packet queue below
+	AVBSFContext* bsf;					// rewrites packets to Annex B byte stream, used by stream's own thread only
+	int codec_id;						// enum AVCodecID of video stream
+	AVPacket* packet_lent;				// taken over by main thread from queue
+
+	// packets waiting for decode pool (or for application in passthrough mode), guarded by cs_lock_queue
+	int use_pool;
+	struct PacketEntry queue[PACKET_QUEUE_SIZE];
+	int queue_head;
+	int queue_count;
+	int queue_scheduled;				// stream waits in a pool thread's deque or is being decoded
+	int queue_skip_to_key;				// queue overflowed, packets are dropped until next keyframe
 
 	int is_closing;
 	int status;
+	int decode_mode;					// FFMPEG_STREAM_DECODE_*, guarded by cs_lock_frame
+	int skip_nonref;					// decode_mode is FFMPEG_STREAM_DECODE_REFERENCE, atomic, read by whoever decodes
+	uint64_t nonref_packets;			// sent to decoder while it discarded non-reference frames, guarded by cs_lock_frame
+	uint64_t nonref_frames;				// and frames it returned meanwhile
+	int skip_to_key;					// packets were skipped, decoding resumes at next keyframe, stream's own thread only
+	int any_event;						// like global any_event but for this stream only, guarded by cs_lock_any
 
 #ifdef USE_WINDOWS_THREADING
 	CRITICAL_SECTION cs_lock_frame;
+	CONDITION_VARIABLE cv_new_frame;	// signalled by worker thread when status changes
+	CONDITION_VARIABLE cv_frame_taken;	// keep_all_frames: signalled by main thread when it frees a queue slot, and by close()
+	CRITICAL_SECTION cs_lock_queue;
+	CONDITION_VARIABLE cv_queue_idle;	// signalled by pool thread when it clears queue_scheduled, and by close()
+	CRITICAL_SECTION cs_lock_preevent;
 	HANDLE thread_handle;
 #endif
 #ifdef USE_PTHREADS
 	pthread_mutex_t cs_lock_frame;
+	pthread_cond_t cv_new_frame;		// signalled by worker thread when status changes
+	pthread_cond_t cv_frame_taken;		// keep_all_frames: signalled by main thread when it frees a queue slot, and by close()
+	pthread_mutex_t cs_lock_queue;
+	pthread_cond_t cv_queue_idle;		// signalled by pool thread when it clears queue_scheduled, and by close()
+	pthread_mutex_t cs_lock_preevent;
 	pthread_t thread_handle;
 #endif
 };
 
 static struct StreamContext stream[MAX_STREAMS];
 static int num_open_streams = 0;
+static int num_users = 0;				// init() calls not yet matched by done(), e.g. several nodelets in one process
+
+// shared by all streams so one thread can sleep until any of them has something new
+// any_event is set by worker threads and cleared by mt_ffmpeg_stream_decoder_wait_any()
+static int any_event = 0;
+#ifdef USE_WINDOWS_THREADING
+static CRITICAL_SECTION cs_lock_any;
+static CONDITION_VARIABLE cv_any;
+#endif
+#ifdef USE_PTHREADS
+static pthread_mutex_t cs_lock_any;
+static pthread_cond_t cv_any;
+#endif
+
+// optional decode pool, each pool thread has its own deque of streams to decode and steals from others when idle
+// a stream is in at most one deque at a time, so deque of MAX_STREAMS entries never overflows
+struct DecodeWorker
+	{
+	int tasks[MAX_STREAMS];
+	int task_head;
+	int task_count;
+#ifdef USE_WINDOWS_THREADING
+	CRITICAL_SECTION cs_lock_tasks;
+	HANDLE thread_handle;
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_t cs_lock_tasks;
+	pthread_t thread_handle;
+#endif
+	};
+
+static struct DecodeWorker decode_worker[MAX_DECODE_WORKERS];
+static int num_decode_workers = 0;		// 0 = no pool, every stream decodes in its own thread
+static int decode_pending = 0;			// tasks sitting in deques, guarded by cs_lock_pool
+static int decode_stopping = 0;
+#ifdef USE_WINDOWS_THREADING
+static CRITICAL_SECTION cs_lock_pool;
+static CONDITION_VARIABLE cv_pool;
+#endif
+#ifdef USE_PTHREADS
+static pthread_mutex_t cs_lock_pool;
+static pthread_cond_t cv_pool;
+#endif
 
 // internal function declarations
 #ifdef USE_WINDOWS_THREADING
@@ -83,40 +256,170 @@ static int num_open_streams = 0;
 #ifdef USE_PTHREADS
  void* mt_ffmpeg_stream_decoder_start_thread(void* thread_argument);
 #endif
+#ifdef USE_WINDOWS_THREADING
+ UINT mt_ffmpeg_stream_decoder_start_pool_thread(LPVOID param);
+#endif
+#ifdef USE_PTHREADS
+ void* mt_ffmpeg_stream_decoder_start_pool_thread(void* thread_argument);
+#endif
 
 void mt_ffmpeg_stream_decoder_thread(int handle);
 int mt_ffmpeg_stream_decoder_interrupt_callback(void *p);
-AVFrame* mt_ffmpeg_stream_decoder_init_frame_rgb(int width, int height);
+int mt_ffmpeg_stream_decoder_convert_rgb(struct OutputContext* out, AVFrame* picture, enum AVPixelFormat dst_format, unsigned char* dst, int dst_stride);
+int mt_ffmpeg_stream_decoder_convert_grey(struct OutputContext* out, AVFrame* picture, unsigned char* dst, int dst_stride);
+int mt_ffmpeg_stream_decoder_crop_size(const struct mt_ffmpeg_stream_output* output, int source_width, int source_height,
+										 int* x, int* y, int* width, int* height);
+int mt_ffmpeg_stream_decoder_output_frame(int handle, int index, int* width, int* height);
+void mt_ffmpeg_stream_decoder_free_outputs(int handle);
+int mt_ffmpeg_stream_decoder_convert_yuv(struct OutputContext* out, AVFrame* picture, enum AVPixelFormat dst_format, unsigned char* dst, int dst_stride);
+int mt_ffmpeg_stream_decoder_repack_yuv(AVFrame* picture, enum AVPixelFormat dst_format, unsigned char* dst, int dst_stride);
+void mt_ffmpeg_stream_decoder_output_size(struct OutputContext* out, int source_width, int source_height, int* width, int* height);
+int mt_ffmpeg_stream_decoder_sws_flags(struct OutputContext* out);
+AVDictionary* mt_ffmpeg_stream_decoder_input_options(int handle);
+void mt_ffmpeg_stream_decoder_frame_ready(int handle, AVFrame* picture, const struct mt_ffmpeg_stream_frame_times* times);
+int mt_ffmpeg_stream_decoder_frames_waiting(int handle);
+int mt_ffmpeg_stream_decoder_app_status(int handle);
+void mt_ffmpeg_stream_decoder_count(int handle, uint64_t* counter);
+void mt_ffmpeg_stream_decoder_signal_any(int handle);
+void mt_ffmpeg_stream_decoder_decode(int handle, AVPacket* packet, int64_t receive_time, int64_t start_time_realtime);
+void mt_ffmpeg_stream_decoder_enqueue(int handle, AVPacket* packet, int64_t receive_time, int64_t start_time_realtime);
+void mt_ffmpeg_stream_decoder_passthrough(int handle, AVPacket* packet, int64_t receive_time, int64_t start_time_realtime);
+int mt_ffmpeg_stream_decoder_open_bsf(int handle, AVStream* video);
+void mt_ffmpeg_stream_decoder_drop_queue(int handle);
+void mt_ffmpeg_stream_decoder_preevent_start(int handle, AVStream* video);
+void mt_ffmpeg_stream_decoder_preevent_add(int handle, AVPacket* packet, int64_t receive_time, int64_t capture_time);
+int mt_ffmpeg_stream_decoder_preevent_drop(int handle);
+void mt_ffmpeg_stream_decoder_free_preevent(struct mt_ffmpeg_stream_record_packet* packets, int head, int count, int size);
+int mt_ffmpeg_stream_decoder_wanted(int handle, AVPacket* packet);
+int mt_ffmpeg_stream_decoder_should_reconnect(int handle);
+int mt_ffmpeg_stream_decoder_same_codec(int handle, const AVCodecParameters* par);
+void mt_ffmpeg_stream_decoder_free_decoder(int handle);
+void mt_ffmpeg_stream_decoder_backoff(int handle, int delay_ms);
+int64_t mt_ffmpeg_stream_decoder_wall_clock(int handle, int64_t pts, int64_t start_time_realtime);
+int mt_ffmpeg_stream_decoder_histogram_bucket(uint64_t microseconds);
+uint64_t mt_ffmpeg_stream_decoder_histogram_value(int bucket);
+void mt_ffmpeg_stream_decoder_atomic_add(uint64_t* counter, uint64_t value);
+void mt_ffmpeg_stream_decoder_atomic_max(uint64_t* counter, uint64_t value);
+uint64_t mt_ffmpeg_stream_decoder_atomic_load(const uint64_t* counter);
+int mt_ffmpeg_stream_decoder_atomic_get(const int* value);
+void mt_ffmpeg_stream_decoder_atomic_set(int* value, int new_value);
+int mt_ffmpeg_stream_decoder_atomic_swap(int* value, int new_value);
+int mt_ffmpeg_stream_decoder_atomic_cas(int* value, int expected, int new_value);
+void mt_ffmpeg_stream_decoder_pool_wait(int handle);
+void mt_ffmpeg_stream_decoder_pool_run(int worker, int handle);
+void mt_ffmpeg_stream_decoder_pool_push(int worker, int handle);
+int mt_ffmpeg_stream_decoder_pool_pop(int worker);
+void mt_ffmpeg_stream_decoder_pool_thread(int worker);
+void mt_ffmpeg_stream_decoder_stop_pool();
+int mt_ffmpeg_stream_decoder_box_factor(struct OutputContext* out, int source_width, int source_height, int width, int height);
+int mt_ffmpeg_stream_decoder_yuv_to_rgb(AVFrame* picture, int is_bgr, unsigned char* dst, int dst_stride);
+uint8_t* mt_ffmpeg_stream_decoder_convert_buffer(struct OutputContext* out, int size);
+void mt_ffmpeg_stream_decoder_rgb_to_grey(const uint8_t* src, int src_stride, int is_bgr,
+										  uint8_t* dst, int dst_stride, int width, int height, int luma_weights);
 
 // must call this function before any other mt_ffmpeg_stream* function!
+// every user in the process calls it once, only the first call sets things up
 void mt_ffmpeg_stream_decoder_init()
 	{
+	if(num_users++ > 0)
+		return;
+
     avformat_network_init();
 //	av_log_set_level(AV_LOG_DEBUG);
 	memset(stream, 0, sizeof(stream));
+	num_open_streams = 0;
+	any_event = 0;
+
+#ifdef USE_WINDOWS_THREADING
+	InitializeCriticalSection(&cs_lock_any);
+	InitializeConditionVariable(&cv_any);
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_init(&cs_lock_any, NULL);
+
+	pthread_condattr_t cv_attr;
+	pthread_condattr_init(&cv_attr);
+	pthread_condattr_setclock(&cv_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cv_any, &cv_attr);
+	pthread_condattr_destroy(&cv_attr);
+#endif
 	}
 
 // call this function to release resources at the end of main application
-// it will also close all opened streams
+// it will also close all opened streams, when called by last user (earlier users must close their own streams)
 void mt_ffmpeg_stream_decoder_done()
 	{
 	int i;
+	if(num_users <= 0 || --num_users > 0)
+		return;
+
 	if(num_open_streams > 0)
 		{
 		for(i=0; i < MAX_STREAMS; i++)
 			mt_ffmpeg_stream_decoder_close(i);
 		}
+
+	mt_ffmpeg_stream_decoder_stop_pool();
+
+#ifdef USE_WINDOWS_THREADING
+	DeleteCriticalSection(&cs_lock_any);
+#endif
+#ifdef USE_PTHREADS
+	pthread_cond_destroy(&cv_any);
+	pthread_mutex_destroy(&cs_lock_any);
+#endif
+	}
+
+// fill options with defaults
+// decoder gets one thread per CPU core, libavcodec alone would decode on a single thread,
+// slice threading only: frame threading would hold back a frame per extra thread on live cameras, it's opt-in
+void mt_ffmpeg_stream_decoder_default_options(struct mt_ffmpeg_stream_options* options)
+	{
+	memset(options, 0, sizeof(*options));
+	options->thread_count = 0;
+	options->thread_type = FFMPEG_STREAM_THREAD_SLICE;
+	options->low_latency = 0;
+	options->transport = FFMPEG_STREAM_TRANSPORT_DEFAULT;
+	options->probesize = 0;
+	options->analyzeduration = 0;
+	options->reorder_queue_size = -1;
+	options->max_delay = -1;
+	options->codec_name[0] = 0;
+	options->listen = 0;
+	options->input_format[0] = 0;
+	options->passthrough = 0;
+	options->reconnect = -1;
+	options->reconnect_delay_ms = 250;
+	options->reconnect_max_delay_ms = 8000;
+	options->io_timeout_ms = 5000;
+	options->keep_all_frames = 0;
+	options->record_path[0] = 0;
+	strcpy(options->record_format, "mp4");
+	options->record_segment_s = 60;
+	options->record_max_files = 0;
+	options->record_queue_size = 0;
+	options->preevent_s = 0;
+	options->preevent_max_kb = 0;
 	}
 
-// opens IP stream by URI
+// opens IP stream by URI with default options
 // returns stream handle or (-1) on error
 // set width and height to 0 to grab frames in native resolution
 // it's a non-blocking function that will create separate thread and do all processing there
 // returning valid stream handle doesn't mean that IP stream is actually opened!
 // should be called only from main application thread!
 int mt_ffmpeg_stream_decoder_open(const char* uri, int width, int height)
+	{
+	return mt_ffmpeg_stream_decoder_open_ex(uri, width, height, NULL);
+	}
+
+// opens IP stream by URI with given options, NULL options means defaults
+// options are copied, caller's structure can be reused right away
+// should be called only from main application thread!
+int mt_ffmpeg_stream_decoder_open_ex(const char* uri, int width, int height, const struct mt_ffmpeg_stream_options* options)
 	{
 	int handle;
+	int i;
 #ifdef USE_WINDOWS_THREADING
 	DWORD thread_id;
 #endif
@@ -136,23 +439,119 @@ int mt_ffmpeg_stream_decoder_open(const char* uri, int width, int height)
 		handle = -1;
 		}
 
+	if(handle < 0 || handle >= MAX_STREAMS || strlen(uri) >= sizeof(stream[0].URI))
+		return -1;
+
 	// set stream to open
 	strcpy(stream[handle].URI, uri);
 	stream[handle].status = FFMPEG_STREAM_STATUS_CONNECTING;
-	stream[handle].target_width = width;
-	stream[handle].target_height = height;
-
-	if(width > 0 && height > 0)
-		stream[handle].framebuf = malloc(width * height * 3);
+	memset(stream[handle].outputs, 0, sizeof(stream[handle].outputs));
+	stream[handle].outputs[0].output.format = FFMPEG_STREAM_FORMAT_RGB24;
+	stream[handle].outputs[0].output.luma_weights = FFMPEG_STREAM_LUMA_BT601;
+	stream[handle].outputs[0].output.width = width;
+	stream[handle].outputs[0].output.height = height;
+	stream[handle].outputs[0].output.scale_filter = FFMPEG_STREAM_SCALE_FAST_BILINEAR;
+	stream[handle].num_outputs = 1;
+	stream[handle].source_width = 0;
+	stream[handle].source_height = 0;
+	memset(&stream[handle].times_lent, 0, sizeof(stream[handle].times_lent));
+	memset(&stream[handle].stats, 0, sizeof(stream[handle].stats));
+	memset(stream[handle].stages, 0, sizeof(stream[handle].stages));
+	stream[handle].codec_ctx = 0;
+	stream[handle].picture = 0;
+	stream[handle].bsf = 0;
+	stream[handle].codec_par = 0;
+	stream[handle].codec_id = AV_CODEC_ID_NONE;
+	stream[handle].queue_head = 0;
+	stream[handle].queue_count = 0;
+	stream[handle].queue_scheduled = 0;
+	stream[handle].queue_skip_to_key = 0;
+	stream[handle].any_event = 0;
+	stream[handle].decode_mode = FFMPEG_STREAM_DECODE_ALL;
+	stream[handle].skip_nonref = 0;
+	stream[handle].nonref_packets = 0;
+	stream[handle].nonref_frames = 0;
+	stream[handle].skip_to_key = 0;
+
+	if(options != NULL)
+		stream[handle].options = *options;
+	else
+		mt_ffmpeg_stream_decoder_default_options(&stream[handle].options);
+
+	// recorder's writer thread runs as long as stream is open, across reconnects
+	stream[handle].recorder = 0;
+	if(stream[handle].options.record_path[0] != 0)
+		stream[handle].recorder = mt_ffmpeg_stream_recorder_open(stream[handle].options.record_path, stream[handle].options.record_format,
+																  stream[handle].options.record_segment_s, stream[handle].options.record_max_files,
+																  stream[handle].options.record_queue_size);
+
+	// pre-event ring holds references only, packet data is allocated by demuxer as packets come
+	stream[handle].preevent = 0;
+	stream[handle].preevent_keys = 0;
+	stream[handle].preevent_size = 0;
+	if(stream[handle].options.preevent_s > 0)
+		{
+		stream[handle].preevent_size = stream[handle].options.preevent_s * PREEVENT_PACKETS_PER_SECOND;
+		stream[handle].preevent = av_calloc(stream[handle].preevent_size, sizeof(stream[handle].preevent[0]));
+		stream[handle].preevent_keys = av_calloc(stream[handle].preevent_size, sizeof(stream[handle].preevent_keys[0]));
+		if(stream[handle].preevent_keys == 0)
+			av_freep(&stream[handle].preevent);
+		}
+	stream[handle].preevent_head = 0;
+	stream[handle].preevent_count = 0;
+	stream[handle].preevent_key_head = 0;
+	stream[handle].preevent_key_count = 0;
+	stream[handle].preevent_bytes = 0;
+	stream[handle].preevent_shift = 0;
+	stream[handle].preevent_rebase = 0;
+	stream[handle].preevent_par = 0;
+	stream[handle].snapshot = 0;
+	stream[handle].snapshot_count = 0;
+	stream[handle].snapshot_par = 0;
+
+	// there is nothing to decode in passthrough mode
+	// nor in pool for streams keeping all frames, as they wait for application when their queue is full
+	stream[handle].use_pool = num_decode_workers > 0 && !stream[handle].options.passthrough && !stream[handle].options.keep_all_frames;
+
+	// frames only hold references to decoder buffers, no pixel memory is allocated here
+	for(i = 0; i < FRAME_QUEUE_SIZE; i++)
+		{
+		stream[handle].slot[i].frame = av_frame_alloc();
+		memset(&stream[handle].slot[i].times, 0, sizeof(stream[handle].slot[i].times));
+		}
+	stream[handle].slot_back = 0;
+	stream[handle].slot_middle = 1;
+	stream[handle].slot_spare = 2;
+	stream[handle].ring_head = 0;
+	stream[handle].ring_tail = 0;
+	stream[handle].frame_lent = av_frame_alloc();
+	stream[handle].packet_lent = av_packet_alloc();
 
 #ifdef USE_WINDOWS_THREADING
 	InitializeCriticalSection(&(stream[handle].cs_lock_frame));
+	InitializeConditionVariable(&(stream[handle].cv_new_frame));
+	InitializeConditionVariable(&(stream[handle].cv_frame_taken));
+	InitializeCriticalSection(&(stream[handle].cs_lock_queue));
+	InitializeConditionVariable(&(stream[handle].cv_queue_idle));
+	InitializeCriticalSection(&(stream[handle].cs_lock_preevent));
 #endif
 #ifdef USE_PTHREADS
 	pthread_mutex_init(&stream[handle].cs_lock_frame, NULL); //if   
+	pthread_mutex_init(&stream[handle].cs_lock_queue, NULL);
+	pthread_mutex_init(&stream[handle].cs_lock_preevent, NULL);
+
+	// use monotonic clock for timed waits so wall clock jumps (NTP) don't affect timeouts
+	pthread_condattr_t cv_attr;
+	pthread_condattr_init(&cv_attr);
+	pthread_condattr_setclock(&cv_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&stream[handle].cv_new_frame, &cv_attr);
+	pthread_cond_init(&stream[handle].cv_frame_taken, &cv_attr);
+	pthread_cond_init(&stream[handle].cv_queue_idle, &cv_attr);
+	pthread_condattr_destroy(&cv_attr);
 #endif
 
 	stream[handle].is_open = 1;
+	num_open_streams++;
 
 	// create and start working thread
 #ifdef USE_WINDOWS_THREADING
@@ -169,10 +568,29 @@ int mt_ffmpeg_stream_decoder_open(const char* uri, int width, int height)
 // should be called only from main application thread!
 void mt_ffmpeg_stream_decoder_close(int handle)
 	{
+	int i;
+
 	if(stream[handle].is_open)
 		{
-		// signal worker thread to close
+		// signal worker thread to close, wake it if keep_all_frames queue is full and it waits for us,
+		// or if it waits for decode pool, so it throws away packets pool hasn't got to yet
 		stream[handle].is_closing = 1;
+#ifdef USE_WINDOWS_THREADING
+		EnterCriticalSection(&(stream[handle].cs_lock_frame));
+		WakeAllConditionVariable(&(stream[handle].cv_frame_taken));
+		LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+		EnterCriticalSection(&(stream[handle].cs_lock_queue));
+		WakeAllConditionVariable(&(stream[handle].cv_queue_idle));
+		LeaveCriticalSection(&(stream[handle].cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+		pthread_cond_broadcast(&(stream[handle].cv_frame_taken));
+		pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+		pthread_mutex_lock(&(stream[handle].cs_lock_queue));
+		pthread_cond_broadcast(&(stream[handle].cv_queue_idle));
+		pthread_mutex_unlock(&(stream[handle].cs_lock_queue));
+#endif
 
 		// wait for thread to end gracefully for 3 seconds, otherwise kill it
 #ifdef USE_WINDOWS_THREADING
@@ -185,19 +603,49 @@ void mt_ffmpeg_stream_decoder_close(int handle)
 		pthread_join(stream[handle].thread_handle, NULL);
 #endif
 
-		if(stream[handle].framebuf != 0)
-			{
-			free(stream[handle].framebuf);
-			stream[handle].framebuf = 0;
-			}
+		for(i = 0; i < FRAME_QUEUE_SIZE; i++)
+			av_frame_free(&stream[handle].slot[i].frame);
+		av_frame_free(&stream[handle].frame_lent);
+		av_packet_free(&stream[handle].packet_lent);
+
+		// passthrough packets application didn't take, they stay available after end of stream until here
+		mt_ffmpeg_stream_decoder_drop_queue(handle);
+
+		// packets still queued for recording are written out, last file is finished
+		if(stream[handle].recorder != 0)
+			mt_ffmpeg_stream_recorder_close(stream[handle].recorder);
+		stream[handle].recorder = 0;
+
+		if(stream[handle].preevent != 0)
+			mt_ffmpeg_stream_decoder_free_preevent(stream[handle].preevent, stream[handle].preevent_head,
+												   stream[handle].preevent_count, stream[handle].preevent_size);
+		av_free(stream[handle].preevent);
+		stream[handle].preevent = 0;
+		av_freep(&stream[handle].preevent_keys);
+		if(stream[handle].preevent_par != 0)
+			avcodec_parameters_free(&stream[handle].preevent_par);
+		mt_ffmpeg_stream_decoder_free_preevent(stream[handle].snapshot, 0, stream[handle].snapshot_count, stream[handle].snapshot_count);
+		av_free(stream[handle].snapshot);
+		stream[handle].snapshot = 0;
+		if(stream[handle].snapshot_par != 0)
+			avcodec_parameters_free(&stream[handle].snapshot_par);
+
+		mt_ffmpeg_stream_decoder_free_outputs(handle);
 
 		stream[handle].is_closing = 0;
 
 #ifdef USE_WINDOWS_THREADING
 		DeleteCriticalSection(&(stream[handle].cs_lock_frame));
+		DeleteCriticalSection(&(stream[handle].cs_lock_queue));
+		DeleteCriticalSection(&(stream[handle].cs_lock_preevent));
 #endif
 #ifdef USE_PTHREADS
+		pthread_cond_destroy(&stream[handle].cv_new_frame);
+		pthread_cond_destroy(&stream[handle].cv_frame_taken);
+		pthread_cond_destroy(&stream[handle].cv_queue_idle);
 		pthread_mutex_destroy(&stream[handle].cs_lock_frame);
+		pthread_mutex_destroy(&stream[handle].cs_lock_queue);
+		pthread_mutex_destroy(&stream[handle].cs_lock_preevent);
 #endif
 
 		stream[handle].is_open = 0;
@@ -221,7 +669,7 @@ int mt_ffmpeg_stream_decoder_get_status(int handle)
 		pthread_mutex_lock(&(stream[handle].cs_lock_frame));
 #endif
 
-		status = stream[handle].status;
+		status = mt_ffmpeg_stream_decoder_app_status(handle);
 
 #ifdef USE_WINDOWS_THREADING
 		LeaveCriticalSection(&(stream[handle].cs_lock_frame));
@@ -234,62 +682,264 @@ int mt_ffmpeg_stream_decoder_get_status(int handle)
 	return status;
 	}
 
-// get frame width
+// wait until new frame is available, stream enters error state or timeout expires
+// timeout_ms < 0 waits forever, timeout_ms == 0 just returns current status
+// returns stream status, same values as mt_ffmpeg_stream_decoder_get_status()
 // should be called only from main application thread!
-int mt_ffmpeg_stream_decoder_get_frame_width(int handle)
+int mt_ffmpeg_stream_decoder_wait_frame(int handle, int timeout_ms)
 	{
-	int width = 0;
+	int status = FFMPEG_STREAM_STATUS_ERROR;
+#ifdef USE_PTHREADS
+	struct timespec deadline;
+#endif
 
 	if(stream[handle].is_open)
 		{
 #ifdef USE_WINDOWS_THREADING
-		// guard access with critical section
 		EnterCriticalSection(&(stream[handle].cs_lock_frame));
+
+		while((status = mt_ffmpeg_stream_decoder_app_status(handle)) != FFMPEG_STREAM_STATUS_NEW_FRAME && status != FFMPEG_STREAM_STATUS_ERROR && timeout_ms != 0)
+			{
+			// we don't track remaining time across spurious wakeups, good enough for a frame wait
+			if(!SleepConditionVariableCS(&(stream[handle].cv_new_frame), &(stream[handle].cs_lock_frame), timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms))
+				break;
+			}
+
+		status = mt_ffmpeg_stream_decoder_app_status(handle);
+
+		LeaveCriticalSection(&(stream[handle].cs_lock_frame));
 #endif
 #ifdef USE_PTHREADS
+		if(timeout_ms > 0)
+			{
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += timeout_ms / 1000;
+			deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+			if(deadline.tv_nsec >= 1000000000L)
+				{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+				}
+			}
+
 		pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+
+		while((status = mt_ffmpeg_stream_decoder_app_status(handle)) != FFMPEG_STREAM_STATUS_NEW_FRAME && status != FFMPEG_STREAM_STATUS_ERROR && timeout_ms != 0)
+			{
+			if(timeout_ms < 0)
+				pthread_cond_wait(&(stream[handle].cv_new_frame), &(stream[handle].cs_lock_frame));
+			else if(pthread_cond_timedwait(&(stream[handle].cv_new_frame), &(stream[handle].cs_lock_frame), &deadline) != 0)
+				break;
+			}
+
+		status = mt_ffmpeg_stream_decoder_app_status(handle);
+
+		pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
 #endif
+		}
+
+	return status;
+	}
 
-		width = stream[handle].target_width;
+// blocks until any open stream got new frame or went into error since previous call, or until timeout
+// (in milliseconds, < 0 waits forever)
+// returns 1 if something happened, caller then checks streams with mt_ffmpeg_stream_decoder_get_status(), 0 on timeout
+// events that arrive while caller is busy with streams are not lost, next call returns right away
+// should be called only from main application thread!
+int mt_ffmpeg_stream_decoder_wait_any(int timeout_ms)
+	{
+	int event;
+#ifdef USE_PTHREADS
+	struct timespec deadline;
+#endif
 
 #ifdef USE_WINDOWS_THREADING
-		LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+	EnterCriticalSection(&cs_lock_any);
+
+	while(!any_event && timeout_ms != 0)
+		{
+		if(!SleepConditionVariableCS(&cv_any, &cs_lock_any, timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms))
+			break;
+		}
+
+	event = any_event;
+	any_event = 0;
+
+	LeaveCriticalSection(&cs_lock_any);
 #endif
 #ifdef USE_PTHREADS
-		pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+	if(timeout_ms > 0)
+		{
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L)
+			{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+			}
+		}
+
+	pthread_mutex_lock(&cs_lock_any);
+
+	while(!any_event && timeout_ms != 0)
+		{
+		if(timeout_ms < 0)
+			pthread_cond_wait(&cv_any, &cs_lock_any);
+		else if(pthread_cond_timedwait(&cv_any, &cs_lock_any, &deadline) != 0)
+			break;
+		}
+
+	event = any_event;
+	any_event = 0;
+
+	pthread_mutex_unlock(&cs_lock_any);
+#endif
+
+	return event;
+	}
+
+// same as mt_ffmpeg_stream_decoder_wait_any() for listed streams only, events of other streams are left to their owners
+// lets several users share decoder in one process (e.g. nodelets in one manager), each waiting in its own thread
+int mt_ffmpeg_stream_decoder_wait_some(const int* handles, int count, int timeout_ms)
+	{
+	int event = 0;
+	int i;
+#ifdef USE_PTHREADS
+	struct timespec deadline;
 #endif
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&cs_lock_any);
+
+	for(;;)
+		{
+		for(i = 0; i < count; i++)
+			{
+			if(handles[i] >= 0 && handles[i] < MAX_STREAMS && stream[handles[i]].any_event)
+				{
+				stream[handles[i]].any_event = 0;
+				event = 1;
+				}
+			}
+		if(event || timeout_ms == 0)
+			break;
+		if(!SleepConditionVariableCS(&cv_any, &cs_lock_any, timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms))
+			break;
 		}
 
-	return width;
+	LeaveCriticalSection(&cs_lock_any);
+#endif
+#ifdef USE_PTHREADS
+	if(timeout_ms > 0)
+		{
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L)
+			{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+			}
+		}
+
+	pthread_mutex_lock(&cs_lock_any);
+
+	for(;;)
+		{
+		for(i = 0; i < count; i++)
+			{
+			if(handles[i] >= 0 && handles[i] < MAX_STREAMS && stream[handles[i]].any_event)
+				{
+				stream[handles[i]].any_event = 0;
+				event = 1;
+				}
+			}
+		if(event || timeout_ms == 0)
+			break;
+		if(timeout_ms < 0)
+			pthread_cond_wait(&cv_any, &cs_lock_any);
+		else if(pthread_cond_timedwait(&cv_any, &cs_lock_any, &deadline) != 0)
+			break;
+		}
+
+	pthread_mutex_unlock(&cs_lock_any);
+#endif
+
+	return event;
+	}
+
+// get frame width at output resolution
+// should be called only from main application thread!
+int mt_ffmpeg_stream_decoder_get_frame_width(int handle)
+	{
+	return mt_ffmpeg_stream_decoder_get_output_width(handle, 0);
 	}
 
-// get frame height
+// get frame height at output resolution
 // should be called only from main application thread!
 int mt_ffmpeg_stream_decoder_get_frame_height(int handle)
 	{
+	return mt_ffmpeg_stream_decoder_get_output_height(handle, 0);
+	}
+
+// size of output at index, for frame currently lent, or for latest decoded one
+// can also be called by application's threads converting outputs of lent frame
+int mt_ffmpeg_stream_decoder_get_output_width(int handle, int index)
+	{
+	int width = 0;
 	int height = 0;
 
-	if(stream[handle].is_open)
-		{
+	mt_ffmpeg_stream_decoder_output_frame(handle, index, &width, &height);
+	return width;
+	}
+
+int mt_ffmpeg_stream_decoder_get_output_height(int handle, int index)
+	{
+	int width = 0;
+	int height = 0;
+
+	mt_ffmpeg_stream_decoder_output_frame(handle, index, &width, &height);
+	return height;
+	}
+
+// output size of frame lent to us, or of latest decoded one, 0 x 0 before first frame
+// returns -1 if there is no such output
+int mt_ffmpeg_stream_decoder_output_frame(int handle, int index, int* width, int* height)
+	{
+	int source_width, source_height;
+
+	if(!stream[handle].is_open || index < 0 || index >= stream[handle].num_outputs)
+		return -1;
+
 #ifdef USE_WINDOWS_THREADING
-		// guard access with critical section
-		EnterCriticalSection(&(stream[handle].cs_lock_frame));
+	// guard access with critical section
+	EnterCriticalSection(&(stream[handle].cs_lock_frame));
 #endif
 #ifdef USE_PTHREADS
-		pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+	pthread_mutex_lock(&(stream[handle].cs_lock_frame));
 #endif
 
-		height = stream[handle].target_height;
+	if(stream[handle].frame_lent->data[0] != 0)
+		{
+		source_width = stream[handle].frame_lent->width;
+		source_height = stream[handle].frame_lent->height;
+		}
+	else
+		{
+		source_width = stream[handle].source_width;
+		source_height = stream[handle].source_height;
+		}
 
 #ifdef USE_WINDOWS_THREADING
-		LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+	LeaveCriticalSection(&(stream[handle].cs_lock_frame));
 #endif
 #ifdef USE_PTHREADS
-		pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+	pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
 #endif
-		}
 
-	return height;
+	mt_ffmpeg_stream_decoder_output_size(&stream[handle].outputs[index], source_width, source_height, width, height);
+	return 0;
 	}
 
 
@@ -323,261 +973,2606 @@ int mt_ffmpeg_stream_decoder_interrupt_callback(void *p)
 	}
 
 // function that actually connects to stream, receives and decodes frames - it will run inside separate thread
+// with decode pool running, this thread only reads packets and queues them, pool threads decode them
+// lost connections are supervised here: stream goes back to CONNECTING and is reopened with growing delay,
+// decoder (and bitstream filter) are kept when stream comes back with same codec, so recovery skips probing
 // will try to keep it as platform-independent as possible
 void mt_ffmpeg_stream_decoder_thread(int handle)
 	{
 	const AVCodec* codec = 0;
 	AVFormatContext* format_ctx = 0;
-	AVCodecContext* codec_ctx = 0;
-    uint8_t* picture_buffer = 0;
-    AVFrame* picture = 0;
-	AVFrame* picture_rgb = 0;
-	struct SwsContext* conversion_ctx = 0;
 	AVPacket* packet = 0;
+	AVDictionary* input_options = 0;
+	const AVInputFormat* input_format = 0;
 	int video_stream_index = -1;
 	int opened_ok = 0;
+	int reuse_decoder = 0;
+	int reconnect = mt_ffmpeg_stream_decoder_should_reconnect(handle);
+	int reconnect_delay = stream[handle].options.reconnect_delay_ms;
+	int packets_read = 0;
 	unsigned int i;
 
-	// try to open stream and start decoding
-	// break from for(ever) loop on errors, sort of poor man's exception handling
+	// packet of input data, reused for every read and every connection
+
+	packet = av_packet_alloc();
 
 	for(;;)
 		{
+		codec = 0;
+		input_format = 0;
+		video_stream_index = -1;
+		opened_ok = 0;
+		reuse_decoder = 0;
+		packets_read = 0;
+
+		for(i = 0; i < RECEIVE_TIME_SLOTS; i++)
+			stream[handle].receive_pts[i] = AV_NOPTS_VALUE;
+		stream[handle].receive_slot = 0;
+		stream[handle].last_receive_time = 0;
+
 		// try to open stream and start decoding
+		// break from for(ever) loop on errors, sort of poor man's exception handling
 
-		format_ctx = avformat_alloc_context();
+		for(;;)
+			{
+			// try to open stream and start decoding
 
-		// assign interrupt callback that will be periodically called by ffmpeg blocking functions
-		// to check if stream should be closed immediately
+			format_ctx = avformat_alloc_context();
 
-		format_ctx->interrupt_callback.callback = mt_ffmpeg_stream_decoder_interrupt_callback;
-		format_ctx->interrupt_callback.opaque = &(stream[handle]);
+			// assign interrupt callback that will be periodically called by ffmpeg blocking functions
+			// to check if stream should be closed immediately
 
-		// connect to URI
+			format_ctx->interrupt_callback.callback = mt_ffmpeg_stream_decoder_interrupt_callback;
+			format_ctx->interrupt_callback.opaque = &(stream[handle]);
 
-		if(avformat_open_input(&format_ctx, stream[handle].URI, NULL, NULL) < 0)
-			break;
+			// connect to URI, options that don't apply to this kind of input are left in dictionary and ignored
 
-		// get info on all elementary streams
+			input_options = mt_ffmpeg_stream_decoder_input_options(handle);
 
-		if(avformat_find_stream_info(format_ctx, NULL) < 0)
-			break;
+			// demuxer can be forced, e.g. lavfi test sources whose "URI" is a filter graph
 
-		// find video elementary stream
+			if(stream[handle].options.input_format[0] != 0)
+				{
+				input_format = av_find_input_format(stream[handle].options.input_format);
+				if(input_format == 0)
+					break;
+				}
 
-		for(i = 0; i < format_ctx->nb_streams; i++) 
-			{
-			if(format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-				video_stream_index = i;
-			}
+			if(avformat_open_input(&format_ctx, stream[handle].URI, input_format, &input_options) < 0)
+				break;
 
-		if(video_stream_index == -1)
-			break;
+			// video elementary stream as stream header (e.g. RTSP SDP) describes it
 
-		// send PLAY command for protocols that need that, like RTSP
+			for(i = 0; i < format_ctx->nb_streams; i++) 
+				{
+				if(format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+					video_stream_index = i;
+				}
 
-//		if(av_read_play(format_ctx) < 0)
-//			break;
+			// same stream as before reconnect: keep decoder, no probing needed
 
-		// find suitable decoder for video 
+			if(video_stream_index != -1)
+				reuse_decoder = mt_ffmpeg_stream_decoder_same_codec(handle, format_ctx->streams[video_stream_index]->codecpar);
 
-		codec = avcodec_find_decoder(format_ctx->streams[video_stream_index]->codecpar->codec_id);
+			// get info on all elementary streams
+			// that means decoding first frames, which can take seconds, not needed if we know codec and
+			// stream header (e.g. RTSP SDP) already told us where video is
 
-		if(codec == 0)
-			break;
+			for(i = 0; i < format_ctx->nb_streams && stream[handle].options.codec_name[0] != 0; i++) 
+				{
+				if(format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+					codec = avcodec_find_decoder_by_name(stream[handle].options.codec_name);
+				}
 
-		// initialize decoder
+			if(codec == 0 && !reuse_decoder)
+				{
+				if(avformat_find_stream_info(format_ctx, NULL) < 0)
+					break;
 
-		codec_ctx = avcodec_alloc_context3(codec);
-		avcodec_parameters_to_context(codec_ctx, format_ctx->streams[video_stream_index]->codecpar);
+				// find video elementary stream, probing may have found more
 
-		if(avcodec_open2(codec_ctx, codec, NULL) < 0)
-			break;
+				for(i = 0; i < format_ctx->nb_streams; i++) 
+					{
+					if(format_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+						video_stream_index = i;
+					}
+				}
 
-		// allocate picture buffer
+			if(video_stream_index == -1)
+				break;
 
-		picture = av_frame_alloc();
+			stream[handle].time_base = format_ctx->streams[video_stream_index]->time_base;
 
-		// allocate packet of input data
+			// send PLAY command for protocols that need that, like RTSP
 
-		packet = av_packet_alloc();
+//			if(av_read_play(format_ctx) < 0)
+//				break;
 
-		if(stream[handle].target_width > 0 && stream[handle].target_height > 0)
-			{
-			// allocate RGB picture buffer if we know frame dimensions beforehand
-			picture_rgb = mt_ffmpeg_stream_decoder_init_frame_rgb(stream[handle].target_width, stream[handle].target_height);
-			}
+			stream[handle].codec_id = format_ctx->streams[video_stream_index]->codecpar->codec_id;
 
-		// all done
-		opened_ok = 1;
-		stream[handle].status = FFMPEG_STREAM_STATUS_OK;
+			if(reuse_decoder)
+				{
+				// frames held back for old connection are useless now, decoding restarts at next keyframe
 
-		break;
-		}
+				if(stream[handle].codec_ctx != 0)
+					avcodec_flush_buffers(stream[handle].codec_ctx);
+				if(stream[handle].bsf != 0)
+					av_bsf_flush(stream[handle].bsf);
+				stream[handle].skip_to_key = 1;
+				}
+			else
+				{
+				// first connection, or stream changed while we were away
 
-	// stream opened, receive data and decode frames
+				mt_ffmpeg_stream_decoder_free_decoder(handle);
 
-	if(opened_ok && !stream[handle].is_closing)
-		{
-		// grabbing frames now
+				// passthrough mode needs no decoder, only bitstream filter for packets handed to application
 
-		while(!stream[handle].is_closing)
-			{
-			// try to read next frame or block until it is received
+				if(stream[handle].options.passthrough)
+					{
+					if(mt_ffmpeg_stream_decoder_open_bsf(handle, format_ctx->streams[video_stream_index]) < 0)
+						break;
+					}
+				else
+					{
+					// find suitable decoder for video, unless it was given
 
-			if(av_read_frame(format_ctx, packet) >= 0)
-				{
-				// discard frames from other elementary streams (audio)
+					if(codec == 0)
+						codec = avcodec_find_decoder(format_ctx->streams[video_stream_index]->codecpar->codec_id);
 
-				if(packet->stream_index == video_stream_index)
-					{
-					// send raw packet to decoder
+					if(codec == 0)
+						break;
+
+					// initialize decoder
+
+					stream[handle].codec_ctx = avcodec_alloc_context3(codec);
+					avcodec_parameters_to_context(stream[handle].codec_ctx, format_ctx->streams[video_stream_index]->codecpar);
 
-					if(avcodec_send_packet(codec_ctx, packet) == 0)
+					// threading has to be set up before avcodec_open2(), codec ignores changes afterwards
+					// frame threading holds back one frame per extra thread, low latency mode sticks to slice threading
+					// decode pool already spreads streams over all cores, so pooled streams decode single threaded by default
+
+					stream[handle].codec_ctx->thread_count = stream[handle].options.thread_count;
+					if(stream[handle].use_pool && stream[handle].options.thread_count == 0)
+						stream[handle].codec_ctx->thread_count = 1;
+
+					if(stream[handle].options.low_latency)
 						{
-						// decoding complete?
+						stream[handle].codec_ctx->thread_type = FF_THREAD_SLICE;
+						stream[handle].codec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+						}
+					else if(stream[handle].options.thread_type == FFMPEG_STREAM_THREAD_FRAME)
+						stream[handle].codec_ctx->thread_type = FF_THREAD_FRAME;
+					else if(stream[handle].options.thread_type == FFMPEG_STREAM_THREAD_SLICE)
+						stream[handle].codec_ctx->thread_type = FF_THREAD_SLICE;
+
+					if(avcodec_open2(stream[handle].codec_ctx, codec, NULL) < 0)
+						break;
 
-						if(avcodec_receive_frame(codec_ctx, picture) == 0)
-							{
-							// convert decoded YUV frame to RGB
-							if(conversion_ctx == 0)
-								{
-								if(picture_rgb == 0)
-									{
-									// allocate YUV frame buffer
-									stream[handle].target_width = picture->width;
-									stream[handle].target_height = picture->height;
-									stream[handle].framebuf = malloc(picture->width * picture->height * 3);
+					// allocate picture buffer
 
-									// allocate RGB frame
-									picture_rgb = mt_ffmpeg_stream_decoder_init_frame_rgb(stream[handle].target_width, stream[handle].target_height);
-									}
-								// initialize YUV to RGB conversion context
+					stream[handle].picture = av_frame_alloc();
+					}
 
-								conversion_ctx = sws_getContext(picture->width,
-																picture->height,
-																picture->format,
-																picture_rgb->width,
-																picture_rgb->height,
-																picture_rgb->format,
-																SWS_FAST_BILINEAR | SWS_FULL_CHR_H_INT | SWS_ACCURATE_RND,
-																NULL,
-																NULL,
-																NULL);
-								}
+				// remember what decoder was set up for, reconnect compares against it
 
-							sws_scale(conversion_ctx, picture->data, picture->linesize, 0, picture->height, picture_rgb->data, picture_rgb->linesize);
+				stream[handle].codec_par = avcodec_parameters_alloc();
+				avcodec_parameters_copy(stream[handle].codec_par, format_ctx->streams[video_stream_index]->codecpar);
+				}
 
-							//picture_rgb = avFrameConvertPixelFormat(picture, AV_PIX_FMT_RGB24, stream[handle].target_width, stream[handle].target_height);
+			// all done
+			opened_ok = 1;
 
-							// guard access to framebuf with critical section, 
-							// so main thread will not interfere while we are copying data
 #ifdef USE_WINDOWS_THREADING
-							EnterCriticalSection(&(stream[handle].cs_lock_frame));
+			EnterCriticalSection(&(stream[handle].cs_lock_frame));
 #endif
 #ifdef USE_PTHREADS
-							pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+			pthread_mutex_lock(&(stream[handle].cs_lock_frame));
 #endif
-							// copy converted RGB frame to buffer
-							memcpy(stream[handle].framebuf, picture_rgb->data[0], stream[handle].target_width * stream[handle].target_height * 3);
 
-							// signal new frame available
-							stream[handle].status = FFMPEG_STREAM_STATUS_NEW_FRAME;
+			stream[handle].status = FFMPEG_STREAM_STATUS_OK;
+
 #ifdef USE_WINDOWS_THREADING
-							LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+			LeaveCriticalSection(&(stream[handle].cs_lock_frame));
 #endif
 #ifdef USE_PTHREADS
-							pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+			pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
 #endif
-						}
-						}
-					}
-
-				// discard packet
+
+			break;
+			}
+
+		// stream opened, receive data and decode frames
+
+		if(opened_ok && !stream[handle].is_closing)
+			{
+			// every connection is recorded to files of its own, timestamps start over
+
+			if(stream[handle].recorder != 0)
+				mt_ffmpeg_stream_recorder_start(stream[handle].recorder, format_ctx->streams[video_stream_index]->codecpar,
+												stream[handle].time_base.num, stream[handle].time_base.den);
+
+			if(stream[handle].preevent != 0)
+				mt_ffmpeg_stream_decoder_preevent_start(handle, format_ctx->streams[video_stream_index]);
+
+			// grabbing frames now
+
+			while(!stream[handle].is_closing)
+				{
+				// try to read next frame or block until it is received
+				// end of stream and read errors both end the stream, decoder is flushed first
+
+				int64_t wait_start = av_gettime_relative();
+				int end_of_stream = av_read_frame(format_ctx, packet) < 0;
+
+				// time blocked here is network (or camera frame rate), any other thread stays busy meanwhile
+				if(!end_of_stream && packet->stream_index == video_stream_index)
+					mt_ffmpeg_stream_decoder_add_stage_time(handle, FFMPEG_STREAM_STAGE_DEMUX, av_gettime_relative() - wait_start);
+
+				// discard frames from other elementary streams (audio)
+
+				if(!end_of_stream && packet->stream_index != video_stream_index)
+					{
+					av_packet_unref(packet);
+					continue;
+					}
+
+				if(!end_of_stream)
+					{
+					mt_ffmpeg_stream_decoder_count(handle, &stream[handle].stats.packets);
+					packets_read++;
+					}
+
+				// recording and pre-event buffer take every packet, whoever watches and whatever gets decoded
+				// recorder's writer thread does file I/O, buffer only takes a reference
+
+				if(!end_of_stream && (stream[handle].recorder != 0 || stream[handle].preevent != 0))
+					{
+					int64_t receive_time = av_gettime();
+					int64_t capture_time = mt_ffmpeg_stream_decoder_wall_clock(handle, packet->pts, format_ctx->start_time_realtime);
+
+					if(stream[handle].recorder != 0)
+						mt_ffmpeg_stream_recorder_write(stream[handle].recorder, packet, receive_time, capture_time);
+					if(stream[handle].preevent != 0)
+						mt_ffmpeg_stream_decoder_preevent_add(handle, packet, receive_time, capture_time);
+					}
+
+				// nobody wants frames (or only keyframes), packet is read to keep connection alive and thrown away
+
+				if(!end_of_stream && !mt_ffmpeg_stream_decoder_wanted(handle, packet))
+					{
+					mt_ffmpeg_stream_decoder_count(handle, &stream[handle].stats.packets_skipped);
+					av_packet_unref(packet);
+					continue;
+					}
+
+				// decode here or leave it to pool, NULL packet flushes decoder
+				// in passthrough mode packet goes to application as it is
+
+				if(stream[handle].options.passthrough)
+					mt_ffmpeg_stream_decoder_passthrough(handle, end_of_stream ? NULL : packet, av_gettime(), format_ctx->start_time_realtime);
+				else if(stream[handle].use_pool)
+					mt_ffmpeg_stream_decoder_enqueue(handle, end_of_stream ? NULL : packet, av_gettime(), format_ctx->start_time_realtime);
+				else
+					mt_ffmpeg_stream_decoder_decode(handle, end_of_stream ? NULL : packet, av_gettime(), format_ctx->start_time_realtime);
+
+				// discard packet
 
 				av_packet_unref(packet);
+
+				if(end_of_stream)
+					break;
 				}
-			else
-				break;
+
+			// pool must be done with this stream before decoder is flushed for next connection or goes away
+			// queued packets still get decoded (flush included) unless stream is being closed
+
+			if(stream[handle].use_pool)
+				mt_ffmpeg_stream_decoder_pool_wait(handle);
 			}
+
+		// connection is done with, decoder stays for next one
+
+		if(input_options != 0)
+			av_dict_free(&input_options);
+
+		if(format_ctx != 0)
+			avformat_close_input(&format_ctx);
+
+		if(stream[handle].is_closing || !reconnect)
+			break;
+
+		// stream lost (or never came up): tell application we are connecting again and wait a while before that
+		// delay doubles on every failed attempt, connection that delivered packets starts over from shortest one
+
+		if(packets_read > 0)
+			reconnect_delay = stream[handle].options.reconnect_delay_ms;
+
+#ifdef USE_WINDOWS_THREADING
+		EnterCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+#endif
+		stream[handle].status = FFMPEG_STREAM_STATUS_CONNECTING;
+		stream[handle].stats.reconnects++;
+#ifdef USE_WINDOWS_THREADING
+		LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+#endif
+
+		mt_ffmpeg_stream_decoder_backoff(handle, reconnect_delay);
+
+		reconnect_delay *= 2;
+		if(reconnect_delay > stream[handle].options.reconnect_max_delay_ms)
+			reconnect_delay = stream[handle].options.reconnect_max_delay_ms;
 		}
 
 	// either we encountered some error or stream was closed by calling mt_ffmpeg_stream_decoder_close() from other thread
+	// wake up anybody waiting for a frame, there won't be any more
 
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+#endif
 	stream[handle].status = FFMPEG_STREAM_STATUS_ERROR;
+#ifdef USE_WINDOWS_THREADING
+	WakeAllConditionVariable(&(stream[handle].cv_new_frame));
+	LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_cond_broadcast(&(stream[handle].cv_new_frame));
+	pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+#endif
+	mt_ffmpeg_stream_decoder_signal_any(handle);
 
 	// cleanup
 
 	if(packet != 0)
 		av_packet_free(&packet);
 
-	if(picture_rgb != 0)
+	mt_ffmpeg_stream_decoder_free_decoder(handle);
+	}
+
+// whether lost stream is reopened: as asked for, or by default for network URIs (not files, devices or lavfi graphs)
+int mt_ffmpeg_stream_decoder_should_reconnect(int handle)
+	{
+	const char* uri = stream[handle].URI;
+
+	if(stream[handle].options.reconnect >= 0)
+		return stream[handle].options.reconnect;
+
+	return strstr(uri, "://") != 0 && strncmp(uri, "file:", 5) != 0 && stream[handle].options.input_format[0] == 0;
+	}
+
+// decoder is kept over reconnect if stream comes back with same codec and same out of band parameter sets,
+// in-band changes (new SPS, resolution) are handled by decoder itself and by per-frame conversion setup
+int mt_ffmpeg_stream_decoder_same_codec(int handle, const AVCodecParameters* par)
+	{
+	const AVCodecParameters* old = stream[handle].codec_par;
+
+	if(old == 0 || par->codec_id != old->codec_id)
+		return 0;
+
+	// no parameter sets in new header means they come in-band, old ones don't hurt then
+	if(par->extradata_size == 0)
+		return 1;
+
+	return par->extradata_size == old->extradata_size && memcmp(par->extradata, old->extradata, par->extradata_size) == 0;
+	}
+
+// decoder, its picture, bitstream filter and remembered codec parameters, all freed on close and when codec changes
+void mt_ffmpeg_stream_decoder_free_decoder(int handle)
+	{
+	if(stream[handle].picture != 0)
+		av_frame_free(&stream[handle].picture);
+
+	if(stream[handle].codec_ctx != 0)
+		avcodec_free_context(&stream[handle].codec_ctx);
+
+	if(stream[handle].bsf != 0)
+		av_bsf_free(&stream[handle].bsf);
+
+	if(stream[handle].codec_par != 0)
+		avcodec_parameters_free(&stream[handle].codec_par);
+	}
+
+// wait before next reconnect attempt, returns early if stream is being closed
+void mt_ffmpeg_stream_decoder_backoff(int handle, int delay_ms)
+	{
+	int64_t until = av_gettime_relative() + (int64_t)delay_ms * 1000;
+
+	while(!stream[handle].is_closing && av_gettime_relative() < until)
+		av_usleep(20000);
+	}
+
+// feed one packet to stream's decoder and hand every frame it produces over to main thread
+// decoder is fed and drained as a state machine: one packet may give several frames or none,
+// decoder may refuse packet (EAGAIN) until its output is drained, and it holds frames back
+// (reordering, frame threads) that only come out when it's flushed with NULL packet at end of stream
+// start_time_realtime is wall clock of stream start from RTCP sender reports (AV_NOPTS_VALUE if unknown)
+// runs in stream's own thread, or in one of decode pool threads, never in two at once
+void mt_ffmpeg_stream_decoder_decode(int handle, AVPacket* packet, int64_t receive_time, int64_t start_time_realtime)
+	{
+	AVCodecContext* codec_ctx = stream[handle].codec_ctx;
+	AVFrame* picture = stream[handle].picture;
+	struct mt_ffmpeg_stream_frame_times times;
+	int pending = 1;	// packet (or flush request) still has to be accepted by decoder
+	int flushed = 0;	// decoder returned AVERROR_EOF, nothing left
+	int64_t decode_start = av_gettime_relative();
+	int skip_nonref = mt_ffmpeg_stream_decoder_atomic_get(&stream[handle].skip_nonref);
+	int i;
+
+	// B-frames (and other frames nothing refers to) cost a decode but nobody would miss them when application lags behind,
+	// decoder drops them before doing any work, frame threads pick the setting up with next packet
+
+	codec_ctx->skip_frame = skip_nonref ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+	if(skip_nonref && packet != NULL)
+		mt_ffmpeg_stream_decoder_count(handle, &stream[handle].nonref_packets);
+
+	// remember when packet arrived, decoder may return its frame much later
+
+	if(packet != NULL)
+		{
+		stream[handle].last_receive_time = receive_time;
+		stream[handle].receive_pts[stream[handle].receive_slot] = packet->pts;
+		stream[handle].receive_time[stream[handle].receive_slot] = receive_time;
+		stream[handle].receive_slot = (stream[handle].receive_slot + 1) % RECEIVE_TIME_SLOTS;
+		}
+
+	// flush keeps going until decoder says it's empty
+
+	while((pending || packet == NULL) && !flushed)
+		{
+		int received = 0;
+		int ret;
+
+		// send raw packet to decoder, NULL packet starts flushing
+
+		ret = avcodec_send_packet(codec_ctx, packet);
+
+		if(ret != AVERROR(EAGAIN))
+			{
+			pending = 0;
+
+			// corrupt packet, whatever frame it belonged to is lost
+			if(ret < 0 && ret != AVERROR_EOF)
+				mt_ffmpeg_stream_decoder_count(handle, &stream[handle].stats.frames_dropped);
+			}
+
+		// take every frame decoder has ready
+
+		for(;;)
+			{
+			ret = avcodec_receive_frame(codec_ctx, picture);
+
+			if(ret == AVERROR(EAGAIN))
+				break;		// needs more input
+
+			if(ret == AVERROR_EOF)
+				{
+				flushed = 1;
+				break;
+				}
+
+			if(ret < 0)
+				{
+				mt_ffmpeg_stream_decoder_count(handle, &stream[handle].stats.frames_dropped);
+				break;
+				}
+
+			received++;
+			if(skip_nonref)
+				mt_ffmpeg_stream_decoder_count(handle, &stream[handle].nonref_frames);
+
+			// frame timing, packet that carried frame is found by pts
+			// capture time is known once RTCP sender reports mapped stream clock to wall clock
+			// best effort timestamp is pts, or decoder's guess from dts when camera doesn't send pts
+			times.decode_time = av_gettime();
+			times.receive_time = stream[handle].last_receive_time;
+			for(i = 0; i < RECEIVE_TIME_SLOTS && picture->pts != AV_NOPTS_VALUE; i++)
+				{
+				if(stream[handle].receive_pts[i] == picture->pts)
+					times.receive_time = stream[handle].receive_time[i];
+				}
+			times.capture_time = mt_ffmpeg_stream_decoder_wall_clock(handle, picture->best_effort_timestamp, start_time_realtime);
+
+			mt_ffmpeg_stream_decoder_frame_ready(handle, picture, &times);
+			}
+
+		// decoder refused packet but had nothing to give either, shouldn't happen, drop packet rather than spin
+		if(pending && received == 0)
+			{
+			mt_ffmpeg_stream_decoder_count(handle, &stream[handle].stats.frames_dropped);
+			pending = 0;
+			}
+		}
+
+	mt_ffmpeg_stream_decoder_add_stage_time(handle, FFMPEG_STREAM_STAGE_DECODE, av_gettime_relative() - decode_start);
+	}
+
+// queue packet for decode pool, called by stream's own thread, takes over packet's data
+// if pool falls behind and queue fills up, packets are dropped up to next keyframe (decoder can't resume earlier)
+// stream is handed to a pool thread unless it's already waiting there or being decoded
+void mt_ffmpeg_stream_decoder_enqueue(int handle, AVPacket* packet, int64_t receive_time, int64_t start_time_realtime)
+	{
+	struct StreamContext* s = &stream[handle];
+	int schedule = 0;
+	int dropped = 0;
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(s->cs_lock_queue));
+#endif
+
+	if(packet != NULL && s->queue_skip_to_key && (packet->flags & AV_PKT_FLAG_KEY))
+		s->queue_skip_to_key = 0;
+
+	// flush request is never dropped, oldest packet makes room for it
+	if(packet == NULL && s->queue_count == PACKET_QUEUE_SIZE)
 		{
-		av_freep(&picture_rgb->data[0]);
+		av_packet_free(&s->queue[s->queue_head].packet);
+		s->queue_head = (s->queue_head + 1) % PACKET_QUEUE_SIZE;
+		s->queue_count--;
+		dropped = 1;
+		}
 
-		av_frame_free(&picture_rgb);
+	if(packet != NULL && (s->queue_skip_to_key || s->queue_count == PACKET_QUEUE_SIZE))
+		{
+		s->queue_skip_to_key = 1;
+		dropped = 1;
 		}
+	else if(s->queue_count < PACKET_QUEUE_SIZE)
+		{
+		struct PacketEntry* e = &s->queue[(s->queue_head + s->queue_count) % PACKET_QUEUE_SIZE];
 
-	if(conversion_ctx != 0)
-		sws_freeContext(conversion_ctx);
+		e->packet = 0;
+		if(packet != NULL)
+			{
+			e->packet = av_packet_alloc();
+			av_packet_move_ref(e->packet, packet);
+			}
+		e->receive_time = receive_time;
+		e->start_time_realtime = start_time_realtime;
+		s->queue_count++;
 
-	if(picture != 0)
-		av_frame_free(&picture);
+		if(!s->queue_scheduled)
+			{
+			s->queue_scheduled = 1;
+			schedule = 1;
+			}
+		}
 
-	if(picture_buffer != 0)
-		av_free(picture_buffer);
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(s->cs_lock_queue));
+#endif
 
-	if(codec_ctx != 0)
-		avcodec_free_context(&codec_ctx);
+	if(dropped)
+		mt_ffmpeg_stream_decoder_count(handle, &s->stats.frames_dropped);
 
-	if(format_ctx != 0)
-		avformat_free_context(format_ctx);
+	// streams start on "their" pool thread, idle threads steal them from there
+	if(schedule)
+		mt_ffmpeg_stream_decoder_pool_push(handle % num_decode_workers, handle);
 	}
 
-// grab next frame, should be called only if mt_ffmpeg_stream_decoder_get_status() returned FFMPEG_STREAM_STATUS_NEW_FRAME
-// should be called from main application thread!
+// set up bitstream filter for passthrough mode, every H.264 / H.265 keyframe handed out has to carry parameter sets
+// so receivers can start there:
+// MP4-like containers give length-prefixed NAL units with parameter sets only in extradata (avcC / hvcC),
+// mp4toannexb rewrites them to Annex B byte stream and puts parameter sets in front of keyframes
+// RTSP and MPEG-TS already give Annex B, but many cameras send SPS/PPS only in SDP (sprop-parameter-sets),
+// which ends up in Annex B extradata: dump_extra puts it in front of keyframes that don't start with it already
+// other codecs get "null" filter
+int mt_ffmpeg_stream_decoder_open_bsf(int handle, AVStream* video)
+	{
+	const AVCodecParameters* par = video->codecpar;
+	const char* filters = "null";
+	int length_prefixed = par->extradata_size > 0 && par->extradata[0] == 1;	// avcC / hvcC start with version 1
 
-void mt_ffmpeg_stream_decoder_grab_frame(int handle, unsigned char* framebuf)
+	if(par->codec_id == AV_CODEC_ID_H264)
+		filters = length_prefixed ? "h264_mp4toannexb" : "dump_extra=freq=keyframe";
+	else if(par->codec_id == AV_CODEC_ID_HEVC)
+		filters = length_prefixed ? "hevc_mp4toannexb" : "dump_extra=freq=keyframe";
+
+	if(av_bsf_list_parse_str(filters, &stream[handle].bsf) < 0)
+		return -1;
+
+	avcodec_parameters_copy(stream[handle].bsf->par_in, video->codecpar);
+	stream[handle].bsf->time_base_in = video->time_base;
+
+	return av_bsf_init(stream[handle].bsf);
+	}
+
+// hand compressed packet over to application in passthrough mode, called by stream's own thread, takes over packet's data
+// application reads packet queue with mt_ffmpeg_stream_decoder_acquire_packet(), if it falls behind and queue fills up,
+// packets are dropped up to next keyframe, same as for decode pool (later packets are useless without earlier ones)
+// NULL packet drains bitstream filter at end of stream
+void mt_ffmpeg_stream_decoder_passthrough(int handle, AVPacket* packet, int64_t receive_time, int64_t start_time_realtime)
 	{
-	// guard access to framebuf with critical section
-	// ensure that working thread will not interfere while we are copying data
+	struct StreamContext* s = &stream[handle];
+	AVPacket* filtered;
+	int queued = 0;
+	int dropped = 0;
+
+	if(av_bsf_send_packet(s->bsf, packet) < 0)
+		{
+		mt_ffmpeg_stream_decoder_count(handle, &s->stats.frames_dropped);
+		return;
+		}
+
+	filtered = av_packet_alloc();
+
+	while(av_bsf_receive_packet(s->bsf, filtered) == 0)
+		{
 #ifdef USE_WINDOWS_THREADING
-	EnterCriticalSection(&(stream[handle].cs_lock_frame));
+		EnterCriticalSection(&(s->cs_lock_queue));
 #endif
 #ifdef USE_PTHREADS
-	pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+		pthread_mutex_lock(&(s->cs_lock_queue));
 #endif
 
-	// copy data
-	memcpy(framebuf, stream[handle].framebuf, stream[handle].target_width * stream[handle].target_height * 3);
-	stream[handle].status = FFMPEG_STREAM_STATUS_OK;
+		if(s->queue_skip_to_key && (filtered->flags & AV_PKT_FLAG_KEY))
+			s->queue_skip_to_key = 0;
+
+		if(s->queue_skip_to_key || s->queue_count == PACKET_QUEUE_SIZE)
+			{
+			s->queue_skip_to_key = 1;
+			av_packet_unref(filtered);
+			dropped++;
+			}
+		else
+			{
+			struct PacketEntry* e = &s->queue[(s->queue_head + s->queue_count) % PACKET_QUEUE_SIZE];
+
+			e->packet = filtered;
+			e->receive_time = receive_time;
+			e->start_time_realtime = start_time_realtime;
+			s->queue_count++;
+			queued = 1;
+			filtered = 0;
+			}
 
 #ifdef USE_WINDOWS_THREADING
-	LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+		LeaveCriticalSection(&(s->cs_lock_queue));
 #endif
 #ifdef USE_PTHREADS
-	pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+		pthread_mutex_unlock(&(s->cs_lock_queue));
+#endif
+
+		if(filtered == 0)
+			filtered = av_packet_alloc();
+		}
+
+	av_packet_free(&filtered);
+
+	for(; dropped > 0; dropped--)
+		mt_ffmpeg_stream_decoder_count(handle, &s->stats.frames_dropped);
+
+	// wake up main thread, NEW_FRAME status means packets are waiting in passthrough mode
+
+	if(queued)
+		{
+#ifdef USE_WINDOWS_THREADING
+		EnterCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_lock(&(s->cs_lock_frame));
+#endif
+
+		s->status = FFMPEG_STREAM_STATUS_NEW_FRAME;
+#ifdef USE_WINDOWS_THREADING
+		WakeAllConditionVariable(&(s->cv_new_frame));
+		LeaveCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+		pthread_cond_broadcast(&(s->cv_new_frame));
+		pthread_mutex_unlock(&(s->cs_lock_frame));
+#endif
+
+		mt_ffmpeg_stream_decoder_signal_any(handle);
+		}
+	}
+
+// wall clock time (as av_gettime()) when frame with given pts was captured, 0 if unknown
+// start_time_realtime is what RTSP demuxer learned from RTCP sender reports: wall clock at pts 0,
+// so it's only as good as camera's clock sync (NTP / PTP)
+int64_t mt_ffmpeg_stream_decoder_wall_clock(int handle, int64_t pts, int64_t start_time_realtime)
+	{
+	AVRational microseconds = { 1, 1000000 };
+
+	if(start_time_realtime == AV_NOPTS_VALUE || start_time_realtime <= 0 || pts == AV_NOPTS_VALUE)
+		return 0;
+
+	return start_time_realtime + av_rescale_q(pts, stream[handle].time_base, microseconds);
+	}
+
+// decide if packet goes to decoder (or to application in passthrough mode), called by stream's own thread
+// after skipped packets only keyframe can start decoding again, anything before it would decode to garbage
+int mt_ffmpeg_stream_decoder_wanted(int handle, AVPacket* packet)
+	{
+	struct StreamContext* s = &stream[handle];
+	int key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+	int mode;
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(s->cs_lock_frame));
+#endif
+	mode = s->decode_mode;
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(s->cs_lock_frame));
 #endif
+
+	if(mode == FFMPEG_STREAM_DECODE_NONE || (mode == FFMPEG_STREAM_DECODE_KEYFRAMES && !key))
+		{
+		s->skip_to_key = 1;
+		return 0;
+		}
+
+	if(s->skip_to_key && !key)
+		return 0;
+
+	s->skip_to_key = 0;
+	return 1;
 	}
 
+// throw away queued packets, called by close() after stream's own thread has ended
+// and by set_decode() when passthrough stream goes idle
+void mt_ffmpeg_stream_decoder_drop_queue(int handle)
+	{
+	struct StreamContext* s = &stream[handle];
 
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(s->cs_lock_queue));
+#endif
 
+	while(s->queue_count > 0)
+		{
+		av_packet_free(&s->queue[s->queue_head].packet);
+		s->queue_head = (s->queue_head + 1) % PACKET_QUEUE_SIZE;
+		s->queue_count--;
+		}
 
-// initialize frame with given width and height
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(s->cs_lock_queue));
+#endif
+	}
 
-AVFrame* mt_ffmpeg_stream_decoder_init_frame_rgb(int width, int height)
+// wait until decode pool is done with stream, called by stream's own thread before it frees decoder
+// queued packets are thrown away if stream is being closed, otherwise they're decoded first
+void mt_ffmpeg_stream_decoder_pool_wait(int handle)
 	{
-	AVFrame* picture = av_frame_alloc();
+	struct StreamContext* s = &stream[handle];
 
-	if(av_image_alloc(picture->data, picture->linesize, width, height, AV_PIX_FMT_RGB24, 1) < 0)
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(s->cs_lock_queue));
+#endif
+	for(;;)
 		{
-		av_frame_free(&picture);
-		return NULL;
+		if(s->is_closing)
+			{
+			while(s->queue_count > 0)
+				{
+				av_packet_free(&s->queue[s->queue_head].packet);
+				s->queue_head = (s->queue_head + 1) % PACKET_QUEUE_SIZE;
+				s->queue_count--;
+				}
+			}
+		if(!s->queue_scheduled)
+			break;
+
+		// pool thread wakes us when it finds queue drained, close() when queue is to be thrown away
+#ifdef USE_WINDOWS_THREADING
+		SleepConditionVariableCS(&(s->cv_queue_idle), &(s->cs_lock_queue), INFINITE);
+#endif
+#ifdef USE_PTHREADS
+		pthread_cond_wait(&(s->cv_queue_idle), &(s->cs_lock_queue));
+#endif
 		}
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(s->cs_lock_queue));
+#endif
+	}
 
-	picture->width = width;
-	picture->height = height;
-	picture->format = AV_PIX_FMT_RGB24;
+// decode up to DECODE_QUANTUM queued packets of one stream, called by pool thread
+// stream with more packets waiting goes to the back of the line so one busy camera can't starve others
+void mt_ffmpeg_stream_decoder_pool_run(int worker, int handle)
+	{
+	struct StreamContext* s = &stream[handle];
+	struct PacketEntry e;
+	int more = 0;
+	int n;
 
-	return picture;
+	for(n = 0; ; n++)
+		{
+		int have_packet = 0;
+
+#ifdef USE_WINDOWS_THREADING
+		EnterCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_lock(&(s->cs_lock_queue));
+#endif
+		if(s->queue_count == 0)
+			{
+			s->queue_scheduled = 0;		// drained, stream's own thread schedules it again with next packet
+#ifdef USE_WINDOWS_THREADING
+			WakeConditionVariable(&(s->cv_queue_idle));
+#endif
+#ifdef USE_PTHREADS
+			pthread_cond_signal(&(s->cv_queue_idle));
+#endif
+			}
+		else if(n == DECODE_QUANTUM)
+			more = 1;					// turn is over, stream stays scheduled
+		else
+			{
+			e = s->queue[s->queue_head];
+			s->queue_head = (s->queue_head + 1) % PACKET_QUEUE_SIZE;
+			s->queue_count--;
+			have_packet = 1;
+			}
+#ifdef USE_WINDOWS_THREADING
+		LeaveCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_unlock(&(s->cs_lock_queue));
+#endif
+
+		if(!have_packet)
+			break;
+
+		mt_ffmpeg_stream_decoder_decode(handle, e.packet, e.receive_time, e.start_time_realtime);
+		if(e.packet != 0)
+			av_packet_free(&e.packet);
+		}
+
+	if(more)
+		mt_ffmpeg_stream_decoder_pool_push(worker, handle);
+	}
+
+// append stream to pool thread's task deque and wake up an idle pool thread
+void mt_ffmpeg_stream_decoder_pool_push(int worker, int handle)
+	{
+	struct DecodeWorker* w = &decode_worker[worker];
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(w->cs_lock_tasks));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(w->cs_lock_tasks));
+#endif
+	w->tasks[(w->task_head + w->task_count) % MAX_STREAMS] = handle;
+	w->task_count++;
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(w->cs_lock_tasks));
+
+	EnterCriticalSection(&cs_lock_pool);
+	decode_pending++;
+	WakeConditionVariable(&cv_pool);
+	LeaveCriticalSection(&cs_lock_pool);
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(w->cs_lock_tasks));
+
+	pthread_mutex_lock(&cs_lock_pool);
+	decode_pending++;
+	pthread_cond_signal(&cv_pool);
+	pthread_mutex_unlock(&cs_lock_pool);
+#endif
+	}
+
+// take stream from front of own deque, or steal one from back of another pool thread's deque
+// returns stream handle or -1 if all deques are empty
+int mt_ffmpeg_stream_decoder_pool_pop(int worker)
+	{
+	int handle = -1;
+	int i;
+
+	for(i = 0; i < num_decode_workers && handle < 0; i++)
+		{
+		struct DecodeWorker* w = &decode_worker[(worker + i) % num_decode_workers];
+
+#ifdef USE_WINDOWS_THREADING
+		EnterCriticalSection(&(w->cs_lock_tasks));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_lock(&(w->cs_lock_tasks));
+#endif
+		if(w->task_count > 0)
+			{
+			if(i == 0)
+				{
+				handle = w->tasks[w->task_head];
+				w->task_head = (w->task_head + 1) % MAX_STREAMS;
+				}
+			else
+				handle = w->tasks[(w->task_head + w->task_count - 1) % MAX_STREAMS];
+			w->task_count--;
+			}
+#ifdef USE_WINDOWS_THREADING
+		LeaveCriticalSection(&(w->cs_lock_tasks));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_unlock(&(w->cs_lock_tasks));
+#endif
+		}
+
+	return handle;
+	}
+
+// decode pool thread
+void mt_ffmpeg_stream_decoder_pool_thread(int worker)
+	{
+	for(;;)
+		{
+		int handle = mt_ffmpeg_stream_decoder_pool_pop(worker);
+
+		// decode_pending counts tasks sitting in deques, it's taken down for every task popped
+		// and thread sleeps only while it's 0, so a task pushed between pop and sleep isn't missed
+#ifdef USE_WINDOWS_THREADING
+		EnterCriticalSection(&cs_lock_pool);
+		if(handle >= 0)
+			decode_pending--;
+		else
+			{
+			while(decode_pending == 0 && !decode_stopping)
+				SleepConditionVariableCS(&cv_pool, &cs_lock_pool, INFINITE);
+			}
+		LeaveCriticalSection(&cs_lock_pool);
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_lock(&cs_lock_pool);
+		if(handle >= 0)
+			decode_pending--;
+		else
+			{
+			while(decode_pending == 0 && !decode_stopping)
+				pthread_cond_wait(&cv_pool, &cs_lock_pool);
+			}
+		pthread_mutex_unlock(&cs_lock_pool);
+#endif
+
+		if(handle >= 0)
+			mt_ffmpeg_stream_decoder_pool_run(worker, handle);
+		else if(decode_stopping)
+			break;
+		}
+	}
+
+#ifdef USE_WINDOWS_THREADING
+ UINT mt_ffmpeg_stream_decoder_start_pool_thread(LPVOID param)
+	{
+	mt_ffmpeg_stream_decoder_pool_thread((int)(UINT_PTR)param);
+	return 0;
+	}
+#endif
+
+#ifdef USE_PTHREADS
+ void* mt_ffmpeg_stream_decoder_start_pool_thread(void* thread_argument)
+	{
+	mt_ffmpeg_stream_decoder_pool_thread((int)(intptr_t)thread_argument);
+	return 0;
+	}
+#endif
+
+// start shared decode pool with given number of threads, 0 = one per CPU core
+// streams opened afterwards are only demuxed by their own threads, pool threads decode them
+// returns number of pool threads started
+// should be called only from main application thread, after mt_ffmpeg_stream_decoder_init() and before opening streams!
+int mt_ffmpeg_stream_decoder_start_pool(int workers)
+	{
+	int i;
+#ifdef USE_WINDOWS_THREADING
+	DWORD thread_id;
+#endif
+
+	if(num_decode_workers > 0)
+		return num_decode_workers;
+
+	if(workers <= 0)
+		workers = av_cpu_count();
+	if(workers > MAX_DECODE_WORKERS)
+		workers = MAX_DECODE_WORKERS;
+
+	decode_pending = 0;
+	decode_stopping = 0;
+
+#ifdef USE_WINDOWS_THREADING
+	InitializeCriticalSection(&cs_lock_pool);
+	InitializeConditionVariable(&cv_pool);
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_init(&cs_lock_pool, NULL);
+	pthread_cond_init(&cv_pool, NULL);
+#endif
+
+	for(i = 0; i < workers; i++)
+		{
+		decode_worker[i].task_head = 0;
+		decode_worker[i].task_count = 0;
+#ifdef USE_WINDOWS_THREADING
+		InitializeCriticalSection(&(decode_worker[i].cs_lock_tasks));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_init(&(decode_worker[i].cs_lock_tasks), NULL);
+#endif
+		}
+
+	// workers must be known before any of them looks for work to steal
+	num_decode_workers = workers;
+
+	for(i = 0; i < workers; i++)
+		{
+#ifdef USE_WINDOWS_THREADING
+		decode_worker[i].thread_handle = CreateThread(NULL, 0,
+			(LPTHREAD_START_ROUTINE)(mt_ffmpeg_stream_decoder_start_pool_thread), (LPVOID)(UINT_PTR)i, 0, &thread_id);
+#endif
+#ifdef USE_PTHREADS
+		pthread_create(&(decode_worker[i].thread_handle), NULL, mt_ffmpeg_stream_decoder_start_pool_thread, (void*)(intptr_t)i);
+#endif
+		}
+
+	return workers;
+	}
+
+// stop decode pool threads, streams using the pool must be closed already
+void mt_ffmpeg_stream_decoder_stop_pool()
+	{
+	int i;
+
+	if(num_decode_workers == 0)
+		return;
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&cs_lock_pool);
+	decode_stopping = 1;
+	WakeAllConditionVariable(&cv_pool);
+	LeaveCriticalSection(&cs_lock_pool);
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&cs_lock_pool);
+	decode_stopping = 1;
+	pthread_cond_broadcast(&cv_pool);
+	pthread_mutex_unlock(&cs_lock_pool);
+#endif
+
+	for(i = 0; i < num_decode_workers; i++)
+		{
+#ifdef USE_WINDOWS_THREADING
+		WaitForSingleObject(decode_worker[i].thread_handle, INFINITE);
+		CloseHandle(decode_worker[i].thread_handle);
+		DeleteCriticalSection(&(decode_worker[i].cs_lock_tasks));
+#endif
+#ifdef USE_PTHREADS
+		pthread_join(decode_worker[i].thread_handle, NULL);
+		pthread_mutex_destroy(&(decode_worker[i].cs_lock_tasks));
+#endif
+		}
+
+#ifdef USE_WINDOWS_THREADING
+	DeleteCriticalSection(&cs_lock_pool);
+#endif
+#ifdef USE_PTHREADS
+	pthread_cond_destroy(&cv_pool);
+	pthread_mutex_destroy(&cs_lock_pool);
+#endif
+
+	num_decode_workers = 0;
+	}
+
+// hand decoded picture over to main thread, called by worker thread
+// previous frame is overwritten (and counted as such) if main thread didn't pick it up in time,
+// in keep_all_frames mode we wait for main thread instead
+void mt_ffmpeg_stream_decoder_frame_ready(int handle, AVFrame* picture, const struct mt_ffmpeg_stream_frame_times* times)
+	{
+	struct StreamContext* s = &stream[handle];
+	int width = picture->width;
+	int height = picture->height;
+	int overwritten = 0;
+	int slot;
+	int tail;
+
+	if(s->options.keep_all_frames)
+		{
+		// queue full: application is behind, hold decoding (and reading) back until it takes a frame
+		// acquire_frame() frees slot before it signals under cs_lock_frame, so checking under that lock misses no wakeup
+#ifdef USE_WINDOWS_THREADING
+		EnterCriticalSection(&(s->cs_lock_frame));
+		while(mt_ffmpeg_stream_decoder_frames_waiting(handle) >= FRAME_QUEUE_SIZE && !s->is_closing)
+			SleepConditionVariableCS(&(s->cv_frame_taken), &(s->cs_lock_frame), INFINITE);
+		LeaveCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_lock(&(s->cs_lock_frame));
+		while(mt_ffmpeg_stream_decoder_frames_waiting(handle) >= FRAME_QUEUE_SIZE && !s->is_closing)
+			pthread_cond_wait(&(s->cv_frame_taken), &(s->cs_lock_frame));
+		pthread_mutex_unlock(&(s->cs_lock_frame));
+#endif
+		if(s->is_closing)
+			{
+			av_frame_unref(picture);
+			return;
+			}
+
+		// fill slot first, then let main thread see it
+		tail = s->ring_tail;
+		slot = tail & (FRAME_QUEUE_SIZE - 1);
+		av_frame_move_ref(s->slot[slot].frame, picture);
+		s->slot[slot].times = *times;
+		mt_ffmpeg_stream_decoder_atomic_set(&s->ring_tail, (tail + 1) & (2 * FRAME_QUEUE_SIZE - 1));
+		}
+	else
+		{
+		// hand reference-counted picture over, no pixels are copied
+		av_frame_move_ref(s->slot[s->slot_back].frame, picture);
+		s->slot[s->slot_back].times = *times;
+
+		// publish it as middle slot, previous middle one comes back to us
+		slot = mt_ffmpeg_stream_decoder_atomic_swap(&s->slot_middle, s->slot_back | FRAME_SLOT_FRESH);
+		overwritten = (slot & FRAME_SLOT_FRESH) != 0;
+		s->slot_back = slot & FRAME_SLOT_INDEX;
+
+		// main thread didn't take that frame in time (or dropped it), its buffers go back to decoder
+		av_frame_unref(s->slot[s->slot_back].frame);
+		}
+
+	// lock is needed only for counters and to wake up main thread if it waits,
+	// frame is already published, so wait_frame() either sees it or gets woken up
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(s->cs_lock_frame));
+#endif
+	// remember native resolution, output size is derived from it
+	s->source_width = width;
+	s->source_height = height;
+
+	s->stats.frames_decoded++;
+	if(overwritten)
+		s->stats.frames_overwritten++;
+
+#ifdef USE_WINDOWS_THREADING
+	WakeAllConditionVariable(&(s->cv_new_frame));
+	LeaveCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_cond_broadcast(&(s->cv_new_frame));
+	pthread_mutex_unlock(&(s->cs_lock_frame));
+#endif
+
+	mt_ffmpeg_stream_decoder_signal_any(handle);
+	}
+
+// number of decoded frames application can acquire, without lock
+int mt_ffmpeg_stream_decoder_frames_waiting(int handle)
+	{
+	struct StreamContext* s = &stream[handle];
+
+	if(s->options.passthrough)
+		return 0;
+	if(s->options.keep_all_frames)
+		return (mt_ffmpeg_stream_decoder_atomic_get(&s->ring_tail) - mt_ffmpeg_stream_decoder_atomic_get(&s->ring_head)) & (2 * FRAME_QUEUE_SIZE - 1);
+	return (mt_ffmpeg_stream_decoder_atomic_get(&s->slot_middle) & FRAME_SLOT_FRESH) != 0;
+	}
+
+// status as application sees it, called with cs_lock_frame held
+// waiting decoded frames make it NEW_FRAME, even after stream ended, so last frames can still be taken
+int mt_ffmpeg_stream_decoder_app_status(int handle)
+	{
+	if(mt_ffmpeg_stream_decoder_frames_waiting(handle) > 0)
+		return FFMPEG_STREAM_STATUS_NEW_FRAME;
+	return stream[handle].status;
+	}
+
+// wake up thread waiting in mt_ffmpeg_stream_decoder_wait_any(), called by worker threads
+// after stream's own lock is released, so the two locks are never held together
+void mt_ffmpeg_stream_decoder_signal_any(int handle)
+	{
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&cs_lock_any);
+	any_event = 1;
+	stream[handle].any_event = 1;
+	WakeAllConditionVariable(&cv_any);
+	LeaveCriticalSection(&cs_lock_any);
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&cs_lock_any);
+	any_event = 1;
+	stream[handle].any_event = 1;
+	pthread_cond_broadcast(&cv_any);
+	pthread_mutex_unlock(&cs_lock_any);
+#endif
+	}
+
+// bump one of stream's stats counters, called by worker thread
+void mt_ffmpeg_stream_decoder_count(int handle, uint64_t* counter)
+	{
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+#endif
+	(*counter)++;
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+#endif
+	}
+
+// copy of stream's counters, consistent with each other
+// discarded frames never leave decoder, they are packets it took in FFMPEG_STREAM_DECODE_REFERENCE mode without returning a frame
+void mt_ffmpeg_stream_decoder_get_stats(int handle, struct mt_ffmpeg_stream_stats* stats)
+	{
+	struct mt_ffmpeg_stream_record_stats record;
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+#endif
+	*stats = stream[handle].stats;
+	if(stream[handle].nonref_packets > stream[handle].nonref_frames)
+		stats->frames_discarded = stream[handle].nonref_packets - stream[handle].nonref_frames;
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+#endif
+
+	if(stream[handle].recorder != 0)
+		{
+		mt_ffmpeg_stream_recorder_get_stats(stream[handle].recorder, &record);
+		stats->packets_recorded = record.packets_written;
+		stats->packets_not_recorded = record.packets_dropped;
+		stats->record_files = record.files;
+		}
+	}
+
+// atomic counter helpers for stage statistics, relaxed ordering is enough for statistics
+void mt_ffmpeg_stream_decoder_atomic_add(uint64_t* counter, uint64_t value)
+	{
+#ifdef _MSC_VER
+	InterlockedExchangeAdd64((volatile LONG64*)counter, (LONG64)value);
+#else
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+#endif
+	}
+
+void mt_ffmpeg_stream_decoder_atomic_max(uint64_t* counter, uint64_t value)
+	{
+	uint64_t old = mt_ffmpeg_stream_decoder_atomic_load(counter);
+
+	while(value > old)
+		{
+#ifdef _MSC_VER
+		uint64_t seen = (uint64_t)InterlockedCompareExchange64((volatile LONG64*)counter, (LONG64)value, (LONG64)old);
+		if(seen == old)
+			break;
+		old = seen;
+#else
+		if(__atomic_compare_exchange_n(counter, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+#endif
+		}
+	}
+
+uint64_t mt_ffmpeg_stream_decoder_atomic_load(const uint64_t* counter)
+	{
+#ifdef _MSC_VER
+	return (uint64_t)InterlockedCompareExchange64((volatile LONG64*)counter, 0, 0);
+#else
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+#endif
+	}
+
+// atomic int helpers for lock-free frame handoff: what one side wrote before set / swap
+// is visible to other side after it read the value with get / swap
+int mt_ffmpeg_stream_decoder_atomic_get(const int* value)
+	{
+#ifdef _MSC_VER
+	return (int)InterlockedCompareExchange((volatile LONG*)value, 0, 0);
+#else
+	return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+	}
+
+void mt_ffmpeg_stream_decoder_atomic_set(int* value, int new_value)
+	{
+#ifdef _MSC_VER
+	InterlockedExchange((volatile LONG*)value, (LONG)new_value);
+#else
+	__atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+#endif
+	}
+
+int mt_ffmpeg_stream_decoder_atomic_swap(int* value, int new_value)
+	{
+#ifdef _MSC_VER
+	return (int)InterlockedExchange((volatile LONG*)value, (LONG)new_value);
+#else
+	return __atomic_exchange_n(value, new_value, __ATOMIC_ACQ_REL);
+#endif
+	}
+
+// returns 1 if value was expected one and got replaced
+int mt_ffmpeg_stream_decoder_atomic_cas(int* value, int expected, int new_value)
+	{
+#ifdef _MSC_VER
+	return InterlockedCompareExchange((volatile LONG*)value, (LONG)new_value, (LONG)expected) == (LONG)expected;
+#else
+	return __atomic_compare_exchange_n(value, &expected, new_value, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+	}
+
+// histogram bucket of duration: exact below 4 us, then 4 buckets per power of two (at most 19% wide),
+// so few hundred bytes per stage cover microseconds to minutes with constant relative precision, like HDR histograms
+int mt_ffmpeg_stream_decoder_histogram_bucket(uint64_t microseconds)
+	{
+	int octave = 0;
+	int bucket;
+
+	if(microseconds < 4)
+		return (int)microseconds;
+
+	while((microseconds >> octave) >= 8)
+		octave++;
+
+	// microseconds >> octave is 4..7 here
+	bucket = 4 + octave * 4 + (int)((microseconds >> octave) - 4);
+	if(bucket >= FFMPEG_STREAM_HISTOGRAM_BUCKETS)
+		bucket = FFMPEG_STREAM_HISTOGRAM_BUCKETS - 1;
+
+	return bucket;
+	}
+
+// smallest duration falling into bucket
+uint64_t mt_ffmpeg_stream_decoder_histogram_value(int bucket)
+	{
+	if(bucket < 4)
+		return (uint64_t)bucket;
+
+	return (uint64_t)(4 + (bucket - 4) % 4) << ((bucket - 4) / 4);
+	}
+
+// account time spent in one stage for one frame (or packet)
+// lock-free, so decoder threads, pool threads and application threads can all report without waiting on each other
+void mt_ffmpeg_stream_decoder_add_stage_time(int handle, int stage, int64_t microseconds)
+	{
+	struct mt_ffmpeg_stream_stage_stats* st;
+	uint64_t us = microseconds > 0 ? (uint64_t)microseconds : 0;
+
+	if(handle < 0 || handle >= MAX_STREAMS || stage < 0 || stage >= FFMPEG_STREAM_STAGES)
+		return;
+
+	st = &stream[handle].stages[stage];
+	mt_ffmpeg_stream_decoder_atomic_add(&st->count, 1);
+	mt_ffmpeg_stream_decoder_atomic_add(&st->total_us, us);
+	mt_ffmpeg_stream_decoder_atomic_max(&st->max_us, us);
+	mt_ffmpeg_stream_decoder_atomic_add(&st->buckets[mt_ffmpeg_stream_decoder_histogram_bucket(us)], 1);
+	}
+
+// snapshot of one stage's counters since open, fields are read one by one while others keep counting,
+// so they can be off by the few frames in flight, good enough for statistics
+void mt_ffmpeg_stream_decoder_get_stage_stats(int handle, int stage, struct mt_ffmpeg_stream_stage_stats* stats)
+	{
+	const struct mt_ffmpeg_stream_stage_stats* st;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if(handle < 0 || handle >= MAX_STREAMS || stage < 0 || stage >= FFMPEG_STREAM_STAGES)
+		return;
+
+	st = &stream[handle].stages[stage];
+	stats->count = mt_ffmpeg_stream_decoder_atomic_load(&st->count);
+	stats->total_us = mt_ffmpeg_stream_decoder_atomic_load(&st->total_us);
+	stats->max_us = mt_ffmpeg_stream_decoder_atomic_load(&st->max_us);
+	for(i = 0; i < FFMPEG_STREAM_HISTOGRAM_BUCKETS; i++)
+		stats->buckets[i] = mt_ffmpeg_stream_decoder_atomic_load(&st->buckets[i]);
+	}
+
+// duration below which given fraction (0.5 = median, 0.99 ...) of samples fall, middle of bucket it lands in
+// works on difference of two snapshots too, for percentiles over an interval
+int64_t mt_ffmpeg_stream_decoder_stage_percentile(const struct mt_ffmpeg_stream_stage_stats* stats, double fraction)
+	{
+	uint64_t total = 0;
+	uint64_t seen = 0;
+	uint64_t rank;
+	int i;
+
+	for(i = 0; i < FFMPEG_STREAM_HISTOGRAM_BUCKETS; i++)
+		total += stats->buckets[i];
+
+	if(total == 0)
+		return 0;
+
+	rank = (uint64_t)(fraction * (double)total);
+	if(rank >= total)
+		rank = total - 1;
+
+	for(i = 0; i < FFMPEG_STREAM_HISTOGRAM_BUCKETS; i++)
+		{
+		seen += stats->buckets[i];
+		if(seen > rank)
+			break;
+		}
+
+	if(i >= FFMPEG_STREAM_HISTOGRAM_BUCKETS - 1)
+		return (int64_t)mt_ffmpeg_stream_decoder_histogram_value(FFMPEG_STREAM_HISTOGRAM_BUCKETS - 1);
+
+	return (int64_t)((mt_ffmpeg_stream_decoder_histogram_value(i) + mt_ffmpeg_stream_decoder_histogram_value(i + 1)) / 2);
+	}
+
+// take over latest decoded frame (oldest queued one in keep_all_frames mode), should be called only if
+// mt_ffmpeg_stream_decoder_get_status() or mt_ffmpeg_stream_decoder_wait_frame() returned FFMPEG_STREAM_STATUS_NEW_FRAME
+// frame stays lent to caller until mt_ffmpeg_stream_decoder_release_frame(), worker thread keeps decoding
+// into other buffers meanwhile, so no copy is made here, and no lock is taken until frame is ours
+// returns 1 if frame was acquired, 0 if there was no new frame
+// should be called from main application thread!
+int mt_ffmpeg_stream_decoder_acquire_frame(int handle)
+	{
+	struct StreamContext* s = &stream[handle];
+	struct FrameSlot* taken = 0;
+	int head;
+	int slot;
+
+	if(s->options.keep_all_frames)
+		{
+		head = s->ring_head;
+		if(mt_ffmpeg_stream_decoder_atomic_get(&s->ring_tail) != head)
+			taken = &s->slot[head & (FRAME_QUEUE_SIZE - 1)];
+		}
+	else if(mt_ffmpeg_stream_decoder_atomic_get(&s->slot_middle) & FRAME_SLOT_FRESH)
+		{
+		// take middle slot, leave our empty one there
+		slot = mt_ffmpeg_stream_decoder_atomic_swap(&s->slot_middle, s->slot_spare);
+		s->slot_spare = slot & FRAME_SLOT_INDEX;
+
+		// mt_ffmpeg_stream_decoder_set_decode() may have dropped it meanwhile
+		if(slot & FRAME_SLOT_FRESH)
+			taken = &s->slot[s->slot_spare];
+		else
+			av_frame_unref(s->slot[s->slot_spare].frame);
+		}
+
+	if(taken == 0)
+		return 0;
+
+	av_frame_unref(s->frame_lent);
+	av_frame_move_ref(s->frame_lent, taken->frame);
+	s->times_lent = taken->times;
+
+	// slot is empty again, in keep_all_frames mode worker thread may fill it from now on, wake it if queue was full
+	if(s->options.keep_all_frames)
+		{
+		mt_ffmpeg_stream_decoder_atomic_set(&s->ring_head, (head + 1) & (2 * FRAME_QUEUE_SIZE - 1));
+#ifdef USE_WINDOWS_THREADING
+		EnterCriticalSection(&(s->cs_lock_frame));
+		WakeConditionVariable(&(s->cv_frame_taken));
+		LeaveCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_lock(&(s->cs_lock_frame));
+		pthread_cond_signal(&(s->cv_frame_taken));
+		pthread_mutex_unlock(&(s->cs_lock_frame));
+#endif
+		}
+
+	mt_ffmpeg_stream_decoder_count(handle, &s->stats.frames_acquired);
+
+	// how long frame waited for application, long waits mean main thread is the bottleneck
+	if(s->times_lent.decode_time > 0)
+		mt_ffmpeg_stream_decoder_add_stage_time(handle, FFMPEG_STREAM_STAGE_HANDOFF, av_gettime() - s->times_lent.decode_time);
+
+	return 1;
+	}
+
+// convert lent frame at target resolution in selected output format (see mt_ffmpeg_stream_decoder_set_output()),
+// writing straight into caller's buffer
+// dst_stride is number of bytes between rows of dst, at least output width * bytes per pixel
+// returns 0 on success, -1 if no frame is lent or conversion failed
+// should be called from main application thread!
+int mt_ffmpeg_stream_decoder_convert_frame(int handle, unsigned char* dst, int dst_stride)
+	{
+	return mt_ffmpeg_stream_decoder_convert_output(handle, 0, dst, dst_stride);
+	}
+
+// same for output at index (see mt_ffmpeg_stream_decoder_set_outputs())
+// outputs have conversion state of their own and lent frame is only read,
+// so while frame is lent, different outputs can be converted at once by different threads
+int mt_ffmpeg_stream_decoder_convert_output(int handle, int index, unsigned char* dst, int dst_stride)
+	{
+	AVFrame* picture = stream[handle].frame_lent;
+	struct OutputContext* out;
+	int64_t convert_start = av_gettime_relative();
+	int x, y, width, height;
+	int ret;
+
+	if(picture == 0 || picture->data[0] == 0 || index < 0 || index >= stream[handle].num_outputs)
+		return -1;
+
+	out = &stream[handle].outputs[index];
+
+	// crop by reference: view's plane pointers start at top left of rectangle, swscale and kernels read nothing else
+	mt_ffmpeg_stream_decoder_crop_size(&out->output, picture->width, picture->height, &x, &y, &width, &height);
+	if(width != picture->width || height != picture->height)
+		{
+		if(av_frame_ref(out->view, picture) < 0)
+			return -1;
+		out->view->crop_left = x;
+		out->view->crop_top = y;
+		out->view->crop_right = picture->width - x - width;
+		out->view->crop_bottom = picture->height - y - height;
+		if(av_frame_apply_cropping(out->view, AV_FRAME_CROP_UNALIGNED) < 0)
+			{
+			av_frame_unref(out->view);
+			return -1;
+			}
+		picture = out->view;
+		}
+
+	switch(out->output.format)
+		{
+		case FFMPEG_STREAM_FORMAT_GREY:	ret = mt_ffmpeg_stream_decoder_convert_grey(out, picture, dst, dst_stride);						break;
+		case FFMPEG_STREAM_FORMAT_BGR24:	ret = mt_ffmpeg_stream_decoder_convert_rgb(out, picture, AV_PIX_FMT_BGR24, dst, dst_stride);		break;
+		case FFMPEG_STREAM_FORMAT_UYVY:	ret = mt_ffmpeg_stream_decoder_convert_yuv(out, picture, AV_PIX_FMT_UYVY422, dst, dst_stride);	break;
+		case FFMPEG_STREAM_FORMAT_YUYV:	ret = mt_ffmpeg_stream_decoder_convert_yuv(out, picture, AV_PIX_FMT_YUYV422, dst, dst_stride);	break;
+		case FFMPEG_STREAM_FORMAT_NV12:	ret = mt_ffmpeg_stream_decoder_convert_yuv(out, picture, AV_PIX_FMT_NV12, dst, dst_stride);		break;
+		default:							ret = mt_ffmpeg_stream_decoder_convert_rgb(out, picture, AV_PIX_FMT_RGB24, dst, dst_stride);		break;
+		}
+
+	av_frame_unref(out->view);
+
+	mt_ffmpeg_stream_decoder_add_stage_time(handle, FFMPEG_STREAM_STAGE_CONVERT, av_gettime_relative() - convert_start);
+
+	return ret;
+	}
+
+// convert picture to packed RGB-like pixel format with swscale
+int mt_ffmpeg_stream_decoder_convert_rgb(struct OutputContext* out, AVFrame* picture, enum AVPixelFormat dst_format, unsigned char* dst, int dst_stride)
+	{
+	uint8_t* dst_data[4] = { dst, 0, 0, 0 };
+	int dst_linesize[4] = { dst_stride, 0, 0, 0 };
+	int width, height;
+
+	mt_ffmpeg_stream_decoder_output_size(out, picture->width, picture->height, &width, &height);
+
+	// YUV 4:2:0 sources go through vectorized kernels when nearest chroma sample is what was asked for (point filter
+	// at native size), or when output is exact 1/2 or 1/4 of native size with area filter, which box filter reproduces
+	if(dst_format == AV_PIX_FMT_RGB24 || dst_format == AV_PIX_FMT_BGR24)
+		{
+		int box = mt_ffmpeg_stream_decoder_box_factor(out, picture->width, picture->height, width, height);
+		int is_bgr = dst_format == AV_PIX_FMT_BGR24;
+
+		// decoder already gave us what we want (RGB sources like MJPEG RGB or raw video)
+		if(box == 1 && picture->format == dst_format)
+			{
+			av_image_copy_plane(dst, dst_stride, picture->data[0], picture->linesize[0], width * 3, height);
+			return 0;
+			}
+
+		if(box == 1 && out->output.scale_filter == FFMPEG_STREAM_SCALE_POINT &&
+		   mt_ffmpeg_stream_decoder_yuv_to_rgb(picture, is_bgr, dst, dst_stride) == 0)
+			return 0;
+
+		if(box > 1)
+			{
+			int rgb_stride = picture->width * 3;
+			uint8_t* rgb = mt_ffmpeg_stream_decoder_convert_buffer(out, rgb_stride * picture->height);
+
+			if(rgb != 0 && mt_ffmpeg_stream_decoder_yuv_to_rgb(picture, is_bgr, rgb, rgb_stride) == 0)
+				{
+				if(box == 2)
+					mt_ffmpeg_stream_kernels_get()->box_2x(rgb, rgb_stride, dst, dst_stride, width, height, 3);
+				else
+					mt_ffmpeg_stream_kernels_get()->box_4x(rgb, rgb_stride, dst, dst_stride, width, height, 3);
+				return 0;
+				}
+			}
+		}
+
+	// (re)initialize conversion context, it's only rebuilt if source or destination format changes
+	// scaling is done in the same pass as colour conversion
+	out->conversion_ctx = sws_getCachedContext(out->conversion_ctx,
+														 picture->width,
+														 picture->height,
+														 (enum AVPixelFormat)picture->format,
+														 width,
+														 height,
+														 dst_format,
+														 mt_ffmpeg_stream_decoder_sws_flags(out) | SWS_FULL_CHR_H_INT | SWS_ACCURATE_RND,
+														 NULL,
+														 NULL,
+														 NULL);
+	if(out->conversion_ctx == 0)
+		return -1;
+
+	sws_scale(out->conversion_ctx, (const uint8_t* const*)picture->data, picture->linesize, 0, picture->height, dst_data, dst_linesize);
+
+	return 0;
+	}
+
+// convert picture to YUV output format (NV12, UYVY or YUYV)
+// native formats and plain repacks at output size skip swscale, everything else is converted (and scaled) by it
+int mt_ffmpeg_stream_decoder_convert_yuv(struct OutputContext* out, AVFrame* picture, enum AVPixelFormat dst_format, unsigned char* dst, int dst_stride)
+	{
+	uint8_t* dst_data[4] = { dst, 0, 0, 0 };
+	int dst_linesize[4] = { dst_stride, 0, 0, 0 };
+	int width, height;
+
+	mt_ffmpeg_stream_decoder_output_size(out, picture->width, picture->height, &width, &height);
+
+	if(width == picture->width && height == picture->height && mt_ffmpeg_stream_decoder_repack_yuv(picture, dst_format, dst, dst_stride) == 0)
+		return 0;
+
+	// NV12 chroma plane follows luma rows in caller's buffer
+	if(dst_format == AV_PIX_FMT_NV12)
+		{
+		dst_data[1] = dst + (size_t)dst_stride * height;
+		dst_linesize[1] = dst_stride;
+		}
+
+	out->conversion_ctx = sws_getCachedContext(out->conversion_ctx,
+														 picture->width,
+														 picture->height,
+														 (enum AVPixelFormat)picture->format,
+														 width,
+														 height,
+														 dst_format,
+														 mt_ffmpeg_stream_decoder_sws_flags(out),
+														 NULL,
+														 NULL,
+														 NULL);
+	if(out->conversion_ctx == 0)
+		return -1;
+
+	sws_scale(out->conversion_ctx, (const uint8_t* const*)picture->data, picture->linesize, 0, picture->height, dst_data, dst_linesize);
+
+	return 0;
+	}
+
+// copy picture at native size into YUV output format when no sample has to be computed:
+// same format, planar 4:2:0 to NV12 (chroma interleaved), planar 4:2:2 to UYVY / YUYV (all planes interleaved)
+// returns -1 if picture needs real conversion
+int mt_ffmpeg_stream_decoder_repack_yuv(AVFrame* picture, enum AVPixelFormat dst_format, unsigned char* dst, int dst_stride)
+	{
+	int width = picture->width;
+	int height = picture->height;
+	int chroma_width = (width + 1) / 2;
+	int chroma_height = (height + 1) / 2;
+	int x, y;
+
+	if(dst_format == AV_PIX_FMT_NV12)
+		{
+		uint8_t* dst_uv = dst + (size_t)dst_stride * height;
+
+		if(picture->format == AV_PIX_FMT_NV12)
+			{
+			av_image_copy_plane(dst, dst_stride, picture->data[0], picture->linesize[0], width, height);
+			av_image_copy_plane(dst_uv, dst_stride, picture->data[1], picture->linesize[1], chroma_width * 2, chroma_height);
+			return 0;
+			}
+
+		if(picture->format != AV_PIX_FMT_YUV420P && picture->format != AV_PIX_FMT_YUVJ420P)
+			return -1;
+
+		av_image_copy_plane(dst, dst_stride, picture->data[0], picture->linesize[0], width, height);
+		for(y = 0; y < chroma_height; y++)
+			{
+			const uint8_t* u = picture->data[1] + (size_t)picture->linesize[1] * y;
+			const uint8_t* v = picture->data[2] + (size_t)picture->linesize[2] * y;
+			uint8_t* uv = dst_uv + (size_t)dst_stride * y;
+
+			for(x = 0; x < chroma_width; x++)
+				{
+				uv[2 * x] = u[x];
+				uv[2 * x + 1] = v[x];
+				}
+			}
+		return 0;
+		}
+
+	// packed 4:2:2
+	if(picture->format == dst_format)
+		{
+		av_image_copy_plane(dst, dst_stride, picture->data[0], picture->linesize[0], chroma_width * 4, height);
+		return 0;
+		}
+
+	if(picture->format != AV_PIX_FMT_YUV422P && picture->format != AV_PIX_FMT_YUVJ422P)
+		return -1;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* luma = picture->data[0] + (size_t)picture->linesize[0] * y;
+		const uint8_t* u = picture->data[1] + (size_t)picture->linesize[1] * y;
+		const uint8_t* v = picture->data[2] + (size_t)picture->linesize[2] * y;
+		uint8_t* row = dst + (size_t)dst_stride * y;
+
+		// odd width: last pair repeats last luma sample
+		for(x = 0; x < chroma_width; x++)
+			{
+			uint8_t y0 = luma[2 * x];
+			uint8_t y1 = 2 * x + 1 < width ? luma[2 * x + 1] : y0;
+
+			if(dst_format == AV_PIX_FMT_UYVY422)
+				{
+				row[4 * x] = u[x];
+				row[4 * x + 1] = y0;
+				row[4 * x + 2] = v[x];
+				row[4 * x + 3] = y1;
+				}
+			else
+				{
+				row[4 * x] = y0;
+				row[4 * x + 1] = u[x];
+				row[4 * x + 2] = y1;
+				row[4 * x + 3] = v[x];
+				}
+			}
+		}
+	return 0;
+	}
+
+// bytes per row needed for width pixels in output format, 4:2:2 rows hold whole pixel pairs
+int mt_ffmpeg_stream_decoder_format_stride(int format, int width)
+	{
+	switch(format)
+		{
+		case FFMPEG_STREAM_FORMAT_GREY:
+		case FFMPEG_STREAM_FORMAT_NV12:	return width;
+		case FFMPEG_STREAM_FORMAT_UYVY:
+		case FFMPEG_STREAM_FORMAT_YUYV:	return (width + 1) / 2 * 4;
+		default:							return width * 3;
+		}
+	}
+
+// rows of output image in caller's buffer, NV12 chroma rows come after luma rows
+int mt_ffmpeg_stream_decoder_format_rows(int format, int height)
+	{
+	if(format == FFMPEG_STREAM_FORMAT_NV12)
+		return height + (height + 1) / 2;
+	return height;
+	}
+
+// make greyscale image from picture
+// YUV sources already carry grey image in their luma plane, so it's just copied row by row, no RGB is ever built
+// other sources are weighted to luma with BT.601 or BT.709 coefficients
+int mt_ffmpeg_stream_decoder_convert_grey(struct OutputContext* out, AVFrame* picture, unsigned char* dst, int dst_stride)
+	{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((enum AVPixelFormat)picture->format);
+	int width, height;
+	int rgb_stride;
+	uint8_t* rgb;
+
+	if(desc == 0)
+		return -1;
+
+	mt_ffmpeg_stream_decoder_output_size(out, picture->width, picture->height, &width, &height);
+	rgb_stride = width * 3;
+
+	// 8-bit luma in a plane of its own: planar YUV, NV12/NV21 and GRAY8
+	if(!(desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) &&
+	   desc->comp[0].plane == 0 && desc->comp[0].step == 1 && desc->comp[0].depth == 8 &&
+	   (desc->nb_components == 1 || desc->comp[1].plane != 0))
+		{
+		int box = mt_ffmpeg_stream_decoder_box_factor(out, picture->width, picture->height, width, height);
+
+		if(box == 1)
+			{
+			av_image_copy_plane(dst, dst_stride, picture->data[0], picture->linesize[0], width, height);
+			}
+		else if(box == 2)
+			{
+			mt_ffmpeg_stream_kernels_get()->box_2x(picture->data[0], picture->linesize[0], dst, dst_stride, width, height, 1);
+			}
+		else if(box == 4)
+			{
+			mt_ffmpeg_stream_kernels_get()->box_4x(picture->data[0], picture->linesize[0], dst, dst_stride, width, height, 1);
+			}
+		else
+			{
+			// scale luma plane alone as if it was a GRAY8 picture
+			uint8_t* dst_data[4] = { dst, 0, 0, 0 };
+			int dst_linesize[4] = { dst_stride, 0, 0, 0 };
+
+			out->conversion_ctx = sws_getCachedContext(out->conversion_ctx,
+																 picture->width,
+																 picture->height,
+																 AV_PIX_FMT_GRAY8,
+																 width,
+																 height,
+																 AV_PIX_FMT_GRAY8,
+																 mt_ffmpeg_stream_decoder_sws_flags(out),
+																 NULL,
+																 NULL,
+																 NULL);
+			if(out->conversion_ctx == 0)
+				return -1;
+
+			sws_scale(out->conversion_ctx, (const uint8_t* const*)picture->data, picture->linesize, 0, picture->height, dst_data, dst_linesize);
+			}
+		return 0;
+		}
+
+	// packed 24-bit RGB source at target size can be weighted in place
+	if((picture->format == AV_PIX_FMT_RGB24 || picture->format == AV_PIX_FMT_BGR24) &&
+	   picture->width == width && picture->height == height)
+		{
+		mt_ffmpeg_stream_decoder_rgb_to_grey(picture->data[0], picture->linesize[0], picture->format == AV_PIX_FMT_BGR24,
+											 dst, dst_stride, width, height, out->output.luma_weights);
+		return 0;
+		}
+
+	// anything else goes through intermediate RGB24 buffer
+	rgb = mt_ffmpeg_stream_decoder_convert_buffer(out, rgb_stride * height);
+	if(rgb == 0)
+		return -1;
+
+	if(mt_ffmpeg_stream_decoder_convert_rgb(out, picture, AV_PIX_FMT_RGB24, rgb, rgb_stride) < 0)
+		return -1;
+
+	mt_ffmpeg_stream_decoder_rgb_to_grey(rgb, rgb_stride, 0, dst, dst_stride, width, height, out->output.luma_weights);
+	return 0;
+	}
+
+// weighted RGB to luma, coefficients scaled by 256 so they sum up to exactly 256
+void mt_ffmpeg_stream_decoder_rgb_to_grey(const uint8_t* src, int src_stride, int is_bgr,
+										  uint8_t* dst, int dst_stride, int width, int height, int luma_weights)
+	{
+	int wr, wg, wb;
+
+	if(luma_weights == FFMPEG_STREAM_LUMA_BT709)
+		{
+		wr = 54; wg = 183; wb = 19;		// 0.2126, 0.7152, 0.0722
+		}
+	else
+		{
+		wr = 77; wg = 150; wb = 29;		// 0.299, 0.587, 0.114
+		}
+
+	if(is_bgr)
+		{
+		int t = wr;
+		wr = wb;
+		wb = t;
+		}
+
+	mt_ffmpeg_stream_kernels_get()->rgb_to_grey(src, src_stride, dst, dst_stride, width, height, wr, wg, wb);
+	}
+
+// convert 8-bit YUV 4:2:0 picture at native size to packed RGB24 / BGR24 with vectorized kernels
+// colour matrix and range come from the stream, unspecified matrix is taken as BT.601 like swscale does
+// returns -1 if picture isn't in one of supported formats
+int mt_ffmpeg_stream_decoder_yuv_to_rgb(AVFrame* picture, int is_bgr, unsigned char* dst, int dst_stride)
+	{
+	const struct mt_ffmpeg_stream_kernels* kernels = mt_ffmpeg_stream_kernels_get();
+	int matrix = picture->colorspace == AVCOL_SPC_BT709 ? FFMPEG_STREAM_KERNEL_BT709 : FFMPEG_STREAM_KERNEL_BT601;
+	int full_range = picture->color_range == AVCOL_RANGE_JPEG || picture->format == AV_PIX_FMT_YUVJ420P;
+
+	switch(picture->format)
+		{
+		case AV_PIX_FMT_YUV420P:
+		case AV_PIX_FMT_YUVJ420P:
+			kernels->yuv420p_to_rgb(picture->data[0], picture->linesize[0], picture->data[1], picture->linesize[1],
+									picture->data[2], picture->linesize[2], dst, dst_stride, picture->width, picture->height,
+									is_bgr, matrix, full_range);
+			return 0;
+
+		case AV_PIX_FMT_NV12:
+			kernels->nv12_to_rgb(picture->data[0], picture->linesize[0], picture->data[1], picture->linesize[1],
+								 dst, dst_stride, picture->width, picture->height, is_bgr, matrix, full_range);
+			return 0;
+
+		default:
+			return -1;
+		}
+	}
+
+// grow intermediate conversion buffer to at least size bytes
+// returns NULL if allocation failed
+uint8_t* mt_ffmpeg_stream_decoder_convert_buffer(struct OutputContext* out, int size)
+	{
+	if(out->convert_buf_size < size)
+		{
+		av_free(out->convert_buf);
+		out->convert_buf = (uint8_t*)av_malloc(size);
+		out->convert_buf_size = out->convert_buf ? size : 0;
+		}
+
+	return out->convert_buf;
+	}
+
+// choose how much of stream gets decoded, so streams nobody watches cost next to nothing
+// switching back to FFMPEG_STREAM_DECODE_ALL resumes at next keyframe (straight away from FFMPEG_STREAM_DECODE_REFERENCE, nothing was skipped)
+// FFMPEG_STREAM_DECODE_NONE also drops frame (or passthrough packets) waiting for application,
+// it would be stale by the time anybody wants it
+// wakes up mt_ffmpeg_stream_decoder_wait_*() callers, so frame kept by FFMPEG_STREAM_DECODE_KEYFRAMES can be taken right away
+// can be called from any thread
+void mt_ffmpeg_stream_decoder_set_decode(int handle, int mode)
+	{
+	int slot;
+
+	if(handle < 0 || handle >= MAX_STREAMS || !stream[handle].is_open)
+		return;
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+#endif
+
+	stream[handle].decode_mode = mode;
+
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+#endif
+
+	mt_ffmpeg_stream_decoder_atomic_set(&stream[handle].skip_nonref, mode == FFMPEG_STREAM_DECODE_REFERENCE);
+
+	if(mode == FFMPEG_STREAM_DECODE_NONE && stream[handle].options.passthrough)
+		mt_ffmpeg_stream_decoder_drop_queue(handle);
+
+	// waiting frame would be stale by the time anybody wants it, mark it taken (worker thread frees it with next frame)
+	// frames queued in keep_all_frames mode are kept, they are all wanted
+	if(mode == FFMPEG_STREAM_DECODE_NONE && !stream[handle].options.passthrough && !stream[handle].options.keep_all_frames)
+		{
+		slot = mt_ffmpeg_stream_decoder_atomic_get(&stream[handle].slot_middle);
+		if(slot & FRAME_SLOT_FRESH)
+			mt_ffmpeg_stream_decoder_atomic_cas(&stream[handle].slot_middle, slot, slot & FRAME_SLOT_INDEX);
+		}
+
+	mt_ffmpeg_stream_decoder_signal_any(handle);
+	}
+
+// current decode mode, FFMPEG_STREAM_DECODE_*
+int mt_ffmpeg_stream_decoder_get_decode(int handle)
+	{
+	int mode = FFMPEG_STREAM_DECODE_ALL;
+
+	if(handle < 0 || handle >= MAX_STREAMS || !stream[handle].is_open)
+		return mode;
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(stream[handle].cs_lock_frame));
+#endif
+
+	mode = stream[handle].decode_mode;
+
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(stream[handle].cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(stream[handle].cs_lock_frame));
+#endif
+
+	return mode;
+	}
+
+// select format and size of frames produced by mt_ffmpeg_stream_decoder_convert_frame()
+// leaves just this one output
+// should be called only from main application thread!
+void mt_ffmpeg_stream_decoder_set_output(int handle, const struct mt_ffmpeg_stream_output* output)
+	{
+	mt_ffmpeg_stream_decoder_set_outputs(handle, output, 1);
+	}
+
+// several outputs from one decoded stream, e.g. full size crop plus scaled overview, converted by
+// mt_ffmpeg_stream_decoder_convert_output() with their index, first one is also what convert_frame() produces
+// should be called only from main application thread, while no frame is lent!
+int mt_ffmpeg_stream_decoder_set_outputs(int handle, const struct mt_ffmpeg_stream_output* outputs, int count)
+	{
+	int i;
+
+	if(count < 1 || count > FFMPEG_STREAM_MAX_OUTPUTS)
+		return -1;
+
+	for(i = 0; i < count; i++)
+		{
+		stream[handle].outputs[i].output = outputs[i];
+		if(stream[handle].outputs[i].view == 0)
+			stream[handle].outputs[i].view = av_frame_alloc();
+		}
+	stream[handle].num_outputs = count;
+
+	// pick pixel kernels now, before threads converting outputs could race to do it
+	mt_ffmpeg_stream_kernels_get();
+
+	return 0;
+	}
+
+// number of outputs set with mt_ffmpeg_stream_decoder_set_outputs()
+int mt_ffmpeg_stream_decoder_get_num_outputs(int handle)
+	{
+	return stream[handle].num_outputs;
+	}
+
+// conversion state of all outputs, when stream is closed
+void mt_ffmpeg_stream_decoder_free_outputs(int handle)
+	{
+	int i;
+
+	for(i = 0; i < FFMPEG_STREAM_MAX_OUTPUTS; i++)
+		{
+		struct OutputContext* out = &stream[handle].outputs[i];
+
+		if(out->conversion_ctx != 0)
+			{
+			sws_freeContext(out->conversion_ctx);
+			out->conversion_ctx = 0;
+			}
+
+		av_freep(&out->convert_buf);
+		out->convert_buf_size = 0;
+		av_frame_free(&out->view);
+		}
+
+	stream[handle].num_outputs = 0;
+	}
+
+// rectangle of native picture an output is made from, clipped to picture
+// left and top edge are rounded down to even for chroma planes at half resolution, which keeps chroma aligned to luma
+int mt_ffmpeg_stream_decoder_crop_size(const struct mt_ffmpeg_stream_output* output, int source_width, int source_height,
+										 int* x, int* y, int* width, int* height)
+	{
+	*x = 0;
+	*y = 0;
+	*width = source_width;
+	*height = source_height;
+
+	if(output->crop_width <= 0 || output->crop_height <= 0 || source_width <= 0 || source_height <= 0)
+		return 0;
+
+	// rectangle entirely outside of picture (e.g. smaller camera than configured for) falls back to whole picture
+	if(output->crop_x >= source_width || output->crop_y >= source_height ||
+	   output->crop_x + output->crop_width <= 0 || output->crop_y + output->crop_height <= 0)
+		return 0;
+
+	*x = output->crop_x < 0 ? 0 : output->crop_x & ~1;
+	*y = output->crop_y < 0 ? 0 : output->crop_y & ~1;
+	*width = output->crop_x + output->crop_width - *x;
+	*height = output->crop_y + output->crop_height - *y;
+	if(*width > source_width - *x) *width = source_width - *x;
+	if(*height > source_height - *y) *height = source_height - *y;
+
+	return 1;
+	}
+
+// work out output resolution for given native resolution
+// crop rectangle is taken first, then explicit width and height win, then scale factor, otherwise crop is kept as it is
+void mt_ffmpeg_stream_decoder_output_size(struct OutputContext* out, int source_width, int source_height, int* width, int* height)
+	{
+	const struct mt_ffmpeg_stream_output* output = &out->output;
+	int x, y;
+
+	mt_ffmpeg_stream_decoder_crop_size(output, source_width, source_height, &x, &y, &source_width, &source_height);
+
+	if(output->width > 0 && output->height > 0)
+		{
+		*width = output->width;
+		*height = output->height;
+		}
+	else if(output->scale > 0.0 && source_width > 0 && source_height > 0)
+		{
+		*width = (int)(source_width * output->scale + 0.5);
+		*height = (int)(source_height * output->scale + 0.5);
+		if(*width < 1) *width = 1;
+		if(*height < 1) *height = 1;
+		}
+	else
+		{
+		*width = source_width;
+		*height = source_height;
+		}
+	}
+
+// 1 if output is at native size, 2 or 4 if area filter shrinks by exactly that factor in both directions
+// (box average is then what area filter computes), 0 otherwise
+int mt_ffmpeg_stream_decoder_box_factor(struct OutputContext* out, int source_width, int source_height, int width, int height)
+	{
+	if(width == source_width && height == source_height)
+		return 1;
+
+	if(out->output.scale_filter != FFMPEG_STREAM_SCALE_AREA)
+		return 0;
+
+	if(width * 2 == source_width && height * 2 == source_height)
+		return 2;
+
+	if(width * 4 == source_width && height * 4 == source_height)
+		return 4;
+
+	return 0;
+	}
+
+// demuxer / protocol options for avformat_open_input()
+// low latency mode turns off demuxer buffering and shortens probing, explicit values always win
+AVDictionary* mt_ffmpeg_stream_decoder_input_options(int handle)
+	{
+	const struct mt_ffmpeg_stream_options* options = &stream[handle].options;
+	AVDictionary* dict = 0;
+	int probesize = options->probesize;
+	int analyzeduration = options->analyzeduration;
+	int reorder_queue_size = options->reorder_queue_size;
+	int max_delay = options->max_delay;
+
+	if(options->low_latency)
+		{
+		av_dict_set(&dict, "fflags", "nobuffer", 0);
+		if(probesize <= 0) probesize = 32768;
+		if(analyzeduration <= 0) analyzeduration = 100000;
+		if(reorder_queue_size < 0) reorder_queue_size = 0;
+		if(max_delay < 0) max_delay = 0;
+		}
+
+	if(options->transport == FFMPEG_STREAM_TRANSPORT_UDP)
+		av_dict_set(&dict, "rtsp_transport", "udp", 0);
+	else if(options->transport == FFMPEG_STREAM_TRANSPORT_TCP)
+		av_dict_set(&dict, "rtsp_transport", "tcp", 0);
+
+	// RTSP takes it as flag, plain protocols (tcp, rtmp, http) as option of their own
+	if(options->listen)
+		{
+		av_dict_set(&dict, "rtsp_flags", "listen", 0);
+		av_dict_set(&dict, "listen", "1", 0);
+		}
+
+	// dead connection (WiFi gone, camera unplugged) makes reads fail instead of blocking forever
+	// rw_timeout covers avio protocols (http, tcp, rtmp), RTSP has socket timeout of its own, renamed in libavformat 59
+	// (its old "timeout" means listen mode, so it mustn't be set there); waiting for sender in listen mode has no limit
+	if(options->io_timeout_ms > 0 && !options->listen)
+		{
+		av_dict_set_int(&dict, "rw_timeout", (int64_t)options->io_timeout_ms * 1000, 0);
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+		av_dict_set_int(&dict, "timeout", (int64_t)options->io_timeout_ms * 1000, 0);
+#else
+		av_dict_set_int(&dict, "stimeout", (int64_t)options->io_timeout_ms * 1000, 0);
+#endif
+		}
+
+	if(probesize > 0)
+		av_dict_set_int(&dict, "probesize", probesize, 0);
+	if(analyzeduration > 0)
+		av_dict_set_int(&dict, "analyzeduration", analyzeduration, 0);
+	if(reorder_queue_size >= 0)
+		av_dict_set_int(&dict, "reorder_queue_size", reorder_queue_size, 0);
+	if(max_delay >= 0)
+		av_dict_set_int(&dict, "max_delay", max_delay, 0);
+
+	return dict;
+	}
+
+// swscale interpolation flags for selected scale filter
+int mt_ffmpeg_stream_decoder_sws_flags(struct OutputContext* out)
+	{
+	switch(out->output.scale_filter)
+		{
+		case FFMPEG_STREAM_SCALE_BILINEAR:	return SWS_BILINEAR;
+		case FFMPEG_STREAM_SCALE_AREA:		return SWS_AREA;
+		case FFMPEG_STREAM_SCALE_POINT:		return SWS_POINT;
+		case FFMPEG_STREAM_SCALE_BICUBIC:	return SWS_BICUBIC;
+		default:							return SWS_FAST_BILINEAR;
+		}
+	}
+
+// timing of lent frame
+// should be called from main application thread!
+int mt_ffmpeg_stream_decoder_get_frame_times(int handle, struct mt_ffmpeg_stream_frame_times* times)
+	{
+	if(stream[handle].frame_lent == 0 || stream[handle].frame_lent->data[0] == 0)
+		return -1;
+
+	*times = stream[handle].times_lent;
+	return 0;
+	}
+
+// return lent frame buffers to decoder
+// should be called from main application thread!
+void mt_ffmpeg_stream_decoder_release_frame(int handle)
+	{
+	av_frame_unref(stream[handle].frame_lent);
+	}
+
+// passthrough mode: lend oldest queued compressed packet to caller (returns 1 if there was one)
+// packets must be taken in order and all of them, caller loops until it returns 0
+// data stays valid until mt_ffmpeg_stream_decoder_release_packet() or next acquire
+// should be called only from main application thread!
+int mt_ffmpeg_stream_decoder_acquire_packet(int handle, struct mt_ffmpeg_stream_packet* packet)
+	{
+	struct StreamContext* s = &stream[handle];
+	struct PacketEntry e;
+	int acquired = 0;
+
+	if(!s->is_open)
+		return 0;
+
+	av_packet_unref(s->packet_lent);
+
+	// frame lock is taken inside queue lock here, passthrough() takes them one after the other, never the other way round
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(s->cs_lock_queue));
+#endif
+
+	if(s->queue_count > 0)
+		{
+		e = s->queue[s->queue_head];
+		s->queue_head = (s->queue_head + 1) % PACKET_QUEUE_SIZE;
+		s->queue_count--;
+		acquired = 1;
+		}
+
+	if(acquired || s->queue_count == 0)
+		{
+#ifdef USE_WINDOWS_THREADING
+		EnterCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_lock(&(s->cs_lock_frame));
+#endif
+
+		if(s->queue_count == 0 && s->status == FFMPEG_STREAM_STATUS_NEW_FRAME)
+			s->status = FFMPEG_STREAM_STATUS_OK;
+		if(acquired)
+			s->stats.frames_acquired++;
+
+#ifdef USE_WINDOWS_THREADING
+		LeaveCriticalSection(&(s->cs_lock_frame));
+#endif
+#ifdef USE_PTHREADS
+		pthread_mutex_unlock(&(s->cs_lock_frame));
+#endif
+		}
+
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(s->cs_lock_queue));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(s->cs_lock_queue));
+#endif
+
+	if(!acquired)
+		return 0;
+
+	av_packet_move_ref(s->packet_lent, e.packet);
+	av_packet_free(&e.packet);
+
+	packet->data = s->packet_lent->data;
+	packet->size = s->packet_lent->size;
+	packet->keyframe = (s->packet_lent->flags & AV_PKT_FLAG_KEY) != 0;
+	packet->pts = s->packet_lent->pts;
+	packet->dts = s->packet_lent->dts;
+	packet->time_base_num = s->time_base.num;
+	packet->time_base_den = s->time_base.den;
+	packet->codec_name = avcodec_get_name((enum AVCodecID)s->codec_id);
+
+	packet->times.receive_time = e.receive_time;
+	mt_ffmpeg_stream_decoder_add_stage_time(handle, FFMPEG_STREAM_STAGE_HANDOFF, av_gettime() - e.receive_time);
+	packet->times.decode_time = 0;
+	packet->times.capture_time = mt_ffmpeg_stream_decoder_wall_clock(handle, packet->pts, e.start_time_realtime);
+
+	return 1;
+	}
+
+// hand lent packet back
+void mt_ffmpeg_stream_decoder_release_packet(int handle)
+	{
+	av_packet_unref(stream[handle].packet_lent);
+	}
+
+// unref packets of ring (or of snapshot, head 0 and size = count)
+void mt_ffmpeg_stream_decoder_free_preevent(struct mt_ffmpeg_stream_record_packet* packets, int head, int count, int size)
+	{
+	int i;
+
+	for(i = 0; i < count; i++)
+		av_packet_free(&packets[(head + i) % size].packet);
+	}
+
+// new connection, called by stream's own thread: buffer carries on if stream comes back with same codec
+// (timestamps are shifted to follow buffered ones, outage shows as a gap), otherwise it starts over
+void mt_ffmpeg_stream_decoder_preevent_start(int handle, AVStream* video)
+	{
+	struct StreamContext* s = &stream[handle];
+	const AVCodecParameters* par = video->codecpar;
+	int same;
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(s->cs_lock_preevent));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(s->cs_lock_preevent));
+#endif
+
+	same = s->preevent_par != 0 && s->preevent_par->codec_id == par->codec_id &&
+		   s->preevent_par->extradata_size == par->extradata_size &&
+		   (par->extradata_size == 0 || memcmp(s->preevent_par->extradata, par->extradata, par->extradata_size) == 0) &&
+		   av_cmp_q(s->preevent_time_base, video->time_base) == 0;
+
+	if(!same)
+		{
+		mt_ffmpeg_stream_decoder_free_preevent(s->preevent, s->preevent_head, s->preevent_count, s->preevent_size);
+		s->preevent_head = 0;
+		s->preevent_count = 0;
+		s->preevent_key_head = 0;
+		s->preevent_key_count = 0;
+		s->preevent_bytes = 0;
+		s->preevent_shift = 0;
+		if(s->preevent_par == 0)
+			s->preevent_par = avcodec_parameters_alloc();
+		if(s->preevent_par != 0)
+			avcodec_parameters_copy(s->preevent_par, par);
+		s->preevent_time_base = video->time_base;
+		}
+	s->preevent_rebase = same;
+
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(s->cs_lock_preevent));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(s->cs_lock_preevent));
+#endif
+	}
+
+// drop oldest keyframe interval, returns 0 if nothing is left (interval was the only one), cs_lock_preevent held
+int mt_ffmpeg_stream_decoder_preevent_drop(int handle)
+	{
+	struct StreamContext* s = &stream[handle];
+
+	do
+		{
+		struct mt_ffmpeg_stream_record_packet* p = &s->preevent[s->preevent_head];
+		s->preevent_bytes -= p->packet->size;
+		av_packet_free(&p->packet);
+		s->preevent_head = (s->preevent_head + 1) % s->preevent_size;
+		s->preevent_count--;
+		}
+	while(s->preevent_count > 0 && !(s->preevent[s->preevent_head].packet->flags & AV_PKT_FLAG_KEY));
+
+	// head is next keyframe now (if any is left)
+	s->preevent_key_head = (s->preevent_key_head + 1) % s->preevent_size;
+	s->preevent_key_count--;
+
+	return s->preevent_count > 0;
+	}
+
+// keep reference to packet, called by stream's own thread for every video packet
+// whole keyframe intervals go once the next one alone covers preevent_s, or when memory (or ring) runs out,
+// so buffer always starts with a keyframe
+void mt_ffmpeg_stream_decoder_preevent_add(int handle, AVPacket* packet, int64_t receive_time, int64_t capture_time)
+	{
+	struct StreamContext* s = &stream[handle];
+	struct mt_ffmpeg_stream_record_packet entry;
+	AVRational microseconds = { 1, 1000000 };
+	int64_t max_bytes = (int64_t)(s->options.preevent_max_kb > 0 ? s->options.preevent_max_kb : PREEVENT_DEFAULT_KB) * 1024;
+	int64_t keep = (int64_t)s->options.preevent_s * 1000000;
+	int key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+	int next, slot;
+
+	entry.packet = av_packet_alloc();
+	if(entry.packet == 0 || av_packet_ref(entry.packet, packet) < 0)
+		{
+		av_packet_free(&entry.packet);
+		return;
+		}
+	entry.receive_time = receive_time;
+	entry.capture_time = capture_time;
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(s->cs_lock_preevent));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(s->cs_lock_preevent));
+#endif
+
+	// first packet after reconnect: carry on from last buffered one, as far behind as the outage was
+	if(s->preevent_rebase && s->preevent_count > 0 && packet->dts != AV_NOPTS_VALUE)
+		{
+		struct mt_ffmpeg_stream_record_packet* last = &s->preevent[(s->preevent_head + s->preevent_count - 1) % s->preevent_size];
+		if(last->packet->dts != AV_NOPTS_VALUE)
+			s->preevent_shift = last->packet->dts + 1 + av_rescale_q(receive_time - last->receive_time, microseconds, s->preevent_time_base) - packet->dts;
+		}
+	s->preevent_rebase = 0;
+	if(entry.packet->pts != AV_NOPTS_VALUE)
+		entry.packet->pts += s->preevent_shift;
+	if(entry.packet->dts != AV_NOPTS_VALUE)
+		entry.packet->dts += s->preevent_shift;
+
+	// buffer starts with a keyframe
+	if(s->preevent_count == 0 && !key)
+		av_packet_free(&entry.packet);
+
+	// oldest interval goes once the one after it covers preevent_s on its own
+	while(s->preevent_key_count > 1)
+		{
+		next = s->preevent_keys[(s->preevent_key_head + 1) % s->preevent_size];
+		if(receive_time - s->preevent[next].receive_time < keep)
+			break;
+		mt_ffmpeg_stream_decoder_preevent_drop(handle);
+		}
+
+	// out of room: oldest intervals go, if the only one doesn't fit buffer starts over at next keyframe
+	while(entry.packet != 0 && s->preevent_count > 0 &&
+		  (s->preevent_count == s->preevent_size || s->preevent_bytes + entry.packet->size > max_bytes))
+		{
+		mt_ffmpeg_stream_decoder_preevent_drop(handle);
+		if(s->preevent_count == 0 && !key)
+			av_packet_free(&entry.packet);
+		}
+
+	if(entry.packet != 0 && entry.packet->size <= max_bytes)
+		{
+		slot = (s->preevent_head + s->preevent_count) % s->preevent_size;
+		s->preevent[slot] = entry;
+		if(key)
+			{
+			s->preevent_keys[(s->preevent_key_head + s->preevent_key_count) % s->preevent_size] = slot;
+			s->preevent_key_count++;
+			}
+		s->preevent_count++;
+		s->preevent_bytes += entry.packet->size;
+		entry.packet = 0;
+		}
+
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(s->cs_lock_preevent));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(s->cs_lock_preevent));
+#endif
+
+	av_packet_free(&entry.packet);
+	}
+
+// take references to every buffered packet, buffer keeps its own
+int mt_ffmpeg_stream_decoder_preevent_snapshot(int handle)
+	{
+	struct StreamContext* s;
+	int i;
+
+	if(handle < 0 || handle >= MAX_STREAMS || !stream[handle].is_open || stream[handle].preevent == 0)
+		return 0;
+	s = &stream[handle];
+
+	mt_ffmpeg_stream_decoder_free_preevent(s->snapshot, 0, s->snapshot_count, s->snapshot_count);
+	av_free(s->snapshot);
+	s->snapshot = 0;
+	s->snapshot_count = 0;
+
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(s->cs_lock_preevent));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(s->cs_lock_preevent));
+#endif
+
+	if(s->preevent_count > 0 && s->preevent_par != 0)
+		s->snapshot = av_calloc(s->preevent_count, sizeof(s->snapshot[0]));
+
+	for(i = 0; s->snapshot != 0 && i < s->preevent_count; i++)
+		{
+		struct mt_ffmpeg_stream_record_packet* p = &s->preevent[(s->preevent_head + i) % s->preevent_size];
+		s->snapshot[s->snapshot_count] = *p;
+		s->snapshot[s->snapshot_count].packet = av_packet_alloc();
+		if(s->snapshot[s->snapshot_count].packet != 0 && av_packet_ref(s->snapshot[s->snapshot_count].packet, p->packet) == 0)
+			s->snapshot_count++;
+		else
+			av_packet_free(&s->snapshot[s->snapshot_count].packet);
+		}
+
+	if(s->snapshot_count > 0)
+		{
+		if(s->snapshot_par == 0)
+			s->snapshot_par = avcodec_parameters_alloc();
+		if(s->snapshot_par == 0 || avcodec_parameters_copy(s->snapshot_par, s->preevent_par) < 0)
+			{
+			mt_ffmpeg_stream_decoder_free_preevent(s->snapshot, 0, s->snapshot_count, s->snapshot_count);
+			s->snapshot_count = 0;
+			}
+		s->snapshot_time_base = s->preevent_time_base;
+		}
+
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(s->cs_lock_preevent));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(s->cs_lock_preevent));
+#endif
+
+	return s->snapshot_count;
+	}
+
+int mt_ffmpeg_stream_decoder_preevent_packet(int handle, int index, struct mt_ffmpeg_stream_packet* packet)
+	{
+	struct StreamContext* s;
+	const struct mt_ffmpeg_stream_record_packet* p;
+
+	if(handle < 0 || handle >= MAX_STREAMS || !stream[handle].is_open)
+		return 0;
+	s = &stream[handle];
+	if(index < 0 || index >= s->snapshot_count)
+		return 0;
+	p = &s->snapshot[index];
+
+	packet->data = p->packet->data;
+	packet->size = p->packet->size;
+	packet->keyframe = (p->packet->flags & AV_PKT_FLAG_KEY) != 0;
+	packet->pts = p->packet->pts;
+	packet->dts = p->packet->dts;
+	packet->time_base_num = s->snapshot_time_base.num;
+	packet->time_base_den = s->snapshot_time_base.den;
+	packet->codec_name = avcodec_get_name(s->snapshot_par->codec_id);
+	packet->times.capture_time = p->capture_time;
+	packet->times.receive_time = p->receive_time;
+	packet->times.decode_time = 0;
+	return 1;
+	}
+
+int mt_ffmpeg_stream_decoder_preevent_dump(int handle, const char* filename)
+	{
+	struct StreamContext* s;
+
+	if(handle < 0 || handle >= MAX_STREAMS || !stream[handle].is_open)
+		return -1;
+	s = &stream[handle];
+	if(s->snapshot_count == 0)
+		return -1;
+
+	return mt_ffmpeg_stream_recorder_write_file(filename, s->snapshot_par, s->snapshot_time_base.num, s->snapshot_time_base.den,
+												s->snapshot, s->snapshot_count);
+	}
+
+// grab next frame, should be called only if mt_ffmpeg_stream_decoder_get_status() returned FFMPEG_STREAM_STATUS_NEW_FRAME
+// framebuf must hold mt_ffmpeg_stream_decoder_format_stride() * mt_ffmpeg_stream_decoder_format_rows() bytes
+// should be called from main application thread!
+
+void mt_ffmpeg_stream_decoder_grab_frame(int handle, unsigned char* framebuf)
+	{
+	if(mt_ffmpeg_stream_decoder_acquire_frame(handle))
+		{
+		mt_ffmpeg_stream_decoder_convert_frame(handle, framebuf,
+											   mt_ffmpeg_stream_decoder_format_stride(stream[handle].outputs[0].output.format, mt_ffmpeg_stream_decoder_get_frame_width(handle)));
+		mt_ffmpeg_stream_decoder_release_frame(handle);
+		}
 	}
@@ -0,0 +1,1103 @@
+// pixel kernels used by stream decoder for conversions swscale doesn't do well (or at all):
+// weighted RGB to grey, exact 2x/4x box downsample, crop and fast YUV 4:2:0 to RGB/BGR
+// each kernel has plain C reference version and SIMD versions for SSE2, AVX2 and NEON,
+// best one is picked at runtime from CPU features
+// SIMD versions must stay bit-exact with reference, so all rounding is spelled out explicitly
+//
+
+#include <string.h>
+#include <stdint.h>
+
+#include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_kernels.h"
+
+// x86: SSE2 everywhere, AVX2 only where compiler can target it per function (gcc/clang)
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+ #define KERNELS_SSE2
+ #include <emmintrin.h>
+ #if defined(__GNUC__)
+  #define KERNELS_AVX2
+  #include <immintrin.h>
+  #define TARGET_SSE2 __attribute__((target("sse2")))
+  #define TARGET_AVX2 __attribute__((target("avx2")))
+ #else
+  #define TARGET_SSE2
+ #endif
+#endif
+
+// ARM: NEON is mandatory on aarch64, on 32-bit ARM only if compiler was told to use it
+#if defined(__aarch64__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+ #define KERNELS_NEON
+ #include <arm_neon.h>
+#endif
+
+// YUV to RGB coefficients in 6-bit fixed point:
+// R = (ycoef * (Y - yoff) + cr_r * (V - 128) + 32) >> 6
+// G = (ycoef * (Y - yoff) - cb_g * (U - 128) - cr_g * (V - 128) + 32) >> 6
+// B = (ycoef * (Y - yoff) + cb_b * (U - 128) + 32) >> 6
+// all intermediate terms fit in signed 16 bits, only final sum may exceed it and then SIMD saturates,
+// which clips to 255 exactly like reference does
+
+struct yuv_coefs
+	{
+	int ycoef, yoff, cr_r, cb_g, cr_g, cb_b;
+	};
+
+static const struct yuv_coefs yuv_coefs_table[2][2] =
+	{
+	{ { 75, 16, 102, 25, 52, 129 },		// BT.601 limited range
+	  { 64,  0,  90, 22, 46, 113 } },	// BT.601 full range
+	{ { 75, 16, 115, 14, 34, 135 },		// BT.709 limited range
+	  { 64,  0, 101, 12, 30, 119 } }	// BT.709 full range
+	};
+
+static const struct yuv_coefs* get_yuv_coefs(int matrix, int full_range)
+	{
+	return &yuv_coefs_table[matrix == FFMPEG_STREAM_KERNEL_BT709 ? 1 : 0][full_range ? 1 : 0];
+	}
+
+static inline uint8_t clip_u8(int v)
+	{
+	return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+	}
+
+// ------------------------------------------------------------------------------------------------
+// reference implementation
+// also used by SIMD versions for row tails
+
+static void yuv_row_scalar(const uint8_t* y, const uint8_t* u, const uint8_t* v, int uv_step,
+						   uint8_t* dst, int x0, int width, int bgr, const struct yuv_coefs* c)
+	{
+	int x;
+	int ri = bgr ? 2 : 0;
+	int bi = bgr ? 0 : 2;
+
+	for(x = x0; x < width; x++)
+		{
+		int yy = c->ycoef * (y[x] - c->yoff) + 32;
+		int d = u[(x >> 1) * uv_step] - 128;
+		int e = v[(x >> 1) * uv_step] - 128;
+
+		dst[x * 3 + ri] = clip_u8((yy + c->cr_r * e) >> 6);
+		dst[x * 3 + 1] = clip_u8((yy - c->cb_g * d - c->cr_g * e) >> 6);
+		dst[x * 3 + bi] = clip_u8((yy + c->cb_b * d) >> 6);
+		}
+	}
+
+static void yuv420p_to_rgb_scalar(const uint8_t* y, int y_stride, const uint8_t* u, int u_stride, const uint8_t* v, int v_stride,
+								  uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range)
+	{
+	const struct yuv_coefs* c = get_yuv_coefs(matrix, full_range);
+	int row;
+
+	for(row = 0; row < height; row++)
+		yuv_row_scalar(y + (size_t)row * y_stride, u + (size_t)(row >> 1) * u_stride, v + (size_t)(row >> 1) * v_stride, 1,
+					   dst + (size_t)row * dst_stride, 0, width, bgr, c);
+	}
+
+static void nv12_to_rgb_scalar(const uint8_t* y, int y_stride, const uint8_t* uv, int uv_stride,
+							   uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range)
+	{
+	const struct yuv_coefs* c = get_yuv_coefs(matrix, full_range);
+	int row;
+
+	for(row = 0; row < height; row++)
+		yuv_row_scalar(y + (size_t)row * y_stride, uv + (size_t)(row >> 1) * uv_stride, uv + (size_t)(row >> 1) * uv_stride + 1, 2,
+					   dst + (size_t)row * dst_stride, 0, width, bgr, c);
+	}
+
+static void grey_row_scalar(const uint8_t* s, uint8_t* d, int x0, int width, int wr, int wg, int wb)
+	{
+	int x;
+
+	for(x = x0; x < width; x++)
+		d[x] = (uint8_t)((wr * s[x * 3 + 0] + wg * s[x * 3 + 1] + wb * s[x * 3 + 2] + 128) >> 8);
+	}
+
+static void rgb_to_grey_scalar(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride,
+							   int width, int height, int wr, int wg, int wb)
+	{
+	int y;
+
+	for(y = 0; y < height; y++)
+		grey_row_scalar(src + (size_t)y * src_stride, dst + (size_t)y * dst_stride, 0, width, wr, wg, wb);
+	}
+
+static void box_2x_row_scalar(const uint8_t* r0, const uint8_t* r1, uint8_t* d, int x0, int width, int channels)
+	{
+	int x, c;
+
+	for(x = x0; x < width; x++)
+		{
+		for(c = 0; c < channels; c++)
+			{
+			int i = x * 2 * channels + c;
+			d[x * channels + c] = (uint8_t)((r0[i] + r0[i + channels] + r1[i] + r1[i + channels] + 2) >> 2);
+			}
+		}
+	}
+
+static void box_2x_scalar(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels)
+	{
+	int y;
+
+	for(y = 0; y < height; y++)
+		box_2x_row_scalar(src + (size_t)(y * 2) * src_stride, src + (size_t)(y * 2 + 1) * src_stride,
+						  dst + (size_t)y * dst_stride, 0, width, channels);
+	}
+
+static void box_4x_row_scalar(const uint8_t* src, int src_stride, uint8_t* d, int x0, int width, int channels)
+	{
+	int x, c, i, j;
+
+	for(x = x0; x < width; x++)
+		{
+		for(c = 0; c < channels; c++)
+			{
+			int sum = 8;
+			for(j = 0; j < 4; j++)
+				{
+				const uint8_t* s = src + (size_t)j * src_stride + x * 4 * channels + c;
+				for(i = 0; i < 4; i++)
+					sum += s[i * channels];
+				}
+			d[x * channels + c] = (uint8_t)(sum >> 4);
+			}
+		}
+	}
+
+static void box_4x_scalar(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels)
+	{
+	int y;
+
+	for(y = 0; y < height; y++)
+		box_4x_row_scalar(src + (size_t)(y * 4) * src_stride, src_stride, dst + (size_t)y * dst_stride, 0, width, channels);
+	}
+
+static void crop_scalar(const uint8_t* src, int src_stride, int bpp, int x, int y,
+						uint8_t* dst, int dst_stride, int width, int height)
+	{
+	int row;
+
+	// plain memcpy per row is already vectorized by C library, so every implementation shares this one
+	for(row = 0; row < height; row++)
+		memcpy(dst + (size_t)row * dst_stride, src + (size_t)(y + row) * src_stride + (size_t)x * bpp, (size_t)width * bpp);
+	}
+
+static const struct mt_ffmpeg_stream_kernels kernels_scalar =
+	{
+	"scalar",
+	yuv420p_to_rgb_scalar,
+	nv12_to_rgb_scalar,
+	rgb_to_grey_scalar,
+	box_2x_scalar,
+	box_4x_scalar,
+	crop_scalar
+	};
+
+// ------------------------------------------------------------------------------------------------
+// SSE2
+// SSE2 has no byte shuffle, so packed 24-bit pixels are gathered with overlapping 32-bit loads and stores
+// loops stop early enough that the extra byte always belongs to a pixel still inside the row
+
+#ifdef KERNELS_SSE2
+
+static inline int load_u32(const uint8_t* p)
+	{
+	int v;
+	memcpy(&v, p, 4);
+	return v;
+	}
+
+static inline void store_u32(uint8_t* p, int v)
+	{
+	memcpy(p, &v, 4);
+	}
+
+// store 4 RGBx pixels from p as 12 bytes of RGB, writes one byte past them
+TARGET_SSE2 static inline void store_rgbx_sse2(uint8_t* d, __m128i p)
+	{
+	store_u32(d + 0, _mm_cvtsi128_si32(p));
+	store_u32(d + 3, _mm_cvtsi128_si32(_mm_srli_si128(p, 4)));
+	store_u32(d + 6, _mm_cvtsi128_si32(_mm_srli_si128(p, 8)));
+	store_u32(d + 9, _mm_cvtsi128_si32(_mm_srli_si128(p, 12)));
+	}
+
+// convert 16 pixels of one row, y16 holds 16 luma samples, d8/e8 hold 8 chroma samples each as signed 16-bit
+TARGET_SSE2 static inline void yuv16_sse2(__m128i y16, __m128i d8, __m128i e8, uint8_t* dst, int bgr, const struct yuv_coefs* c)
+	{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(32);
+	const __m128i yoff = _mm_set1_epi16((short)c->yoff);
+	const __m128i ycoef = _mm_set1_epi16((short)c->ycoef);
+	__m128i rt = _mm_mullo_epi16(e8, _mm_set1_epi16((short)c->cr_r));
+	__m128i gt = _mm_add_epi16(_mm_mullo_epi16(d8, _mm_set1_epi16((short)c->cb_g)), _mm_mullo_epi16(e8, _mm_set1_epi16((short)c->cr_g)));
+	__m128i bt = _mm_mullo_epi16(d8, _mm_set1_epi16((short)c->cb_b));
+	__m128i yl = _mm_mullo_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(y16, zero), yoff), ycoef);
+	__m128i yh = _mm_mullo_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(y16, zero), yoff), ycoef);
+	__m128i r, g, b, t;
+
+	yl = _mm_adds_epi16(yl, round);
+	yh = _mm_adds_epi16(yh, round);
+
+	// each chroma term covers two neighbouring pixels
+	r = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(yl, _mm_unpacklo_epi16(rt, rt)), 6),
+						 _mm_srai_epi16(_mm_adds_epi16(yh, _mm_unpackhi_epi16(rt, rt)), 6));
+	g = _mm_packus_epi16(_mm_srai_epi16(_mm_subs_epi16(yl, _mm_unpacklo_epi16(gt, gt)), 6),
+						 _mm_srai_epi16(_mm_subs_epi16(yh, _mm_unpackhi_epi16(gt, gt)), 6));
+	b = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(yl, _mm_unpacklo_epi16(bt, bt)), 6),
+						 _mm_srai_epi16(_mm_adds_epi16(yh, _mm_unpackhi_epi16(bt, bt)), 6));
+
+	if(bgr)
+		{
+		t = r;
+		r = b;
+		b = t;
+		}
+
+	// interleave to RGBx and squeeze out x with overlapping stores
+	{
+	__m128i rg_lo = _mm_unpacklo_epi8(r, g);
+	__m128i rg_hi = _mm_unpackhi_epi8(r, g);
+	__m128i bx_lo = _mm_unpacklo_epi8(b, zero);
+	__m128i bx_hi = _mm_unpackhi_epi8(b, zero);
+
+	store_rgbx_sse2(dst + 0, _mm_unpacklo_epi16(rg_lo, bx_lo));
+	store_rgbx_sse2(dst + 12, _mm_unpackhi_epi16(rg_lo, bx_lo));
+	store_rgbx_sse2(dst + 24, _mm_unpacklo_epi16(rg_hi, bx_hi));
+	store_rgbx_sse2(dst + 36, _mm_unpackhi_epi16(rg_hi, bx_hi));
+	}
+	}
+
+TARGET_SSE2 static void yuv420p_to_rgb_sse2(const uint8_t* y, int y_stride, const uint8_t* u, int u_stride, const uint8_t* v, int v_stride,
+											uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range)
+	{
+	const struct yuv_coefs* c = get_yuv_coefs(matrix, full_range);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi16(128);
+	int row, x;
+
+	for(row = 0; row < height; row++)
+		{
+		const uint8_t* ys = y + (size_t)row * y_stride;
+		const uint8_t* us = u + (size_t)(row >> 1) * u_stride;
+		const uint8_t* vs = v + (size_t)(row >> 1) * v_stride;
+		uint8_t* d = dst + (size_t)row * dst_stride;
+
+		// strictly less, last store spills one byte into pixel x + 16
+		for(x = 0; x + 16 < width; x += 16)
+			{
+			__m128i d8 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(us + x / 2)), zero), bias);
+			__m128i e8 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(vs + x / 2)), zero), bias);
+			yuv16_sse2(_mm_loadu_si128((const __m128i*)(ys + x)), d8, e8, d + x * 3, bgr, c);
+			}
+
+		yuv_row_scalar(ys, us, vs, 1, d, x, width, bgr, c);
+		}
+	}
+
+TARGET_SSE2 static void nv12_to_rgb_sse2(const uint8_t* y, int y_stride, const uint8_t* uv, int uv_stride,
+										 uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range)
+	{
+	const struct yuv_coefs* c = get_yuv_coefs(matrix, full_range);
+	const __m128i mask = _mm_set1_epi16(0x00FF);
+	const __m128i bias = _mm_set1_epi16(128);
+	int row, x;
+
+	for(row = 0; row < height; row++)
+		{
+		const uint8_t* ys = y + (size_t)row * y_stride;
+		const uint8_t* uvs = uv + (size_t)(row >> 1) * uv_stride;
+		uint8_t* d = dst + (size_t)row * dst_stride;
+
+		for(x = 0; x + 16 < width; x += 16)
+			{
+			__m128i uv16 = _mm_loadu_si128((const __m128i*)(uvs + x));
+			__m128i d8 = _mm_sub_epi16(_mm_and_si128(uv16, mask), bias);
+			__m128i e8 = _mm_sub_epi16(_mm_srli_epi16(uv16, 8), bias);
+			yuv16_sse2(_mm_loadu_si128((const __m128i*)(ys + x)), d8, e8, d + x * 3, bgr, c);
+			}
+
+		yuv_row_scalar(ys, uvs, uvs + 1, 2, d, x, width, bgr, c);
+		}
+	}
+
+// weighted sum of 4 pixels gathered as RGBx, result in 4 32-bit lanes
+TARGET_SSE2 static inline __m128i grey4_sse2(const uint8_t* s, __m128i w)
+	{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i p = _mm_setr_epi32(load_u32(s), load_u32(s + 3), load_u32(s + 6), load_u32(s + 9));
+	__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(p, zero), w);	// R0*wr+G0*wg, B0*wb, R1*wr+G1*wg, B1*wb
+	__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(p, zero), w);
+
+	lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+	hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+	lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+	hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+
+	return _mm_unpacklo_epi64(lo, hi);
+	}
+
+TARGET_SSE2 static void rgb_to_grey_sse2(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride,
+										 int width, int height, int wr, int wg, int wb)
+	{
+	const __m128i w = _mm_setr_epi16((short)wr, (short)wg, (short)wb, 0, (short)wr, (short)wg, (short)wb, 0);
+	const __m128i round = _mm_set1_epi32(128);
+	int y, x;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* s = src + (size_t)y * src_stride;
+		uint8_t* d = dst + (size_t)y * dst_stride;
+
+		// gathering loads read one byte past pixel x + 7
+		for(x = 0; x + 8 < width; x += 8)
+			{
+			__m128i a = _mm_srli_epi32(_mm_add_epi32(grey4_sse2(s + x * 3, w), round), 8);
+			__m128i b = _mm_srli_epi32(_mm_add_epi32(grey4_sse2(s + x * 3 + 12, w), round), 8);
+			__m128i p = _mm_packs_epi32(a, b);
+			_mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(p, p));
+			}
+
+		grey_row_scalar(s, d, x, width, wr, wg, wb);
+		}
+	}
+
+// sums of horizontal byte pairs as 16-bit lanes
+TARGET_SSE2 static inline __m128i pair_sums_sse2(__m128i v)
+	{
+	return _mm_add_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00FF)), _mm_srli_epi16(v, 8));
+	}
+
+// sum of 2x2 RGB block for one output pixel, valid in 16-bit lanes 0..2
+TARGET_SSE2 static inline __m128i box_2x_rgb1_sse2(const uint8_t* r0, const uint8_t* r1)
+	{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i s = _mm_add_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)r0), zero),
+							  _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)r1), zero));
+	return _mm_add_epi16(s, _mm_srli_si128(s, 6));
+	}
+
+TARGET_SSE2 static void box_2x_sse2(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels)
+	{
+	const __m128i round = _mm_set1_epi16(2);
+	int y, x;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* r0 = src + (size_t)(y * 2) * src_stride;
+		const uint8_t* r1 = r0 + src_stride;
+		uint8_t* d = dst + (size_t)y * dst_stride;
+
+		if(channels == 1)
+			{
+			for(x = 0; x + 16 <= width; x += 16)
+				{
+				__m128i a = _mm_add_epi16(pair_sums_sse2(_mm_loadu_si128((const __m128i*)(r0 + x * 2))),
+										  pair_sums_sse2(_mm_loadu_si128((const __m128i*)(r1 + x * 2))));
+				__m128i b = _mm_add_epi16(pair_sums_sse2(_mm_loadu_si128((const __m128i*)(r0 + x * 2 + 16))),
+										  pair_sums_sse2(_mm_loadu_si128((const __m128i*)(r1 + x * 2 + 16))));
+				a = _mm_srli_epi16(_mm_add_epi16(a, round), 2);
+				b = _mm_srli_epi16(_mm_add_epi16(b, round), 2);
+				_mm_storeu_si128((__m128i*)(d + x), _mm_packus_epi16(a, b));
+				}
+			}
+		else
+			{
+			// 8 byte loads and RGBx stores both spill into pixel x + 4
+			for(x = 0; x + 4 < width; x += 4)
+				{
+				__m128i s0 = box_2x_rgb1_sse2(r0 + x * 6, r1 + x * 6);
+				__m128i s1 = box_2x_rgb1_sse2(r0 + x * 6 + 6, r1 + x * 6 + 6);
+				__m128i s2 = box_2x_rgb1_sse2(r0 + x * 6 + 12, r1 + x * 6 + 12);
+				__m128i s3 = box_2x_rgb1_sse2(r0 + x * 6 + 18, r1 + x * 6 + 18);
+				__m128i a = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), round), 2);
+				__m128i b = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), round), 2);
+				store_rgbx_sse2(d + x * 3, _mm_packus_epi16(a, b));
+				}
+			}
+
+		box_2x_row_scalar(r0, r1, d, x, width, channels);
+		}
+	}
+
+// sum of 4x4 RGB block for one output pixel, valid in 16-bit lanes 0..2
+TARGET_SSE2 static inline __m128i box_4x_rgb1_sse2(const uint8_t* s, int stride)
+	{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i t = _mm_setzero_si128();
+	int j;
+
+	for(j = 0; j < 4; j++, s += stride)
+		{
+		t = _mm_add_epi16(t, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)s), zero));
+		t = _mm_add_epi16(t, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s + 6)), zero));
+		}
+	return _mm_add_epi16(t, _mm_srli_si128(t, 6));
+	}
+
+TARGET_SSE2 static void box_4x_sse2(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels)
+	{
+	const __m128i round16 = _mm_set1_epi16(8);
+	const __m128i round32 = _mm_set1_epi32(8);
+	const __m128i mask = _mm_set1_epi32(0xFFFF);
+	int y, x, j, k;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* s = src + (size_t)(y * 4) * src_stride;
+		uint8_t* d = dst + (size_t)y * dst_stride;
+
+		if(channels == 1)
+			{
+			for(x = 0; x + 16 <= width; x += 16)
+				{
+				__m128i q[4];
+
+				for(k = 0; k < 4; k++)
+					{
+					__m128i t = _mm_setzero_si128();
+					for(j = 0; j < 4; j++)
+						t = _mm_add_epi16(t, pair_sums_sse2(_mm_loadu_si128((const __m128i*)(s + (size_t)j * src_stride + x * 4 + k * 16))));
+					t = _mm_add_epi32(_mm_and_si128(t, mask), _mm_srli_epi32(t, 16));
+					q[k] = _mm_srli_epi32(_mm_add_epi32(t, round32), 4);
+					}
+				_mm_storeu_si128((__m128i*)(d + x), _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+				}
+			}
+		else
+			{
+			for(x = 0; x + 4 < width; x += 4)
+				{
+				__m128i s0 = box_4x_rgb1_sse2(s + x * 12, src_stride);
+				__m128i s1 = box_4x_rgb1_sse2(s + x * 12 + 12, src_stride);
+				__m128i s2 = box_4x_rgb1_sse2(s + x * 12 + 24, src_stride);
+				__m128i s3 = box_4x_rgb1_sse2(s + x * 12 + 36, src_stride);
+				__m128i a = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), round16), 4);
+				__m128i b = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), round16), 4);
+				store_rgbx_sse2(d + x * 3, _mm_packus_epi16(a, b));
+				}
+			}
+
+		box_4x_row_scalar(s, src_stride, d, x, width, channels);
+		}
+	}
+
+static const struct mt_ffmpeg_stream_kernels kernels_sse2 =
+	{
+	"sse2",
+	yuv420p_to_rgb_sse2,
+	nv12_to_rgb_sse2,
+	rgb_to_grey_sse2,
+	box_2x_sse2,
+	box_4x_sse2,
+	crop_scalar
+	};
+
+#endif // KERNELS_SSE2
+
+// ------------------------------------------------------------------------------------------------
+// AVX2
+// byte shuffles make packed 24-bit pixels cheap, 16 pixels are split into R, G, B vectors of 16-bit lanes
+// pixels 0..7 end up in low 128-bit lane and 8..15 in high lane, so element order is kept
+
+#ifdef KERNELS_AVX2
+
+#define Z -128	// pshufb index that yields zero
+
+// deinterleave 16 packed RGB pixels (48 bytes) into 16-bit R, G and B
+TARGET_AVX2 static inline void load_rgb16_avx2(const uint8_t* s, __m256i* r, __m256i* g, __m256i* b)
+	{
+	// each 128-bit lane sees its 8 pixels as bytes 0..15 in a and bytes 8..23 in c
+	__m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)s)), _mm_loadu_si128((const __m128i*)(s + 24)), 1);
+	__m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(s + 8))), _mm_loadu_si128((const __m128i*)(s + 32)), 1);
+	const __m256i ra = _mm256_setr_epi8(0, Z, 3, Z, 6, Z, 9, Z, 12, Z, 15, Z, Z, Z, Z, Z,  0, Z, 3, Z, 6, Z, 9, Z, 12, Z, 15, Z, Z, Z, Z, Z);
+	const __m256i rc = _mm256_setr_epi8(Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 10, Z, 13, Z,  Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 10, Z, 13, Z);
+	const __m256i ga = _mm256_setr_epi8(1, Z, 4, Z, 7, Z, 10, Z, 13, Z, Z, Z, Z, Z, Z, Z,  1, Z, 4, Z, 7, Z, 10, Z, 13, Z, Z, Z, Z, Z, Z, Z);
+	const __m256i gc = _mm256_setr_epi8(Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 8, Z, 11, Z, 14, Z,  Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 8, Z, 11, Z, 14, Z);
+	const __m256i ba = _mm256_setr_epi8(2, Z, 5, Z, 8, Z, 11, Z, 14, Z, Z, Z, Z, Z, Z, Z,  2, Z, 5, Z, 8, Z, 11, Z, 14, Z, Z, Z, Z, Z, Z, Z);
+	const __m256i bc = _mm256_setr_epi8(Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 9, Z, 12, Z, 15, Z,  Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 9, Z, 12, Z, 15, Z);
+
+	*r = _mm256_or_si256(_mm256_shuffle_epi8(a, ra), _mm256_shuffle_epi8(c, rc));
+	*g = _mm256_or_si256(_mm256_shuffle_epi8(a, ga), _mm256_shuffle_epi8(c, gc));
+	*b = _mm256_or_si256(_mm256_shuffle_epi8(a, ba), _mm256_shuffle_epi8(c, bc));
+	}
+
+// interleave 16 R, G, B bytes into 48 bytes of packed RGB
+TARGET_AVX2 static inline void store_rgb16_avx2(uint8_t* d, __m128i r, __m128i g, __m128i b)
+	{
+	const __m128i r0 = _mm_setr_epi8(0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z, Z, 5);
+	const __m128i g0 = _mm_setr_epi8(Z, 0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z, Z);
+	const __m128i b0 = _mm_setr_epi8(Z, Z, 0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z);
+	const __m128i r1 = _mm_setr_epi8(Z, Z, 6, Z, Z, 7, Z, Z, 8, Z, Z, 9, Z, Z, 10, Z);
+	const __m128i g1 = _mm_setr_epi8(5, Z, Z, 6, Z, Z, 7, Z, Z, 8, Z, Z, 9, Z, Z, 10);
+	const __m128i b1 = _mm_setr_epi8(Z, 5, Z, Z, 6, Z, Z, 7, Z, Z, 8, Z, Z, 9, Z, Z);
+	const __m128i r2 = _mm_setr_epi8(Z, 11, Z, Z, 12, Z, Z, 13, Z, Z, 14, Z, Z, 15, Z, Z);
+	const __m128i g2 = _mm_setr_epi8(Z, Z, 11, Z, Z, 12, Z, Z, 13, Z, Z, 14, Z, Z, 15, Z);
+	const __m128i b2 = _mm_setr_epi8(10, Z, Z, 11, Z, Z, 12, Z, Z, 13, Z, Z, 14, Z, Z, 15);
+
+	_mm_storeu_si128((__m128i*)(d + 0), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r0), _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(b, b0)));
+	_mm_storeu_si128((__m128i*)(d + 16), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r1), _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(b, b1)));
+	_mm_storeu_si128((__m128i*)(d + 32), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r2), _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(b, b2)));
+	}
+
+// pack four 32-bit R, G, B values (each below 256) into 12 bytes of packed RGB
+TARGET_AVX2 static inline void store_rgb4_avx2(uint8_t* d, __m128i r, __m128i g, __m128i b)
+	{
+	const __m128i order = _mm_setr_epi8(0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, Z, Z, Z, Z);
+	__m128i p = _mm_packus_epi16(_mm_packs_epi32(r, g), _mm_packs_epi32(b, _mm_setzero_si128()));	// R0..3 G0..3 B0..3 0000
+
+	p = _mm_shuffle_epi8(p, order);
+	_mm_storel_epi64((__m128i*)d, p);
+	store_u32(d + 8, _mm_cvtsi128_si32(_mm_srli_si128(p, 8)));
+	}
+
+// 16-bit lanes of 256-bit vector to 16 bytes, element order kept
+TARGET_AVX2 static inline __m128i pack16_avx2(__m256i v)
+	{
+	return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	}
+
+TARGET_AVX2 static inline void yuv16_avx2(__m128i y16, __m128i d8, __m128i e8, uint8_t* dst, int bgr, const struct yuv_coefs* c)
+	{
+	__m256i yy = _mm256_mullo_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(y16), _mm256_set1_epi16((short)c->yoff)), _mm256_set1_epi16((short)c->ycoef));
+	__m128i rt = _mm_mullo_epi16(e8, _mm_set1_epi16((short)c->cr_r));
+	__m128i gt = _mm_add_epi16(_mm_mullo_epi16(d8, _mm_set1_epi16((short)c->cb_g)), _mm_mullo_epi16(e8, _mm_set1_epi16((short)c->cr_g)));
+	__m128i bt = _mm_mullo_epi16(d8, _mm_set1_epi16((short)c->cb_b));
+	__m256i r, g, b;
+	__m128i r8, b8;
+
+	yy = _mm256_adds_epi16(yy, _mm256_set1_epi16(32));
+
+	// each chroma term covers two neighbouring pixels
+	r = _mm256_adds_epi16(yy, _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(rt, rt)), _mm_unpackhi_epi16(rt, rt), 1));
+	g = _mm256_subs_epi16(yy, _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(gt, gt)), _mm_unpackhi_epi16(gt, gt), 1));
+	b = _mm256_adds_epi16(yy, _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(bt, bt)), _mm_unpackhi_epi16(bt, bt), 1));
+
+	r8 = pack16_avx2(_mm256_srai_epi16(r, 6));
+	b8 = pack16_avx2(_mm256_srai_epi16(b, 6));
+	store_rgb16_avx2(dst, bgr ? b8 : r8, pack16_avx2(_mm256_srai_epi16(g, 6)), bgr ? r8 : b8);
+	}
+
+TARGET_AVX2 static void yuv420p_to_rgb_avx2(const uint8_t* y, int y_stride, const uint8_t* u, int u_stride, const uint8_t* v, int v_stride,
+											uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range)
+	{
+	const struct yuv_coefs* c = get_yuv_coefs(matrix, full_range);
+	const __m128i bias = _mm_set1_epi16(128);
+	int row, x;
+
+	for(row = 0; row < height; row++)
+		{
+		const uint8_t* ys = y + (size_t)row * y_stride;
+		const uint8_t* us = u + (size_t)(row >> 1) * u_stride;
+		const uint8_t* vs = v + (size_t)(row >> 1) * v_stride;
+		uint8_t* d = dst + (size_t)row * dst_stride;
+
+		for(x = 0; x + 16 <= width; x += 16)
+			{
+			__m128i d8 = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(us + x / 2))), bias);
+			__m128i e8 = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(vs + x / 2))), bias);
+			yuv16_avx2(_mm_loadu_si128((const __m128i*)(ys + x)), d8, e8, d + x * 3, bgr, c);
+			}
+
+		yuv_row_scalar(ys, us, vs, 1, d, x, width, bgr, c);
+		}
+	}
+
+TARGET_AVX2 static void nv12_to_rgb_avx2(const uint8_t* y, int y_stride, const uint8_t* uv, int uv_stride,
+										 uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range)
+	{
+	const struct yuv_coefs* c = get_yuv_coefs(matrix, full_range);
+	const __m128i mask = _mm_set1_epi16(0x00FF);
+	const __m128i bias = _mm_set1_epi16(128);
+	int row, x;
+
+	for(row = 0; row < height; row++)
+		{
+		const uint8_t* ys = y + (size_t)row * y_stride;
+		const uint8_t* uvs = uv + (size_t)(row >> 1) * uv_stride;
+		uint8_t* d = dst + (size_t)row * dst_stride;
+
+		for(x = 0; x + 16 <= width; x += 16)
+			{
+			__m128i uv16 = _mm_loadu_si128((const __m128i*)(uvs + x));
+			__m128i d8 = _mm_sub_epi16(_mm_and_si128(uv16, mask), bias);
+			__m128i e8 = _mm_sub_epi16(_mm_srli_epi16(uv16, 8), bias);
+			yuv16_avx2(_mm_loadu_si128((const __m128i*)(ys + x)), d8, e8, d + x * 3, bgr, c);
+			}
+
+		yuv_row_scalar(ys, uvs, uvs + 1, 2, d, x, width, bgr, c);
+		}
+	}
+
+TARGET_AVX2 static void rgb_to_grey_avx2(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride,
+										 int width, int height, int wr, int wg, int wb)
+	{
+	const __m256i vwr = _mm256_set1_epi16((short)wr);
+	const __m256i vwg = _mm256_set1_epi16((short)wg);
+	const __m256i vwb = _mm256_set1_epi16((short)wb);
+	const __m256i round = _mm256_set1_epi16(128);
+	int y, x;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* s = src + (size_t)y * src_stride;
+		uint8_t* d = dst + (size_t)y * dst_stride;
+
+		for(x = 0; x + 16 <= width; x += 16)
+			{
+			__m256i r, g, b, l;
+
+			load_rgb16_avx2(s + x * 3, &r, &g, &b);
+			// sum never exceeds 255 * 256 + 128, so unsigned 16-bit lanes are enough
+			l = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, vwr), _mm256_mullo_epi16(g, vwg)),
+								 _mm256_add_epi16(_mm256_mullo_epi16(b, vwb), round));
+			_mm_storeu_si128((__m128i*)(d + x), pack16_avx2(_mm256_srli_epi16(l, 8)));
+			}
+
+		grey_row_scalar(s, d, x, width, wr, wg, wb);
+		}
+	}
+
+// sums of horizontal 16-bit lane pairs as 32-bit lanes
+TARGET_AVX2 static inline __m256i pair_sums32_avx2(__m256i v)
+	{
+	return _mm256_add_epi32(_mm256_and_si256(v, _mm256_set1_epi32(0xFFFF)), _mm256_srli_epi32(v, 16));
+	}
+
+// 8 32-bit lanes (outputs 0..3 in low lane, 4..7 in high lane) to 8 bytes in order
+TARGET_AVX2 static inline __m128i pack32x8_avx2(__m256i v)
+	{
+	__m128i p = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	return _mm_packus_epi16(p, p);
+	}
+
+TARGET_AVX2 static void box_2x_avx2(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels)
+	{
+	const __m256i round16 = _mm256_set1_epi16(2);
+	const __m256i round32 = _mm256_set1_epi32(2);
+	const __m256i mask = _mm256_set1_epi16(0x00FF);
+	int y, x;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* r0 = src + (size_t)(y * 2) * src_stride;
+		const uint8_t* r1 = r0 + src_stride;
+		uint8_t* d = dst + (size_t)y * dst_stride;
+
+		if(channels == 1)
+			{
+			for(x = 0; x + 16 <= width; x += 16)
+				{
+				__m256i a = _mm256_loadu_si256((const __m256i*)(r0 + x * 2));
+				__m256i b = _mm256_loadu_si256((const __m256i*)(r1 + x * 2));
+				__m256i s = _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(a, mask), _mm256_srli_epi16(a, 8)),
+											 _mm256_add_epi16(_mm256_and_si256(b, mask), _mm256_srli_epi16(b, 8)));
+				_mm_storeu_si128((__m128i*)(d + x), pack16_avx2(_mm256_srli_epi16(_mm256_add_epi16(s, round16), 2)));
+				}
+			}
+		else
+			{
+			for(x = 0; x + 8 <= width; x += 8)
+				{
+				__m256i ra, ga, ba, rb, gb, bb;
+				__m128i r8, g8, b8;
+
+				load_rgb16_avx2(r0 + x * 6, &ra, &ga, &ba);
+				load_rgb16_avx2(r1 + x * 6, &rb, &gb, &bb);
+				r8 = pack32x8_avx2(_mm256_srli_epi32(_mm256_add_epi32(pair_sums32_avx2(_mm256_add_epi16(ra, rb)), round32), 2));
+				g8 = pack32x8_avx2(_mm256_srli_epi32(_mm256_add_epi32(pair_sums32_avx2(_mm256_add_epi16(ga, gb)), round32), 2));
+				b8 = pack32x8_avx2(_mm256_srli_epi32(_mm256_add_epi32(pair_sums32_avx2(_mm256_add_epi16(ba, bb)), round32), 2));
+
+				// 8 output pixels, written as two groups of 4
+				store_rgb4_avx2(d + x * 3, _mm_cvtepu8_epi32(r8), _mm_cvtepu8_epi32(g8), _mm_cvtepu8_epi32(b8));
+				store_rgb4_avx2(d + x * 3 + 12, _mm_cvtepu8_epi32(_mm_srli_si128(r8, 4)), _mm_cvtepu8_epi32(_mm_srli_si128(g8, 4)),
+								_mm_cvtepu8_epi32(_mm_srli_si128(b8, 4)));
+				}
+			}
+
+		box_2x_row_scalar(r0, r1, d, x, width, channels);
+		}
+	}
+
+TARGET_AVX2 static void box_4x_avx2(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels)
+	{
+	const __m256i round = _mm256_set1_epi32(8);
+	const __m256i mask = _mm256_set1_epi16(0x00FF);
+	int y, x, j;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* s = src + (size_t)(y * 4) * src_stride;
+		uint8_t* d = dst + (size_t)y * dst_stride;
+
+		if(channels == 1)
+			{
+			for(x = 0; x + 16 <= width; x += 16)
+				{
+				__m256i t0 = _mm256_setzero_si256();
+				__m256i t1 = _mm256_setzero_si256();
+				__m128i lo, hi;
+
+				for(j = 0; j < 4; j++)
+					{
+					__m256i a = _mm256_loadu_si256((const __m256i*)(s + (size_t)j * src_stride + x * 4));
+					__m256i b = _mm256_loadu_si256((const __m256i*)(s + (size_t)j * src_stride + x * 4 + 32));
+					t0 = _mm256_add_epi16(t0, _mm256_add_epi16(_mm256_and_si256(a, mask), _mm256_srli_epi16(a, 8)));
+					t1 = _mm256_add_epi16(t1, _mm256_add_epi16(_mm256_and_si256(b, mask), _mm256_srli_epi16(b, 8)));
+					}
+				lo = pack32x8_avx2(_mm256_srli_epi32(_mm256_add_epi32(pair_sums32_avx2(t0), round), 4));
+				hi = pack32x8_avx2(_mm256_srli_epi32(_mm256_add_epi32(pair_sums32_avx2(t1), round), 4));
+				_mm_storeu_si128((__m128i*)(d + x), _mm_unpacklo_epi64(lo, hi));
+				}
+			}
+		else
+			{
+			for(x = 0; x + 4 <= width; x += 4)
+				{
+				__m256i r = _mm256_setzero_si256(), g = _mm256_setzero_si256(), b = _mm256_setzero_si256();
+				__m256i rj, gj, bj;
+
+				for(j = 0; j < 4; j++)
+					{
+					load_rgb16_avx2(s + (size_t)j * src_stride + x * 12, &rj, &gj, &bj);
+					r = _mm256_add_epi16(r, rj);
+					g = _mm256_add_epi16(g, gj);
+					b = _mm256_add_epi16(b, bj);
+					}
+
+				// pairs of pairs, valid sums end up in even 32-bit lanes
+				r = pair_sums32_avx2(r);
+				g = pair_sums32_avx2(g);
+				b = pair_sums32_avx2(b);
+				r = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(r, _mm256_srli_epi64(r, 32)), round), 4);
+				g = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(g, _mm256_srli_epi64(g, 32)), round), 4);
+				b = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(b, _mm256_srli_epi64(b, 32)), round), 4);
+				r = _mm256_permutevar8x32_epi32(r, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+				g = _mm256_permutevar8x32_epi32(g, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+				b = _mm256_permutevar8x32_epi32(b, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+				store_rgb4_avx2(d + x * 3, _mm256_castsi256_si128(r), _mm256_castsi256_si128(g), _mm256_castsi256_si128(b));
+				}
+			}
+
+		box_4x_row_scalar(s, src_stride, d, x, width, channels);
+		}
+	}
+
+#undef Z
+
+static const struct mt_ffmpeg_stream_kernels kernels_avx2 =
+	{
+	"avx2",
+	yuv420p_to_rgb_avx2,
+	nv12_to_rgb_avx2,
+	rgb_to_grey_avx2,
+	box_2x_avx2,
+	box_4x_avx2,
+	crop_scalar
+	};
+
+#endif // KERNELS_AVX2
+
+// ------------------------------------------------------------------------------------------------
+// NEON
+// structured loads/stores (vld3/vst3) deinterleave packed RGB for free
+
+#ifdef KERNELS_NEON
+
+static inline void yuv16_neon(uint8x16_t y16, int16x8_t d8, int16x8_t e8, uint8_t* dst, int bgr, const struct yuv_coefs* c)
+	{
+	int16x8_t yl = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y16)));
+	int16x8_t yh = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y16)));
+	int16x8_t rt = vmulq_n_s16(e8, (int16_t)c->cr_r);
+	int16x8_t gt = vaddq_s16(vmulq_n_s16(d8, (int16_t)c->cb_g), vmulq_n_s16(e8, (int16_t)c->cr_g));
+	int16x8_t bt = vmulq_n_s16(d8, (int16_t)c->cb_b);
+	int16x8x2_t rd = vzipq_s16(rt, rt);		// each chroma term covers two neighbouring pixels
+	int16x8x2_t gd = vzipq_s16(gt, gt);
+	int16x8x2_t bd = vzipq_s16(bt, bt);
+	uint8x16x3_t out;
+	uint8x16_t r, b;
+
+	yl = vqaddq_s16(vmulq_n_s16(vsubq_s16(yl, vdupq_n_s16((int16_t)c->yoff)), (int16_t)c->ycoef), vdupq_n_s16(32));
+	yh = vqaddq_s16(vmulq_n_s16(vsubq_s16(yh, vdupq_n_s16((int16_t)c->yoff)), (int16_t)c->ycoef), vdupq_n_s16(32));
+
+	r = vcombine_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(yl, rd.val[0]), 6)), vqmovun_s16(vshrq_n_s16(vqaddq_s16(yh, rd.val[1]), 6)));
+	out.val[1] = vcombine_u8(vqmovun_s16(vshrq_n_s16(vqsubq_s16(yl, gd.val[0]), 6)), vqmovun_s16(vshrq_n_s16(vqsubq_s16(yh, gd.val[1]), 6)));
+	b = vcombine_u8(vqmovun_s16(vshrq_n_s16(vqaddq_s16(yl, bd.val[0]), 6)), vqmovun_s16(vshrq_n_s16(vqaddq_s16(yh, bd.val[1]), 6)));
+
+	out.val[0] = bgr ? b : r;
+	out.val[2] = bgr ? r : b;
+	vst3q_u8(dst, out);
+	}
+
+static void yuv420p_to_rgb_neon(const uint8_t* y, int y_stride, const uint8_t* u, int u_stride, const uint8_t* v, int v_stride,
+								uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range)
+	{
+	const struct yuv_coefs* c = get_yuv_coefs(matrix, full_range);
+	const int16x8_t bias = vdupq_n_s16(128);
+	int row, x;
+
+	for(row = 0; row < height; row++)
+		{
+		const uint8_t* ys = y + (size_t)row * y_stride;
+		const uint8_t* us = u + (size_t)(row >> 1) * u_stride;
+		const uint8_t* vs = v + (size_t)(row >> 1) * v_stride;
+		uint8_t* d = dst + (size_t)row * dst_stride;
+
+		for(x = 0; x + 16 <= width; x += 16)
+			{
+			int16x8_t d8 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(us + x / 2))), bias);
+			int16x8_t e8 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(vs + x / 2))), bias);
+			yuv16_neon(vld1q_u8(ys + x), d8, e8, d + x * 3, bgr, c);
+			}
+
+		yuv_row_scalar(ys, us, vs, 1, d, x, width, bgr, c);
+		}
+	}
+
+static void nv12_to_rgb_neon(const uint8_t* y, int y_stride, const uint8_t* uv, int uv_stride,
+							 uint8_t* dst, int dst_stride, int width, int height, int bgr, int matrix, int full_range)
+	{
+	const struct yuv_coefs* c = get_yuv_coefs(matrix, full_range);
+	const int16x8_t bias = vdupq_n_s16(128);
+	int row, x;
+
+	for(row = 0; row < height; row++)
+		{
+		const uint8_t* ys = y + (size_t)row * y_stride;
+		const uint8_t* uvs = uv + (size_t)(row >> 1) * uv_stride;
+		uint8_t* d = dst + (size_t)row * dst_stride;
+
+		for(x = 0; x + 16 <= width; x += 16)
+			{
+			uint8x8x2_t uv8 = vld2_u8(uvs + x);
+			int16x8_t d8 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uv8.val[0])), bias);
+			int16x8_t e8 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(uv8.val[1])), bias);
+			yuv16_neon(vld1q_u8(ys + x), d8, e8, d + x * 3, bgr, c);
+			}
+
+		yuv_row_scalar(ys, uvs, uvs + 1, 2, d, x, width, bgr, c);
+		}
+	}
+
+static void rgb_to_grey_neon(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride,
+							 int width, int height, int wr, int wg, int wb)
+	{
+	const uint8x8_t vwr = vdup_n_u8((uint8_t)wr);
+	const uint8x8_t vwg = vdup_n_u8((uint8_t)wg);
+	const uint8x8_t vwb = vdup_n_u8((uint8_t)wb);
+	int y, x;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* s = src + (size_t)y * src_stride;
+		uint8_t* d = dst + (size_t)y * dst_stride;
+
+		for(x = 0; x + 16 <= width; x += 16)
+			{
+			uint8x16x3_t p = vld3q_u8(s + x * 3);
+			uint16x8_t lo = vmull_u8(vget_low_u8(p.val[0]), vwr);
+			uint16x8_t hi = vmull_u8(vget_high_u8(p.val[0]), vwr);
+
+			lo = vmlal_u8(lo, vget_low_u8(p.val[1]), vwg);
+			hi = vmlal_u8(hi, vget_high_u8(p.val[1]), vwg);
+			lo = vmlal_u8(lo, vget_low_u8(p.val[2]), vwb);
+			hi = vmlal_u8(hi, vget_high_u8(p.val[2]), vwb);
+			// rounding narrow adds 128 before shifting, without overflowing
+			vst1q_u8(d + x, vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)));
+			}
+
+		grey_row_scalar(s, d, x, width, wr, wg, wb);
+		}
+	}
+
+static void box_2x_neon(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels)
+	{
+	int y, x, c;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* r0 = src + (size_t)(y * 2) * src_stride;
+		const uint8_t* r1 = r0 + src_stride;
+		uint8_t* d = dst + (size_t)y * dst_stride;
+
+		if(channels == 1)
+			{
+			for(x = 0; x + 16 <= width; x += 16)
+				{
+				uint16x8_t lo = vpadalq_u8(vpaddlq_u8(vld1q_u8(r0 + x * 2)), vld1q_u8(r1 + x * 2));
+				uint16x8_t hi = vpadalq_u8(vpaddlq_u8(vld1q_u8(r0 + x * 2 + 16)), vld1q_u8(r1 + x * 2 + 16));
+				vst1q_u8(d + x, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+				}
+			}
+		else
+			{
+			for(x = 0; x + 8 <= width; x += 8)
+				{
+				uint8x16x3_t a = vld3q_u8(r0 + x * 6);
+				uint8x16x3_t b = vld3q_u8(r1 + x * 6);
+				uint8x8x3_t out;
+
+				for(c = 0; c < 3; c++)
+					out.val[c] = vrshrn_n_u16(vpadalq_u8(vpaddlq_u8(a.val[c]), b.val[c]), 2);
+				vst3_u8(d + x * 3, out);
+				}
+			}
+
+		box_2x_row_scalar(r0, r1, d, x, width, channels);
+		}
+	}
+
+static void box_4x_neon(const uint8_t* src, int src_stride, uint8_t* dst, int dst_stride, int width, int height, int channels)
+	{
+	int y, x, c, j;
+
+	for(y = 0; y < height; y++)
+		{
+		const uint8_t* s = src + (size_t)(y * 4) * src_stride;
+		uint8_t* d = dst + (size_t)y * dst_stride;
+
+		if(channels == 1)
+			{
+			for(x = 0; x + 8 <= width; x += 8)
+				{
+				uint16x8_t lo = vdupq_n_u16(0);
+				uint16x8_t hi = vdupq_n_u16(0);
+
+				for(j = 0; j < 4; j++)
+					{
+					lo = vpadalq_u8(lo, vld1q_u8(s + (size_t)j * src_stride + x * 4));
+					hi = vpadalq_u8(hi, vld1q_u8(s + (size_t)j * src_stride + x * 4 + 16));
+					}
+				vst1_u8(d + x, vmovn_u16(vcombine_u16(vrshrn_n_u32(vpaddlq_u16(lo), 4), vrshrn_n_u32(vpaddlq_u16(hi), 4))));
+				}
+			}
+		else
+			{
+			for(x = 0; x + 8 <= width; x += 8)
+				{
+				uint16x8_t lo[3], hi[3];
+				uint8x8x3_t out;
+
+				for(c = 0; c < 3; c++)
+					{
+					lo[c] = vdupq_n_u16(0);
+					hi[c] = vdupq_n_u16(0);
+					}
+				for(j = 0; j < 4; j++)
+					{
+					uint8x16x3_t a = vld3q_u8(s + (size_t)j * src_stride + x * 12);
+					uint8x16x3_t b = vld3q_u8(s + (size_t)j * src_stride + x * 12 + 48);
+					for(c = 0; c < 3; c++)
+						{
+						lo[c] = vpadalq_u8(lo[c], a.val[c]);
+						hi[c] = vpadalq_u8(hi[c], b.val[c]);
+						}
+					}
+				for(c = 0; c < 3; c++)
+					out.val[c] = vmovn_u16(vcombine_u16(vrshrn_n_u32(vpaddlq_u16(lo[c]), 4), vrshrn_n_u32(vpaddlq_u16(hi[c]), 4)));
+				vst3_u8(d + x * 3, out);
+				}
+			}
+
+		box_4x_row_scalar(s, src_stride, d, x, width, channels);
+		}
+	}
+
+static const struct mt_ffmpeg_stream_kernels kernels_neon =
+	{
+	"neon",
+	yuv420p_to_rgb_neon,
+	nv12_to_rgb_neon,
+	rgb_to_grey_neon,
+	box_2x_neon,
+	box_4x_neon,
+	crop_scalar
+	};
+
+#endif // KERNELS_NEON
+
+// ------------------------------------------------------------------------------------------------
+// runtime dispatch
+
+static int cpu_has_sse2(void)
+	{
+#if defined(_M_X64) || defined(__x86_64__)
+	return 1;	// part of x86-64 baseline
+#elif defined(KERNELS_SSE2) && defined(__GNUC__)
+	return __builtin_cpu_supports("sse2");
+#else
+	return 0;
+#endif
+	}
+
+static int cpu_has_avx2(void)
+	{
+#ifdef KERNELS_AVX2
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
+	}
+
+const struct mt_ffmpeg_stream_kernels* mt_ffmpeg_stream_kernels_scalar(void)
+	{
+	return &kernels_scalar;
+	}
+
+const struct mt_ffmpeg_stream_kernels* mt_ffmpeg_stream_kernels_by_name(const char* name)
+	{
+	if(strcmp(name, "scalar") == 0)
+		return &kernels_scalar;
+#ifdef KERNELS_SSE2
+	if(strcmp(name, "sse2") == 0 && cpu_has_sse2())
+		return &kernels_sse2;
+#endif
+#ifdef KERNELS_AVX2
+	if(strcmp(name, "avx2") == 0 && cpu_has_avx2())
+		return &kernels_avx2;
+#endif
+#ifdef KERNELS_NEON
+	if(strcmp(name, "neon") == 0)
+		return &kernels_neon;
+#endif
+	return 0;
+	}
+
+// picked (or selected) set, 0 until first use
+static const struct mt_ffmpeg_stream_kernels* best = 0;
+
+// result is cached, racing first calls from several threads all store the same pointer
+const struct mt_ffmpeg_stream_kernels* mt_ffmpeg_stream_kernels_get(void)
+	{
+	if(best == 0)
+		{
+		const struct mt_ffmpeg_stream_kernels* k = &kernels_scalar;
+#ifdef KERNELS_SSE2
+		if(cpu_has_sse2())
+			k = &kernels_sse2;
+#endif
+#ifdef KERNELS_AVX2
+		if(cpu_has_avx2())
+			k = &kernels_avx2;
+#endif
+#ifdef KERNELS_NEON
+		k = &kernels_neon;
+#endif
+		best = k;
+		}
+
+	return best;
+	}
+
+// for benchmarks and bit-exactness checks, not meant to be called while frames are being converted
+int mt_ffmpeg_stream_kernels_select(const char* name)
+	{
+	const struct mt_ffmpeg_stream_kernels* k = mt_ffmpeg_stream_kernels_by_name(name);
+
+	if(k == 0)
+		return -1;
+
+	best = k;
+	return 0;
+	}
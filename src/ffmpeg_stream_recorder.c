@@ -0,0 +1,587 @@
+// segmented recording of compressed video for incident review, see ffmpeg_stream_recorder.h
+// packets are only remuxed: a minute of H.264 costs what camera sent over network, not gigabytes of raw images
+// stream thread queues references to its packets and returns at once, writer thread muxes them into files,
+// when queue is full (disk stalled) packets are dropped until next keyframe, anything in between couldn't be decoded
+// MP4 files are fragmented at keyframes, so a crash or power loss costs last fragment only, not the whole file
+//
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+// same threading choice as in ffmpeg_stream_decoder_portable_noscaling.c
+
+//#define USE_WINDOWS_THREADING	  //Windows
+#define USE_PTHREADS			  //instead of pthreads which is portable across Windows & Linux
+
+#ifdef _WIN32
+ #include <windows.h>
+#endif
+#ifdef USE_PTHREADS
+ #define HAVE_STRUCT_TIMESPEC   //so timespec struct is not redefined in 'pthread.h'
+ #include <pthread.h>
+#endif
+
+#include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_recorder.h"
+
+#define RECORD_QUEUE_SIZE 1024
+#define RECORD_PATH_SIZE 1024
+
+// one file being written with its CSV index, by recorder's writer thread or by a pre-event dump
+// timestamps are made to start at 0 and to strictly increase, as MP4 wants them,
+// cameras without pts get timestamps from receive time
+struct RecordFile
+	{
+	AVFormatContext* muxer;
+	FILE* index;
+	AVRational time_base;		// of packets handed in
+	int64_t ts_offset;			// first dts of file
+	int64_t last_dts;
+	};
+
+// packet on its way from stream thread to writer thread
+struct RecordEntry
+	{
+	AVPacket* packet;			// NULL: stream (re)connected, following packets belong to new file with parameters below
+	AVCodecParameters* par;
+	AVRational time_base;
+	int64_t receive_time;
+	int64_t capture_time;
+	};
+
+struct mt_ffmpeg_stream_recorder
+	{
+	char path[RECORD_PATH_SIZE];
+	char format[8];
+	int segment_seconds;
+	int max_files;
+
+	// queue between stream thread and writer thread, guarded by cs_lock
+	struct RecordEntry* queue;
+	int queue_size;
+	int queue_head;
+	int queue_count;
+	int stopping;
+	struct mt_ffmpeg_stream_record_stats stats;
+	int skip_to_key;			// packet was dropped, stream thread only
+
+	// current file, writer thread only
+	AVCodecParameters* par;
+	AVRational time_base;
+	struct RecordFile file;
+	int64_t segment_start;		// receive time of file's first packet
+	char (*files)[RECORD_PATH_SIZE];	// max_files newest file names, oldest first, for rolling deletion
+	int files_head;
+	int files_count;
+
+#ifdef USE_WINDOWS_THREADING
+	CRITICAL_SECTION cs_lock;
+	CONDITION_VARIABLE cv_queue;
+	HANDLE thread_handle;
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_t cs_lock;
+	pthread_cond_t cv_queue;
+	pthread_t thread_handle;
+#endif
+	};
+
+static void recorder_lock(struct mt_ffmpeg_stream_recorder* rec)
+	{
+#ifdef USE_WINDOWS_THREADING
+	EnterCriticalSection(&(rec->cs_lock));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_lock(&(rec->cs_lock));
+#endif
+	}
+
+static void recorder_unlock(struct mt_ffmpeg_stream_recorder* rec)
+	{
+#ifdef USE_WINDOWS_THREADING
+	LeaveCriticalSection(&(rec->cs_lock));
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_unlock(&(rec->cs_lock));
+#endif
+	}
+
+static void recorder_signal(struct mt_ffmpeg_stream_recorder* rec)
+	{
+#ifdef USE_WINDOWS_THREADING
+	WakeConditionVariable(&(rec->cv_queue));
+#endif
+#ifdef USE_PTHREADS
+	pthread_cond_signal(&(rec->cv_queue));
+#endif
+	}
+
+static void free_entry(struct RecordEntry* entry)
+	{
+	if(entry->packet != 0)
+		av_packet_free(&entry->packet);
+	if(entry->par != 0)
+		avcodec_parameters_free(&entry->par);
+	}
+
+// finish file, it's playable as it is from here on
+static void file_close(struct RecordFile* file)
+	{
+	if(file->muxer != 0)
+		{
+		av_write_trailer(file->muxer);
+		avio_closep(&file->muxer->pb);
+		avformat_free_context(file->muxer);
+		file->muxer = 0;
+		}
+
+	if(file->index != 0)
+		{
+		fclose(file->index);
+		file->index = 0;
+		}
+	}
+
+// create file of given format ("mp4" or "mkv") for stream with given parameters, returns -1 if it can't be written
+static int file_open(struct RecordFile* file, const char* name, const char* format, const AVCodecParameters* par, AVRational time_base)
+	{
+	char index_name[RECORD_PATH_SIZE + 40];
+	AVStream* st;
+	AVDictionary* muxer_options = 0;
+	int ret;
+
+	memset(file, 0, sizeof(*file));
+	if(avformat_alloc_output_context2(&file->muxer, NULL, strcmp(format, "mkv") == 0 ? "matroska" : format, name) < 0)
+		{
+		file->muxer = 0;
+		return -1;
+		}
+
+	// stream is copied as it is, muxer picks its own codec tag
+	st = avformat_new_stream(file->muxer, NULL);
+	if(st == 0 || avcodec_parameters_copy(st->codecpar, par) < 0)
+		{
+		avformat_free_context(file->muxer);
+		file->muxer = 0;
+		return -1;
+		}
+	st->codecpar->codec_tag = 0;
+	st->time_base = time_base;
+
+	if(avio_open(&file->muxer->pb, name, AVIO_FLAG_WRITE) < 0)
+		{
+		avformat_free_context(file->muxer);
+		file->muxer = 0;
+		return -1;
+		}
+
+	// fragment at every keyframe with moov up front, so file stays readable if we never get to write trailer
+	if(strcmp(format, "mp4") == 0)
+		av_dict_set(&muxer_options, "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+
+	ret = avformat_write_header(file->muxer, &muxer_options);
+	av_dict_free(&muxer_options);
+	if(ret < 0)
+		{
+		avio_closep(&file->muxer->pb);
+		avformat_free_context(file->muxer);
+		file->muxer = 0;
+		remove(name);
+		return -1;
+		}
+
+	// index is a nice to have, file is recorded without it too
+	snprintf(index_name, sizeof(index_name), "%s.csv", name);
+	file->index = fopen(index_name, "w");
+	if(file->index != 0)
+		fprintf(file->index, "pts,pts_time,stamp,receive_time,capture_time,keyframe\n");
+
+	file->time_base = time_base;
+	file->last_dts = AV_NOPTS_VALUE;
+	return 0;
+	}
+
+// mux one packet, its timestamps are changed on the way, returns -1 on write error
+static int file_write(struct RecordFile* file, AVPacket* packet, int64_t receive_time, int64_t capture_time)
+	{
+	AVRational microseconds = { 1, 1000000 };
+	int64_t pts, dts, stamp;
+
+	dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+	if(dts == AV_NOPTS_VALUE)
+		dts = av_rescale_q(receive_time, microseconds, file->time_base);
+	pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : dts;
+
+	if(file->last_dts == AV_NOPTS_VALUE)
+		file->ts_offset = dts;
+	dts -= file->ts_offset;
+	pts -= file->ts_offset;
+	if(file->last_dts != AV_NOPTS_VALUE && dts <= file->last_dts)
+		dts = file->last_dts + 1;
+	if(pts < dts)
+		pts = dts;
+	file->last_dts = dts;
+
+	if(file->index != 0)
+		{
+		stamp = capture_time > 0 ? capture_time : receive_time;
+		fprintf(file->index, "%" PRId64 ",%.6f,%.6f,%.6f,%.6f,%d\n", pts, pts * av_q2d(file->time_base),
+				stamp / 1e6, receive_time / 1e6, capture_time / 1e6, (packet->flags & AV_PKT_FLAG_KEY) != 0);
+		}
+
+	packet->pts = pts;
+	packet->dts = dts;
+	packet->stream_index = 0;
+	packet->pos = -1;
+	av_packet_rescale_ts(packet, file->time_base, file->muxer->streams[0]->time_base);
+
+	return av_write_frame(file->muxer, packet) < 0 ? -1 : 0;
+	}
+
+// remember new file, delete oldest one (and its index) when there are more than max_files
+static void add_file(struct mt_ffmpeg_stream_recorder* rec, const char* name)
+	{
+	char index_name[RECORD_PATH_SIZE + 8];
+	int slot;
+
+	if(rec->max_files <= 0)
+		return;
+
+	if(rec->files_count == rec->max_files)
+		{
+		remove(rec->files[rec->files_head]);
+		snprintf(index_name, sizeof(index_name), "%s.csv", rec->files[rec->files_head]);
+		remove(index_name);
+		rec->files_head = (rec->files_head + 1) % rec->max_files;
+		rec->files_count--;
+		}
+
+	slot = (rec->files_head + rec->files_count) % rec->max_files;
+	snprintf(rec->files[slot], RECORD_PATH_SIZE, "%s", name);
+	rec->files_count++;
+	}
+
+// new file named after local time of its first packet, returns -1 if it can't be written
+static int open_segment(struct mt_ffmpeg_stream_recorder* rec, int64_t receive_time)
+	{
+	char name[RECORD_PATH_SIZE + 32];
+	time_t seconds = (time_t)(receive_time / 1000000);
+	struct tm t;
+
+#ifdef _WIN32
+	localtime_s(&t, &seconds);
+#else
+	localtime_r(&seconds, &t);
+#endif
+	snprintf(name, sizeof(name), "%s_%04d%02d%02d_%02d%02d%02d_%03d.%s", rec->path,
+			 t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec,
+			 (int)((receive_time / 1000) % 1000), rec->format);
+
+	if(file_open(&rec->file, name, rec->format, rec->par, rec->time_base) < 0)
+		return -1;
+
+	rec->segment_start = receive_time;
+	add_file(rec, name);
+
+	recorder_lock(rec);
+	rec->stats.files++;
+	recorder_unlock(rec);
+	return 0;
+	}
+
+// mux one packet, starting new file first at keyframes when segment is long enough
+static void write_packet(struct mt_ffmpeg_stream_recorder* rec, struct RecordEntry* entry)
+	{
+	int key = (entry->packet->flags & AV_PKT_FLAG_KEY) != 0;
+	int written = 0;
+
+	if(rec->par == 0)
+		return;
+
+	if(rec->file.muxer != 0 && key && rec->segment_seconds > 0 && entry->receive_time - rec->segment_start >= (int64_t)rec->segment_seconds * 1000000)
+		file_close(&rec->file);
+
+	// file can only start with a keyframe, packets before it wouldn't decode
+	if(rec->file.muxer == 0)
+		{
+		if(!key)
+			return;
+		if(open_segment(rec, entry->receive_time) < 0)
+			{
+			recorder_lock(rec);
+			rec->stats.packets_dropped++;
+			recorder_unlock(rec);
+			return;
+			}
+		}
+
+	// write error (disk full, removed) ends this file, next keyframe tries a new one
+	if(file_write(&rec->file, entry->packet, entry->receive_time, entry->capture_time) < 0)
+		file_close(&rec->file);
+	else
+		written = 1;
+
+	recorder_lock(rec);
+	if(written)
+		rec->stats.packets_written++;
+	else
+		rec->stats.packets_dropped++;
+	recorder_unlock(rec);
+	}
+
+// writer thread: takes packets off queue until recorder is closed and queue is empty
+static void recorder_thread(struct mt_ffmpeg_stream_recorder* rec)
+	{
+	struct RecordEntry entry;
+
+	for(;;)
+		{
+		recorder_lock(rec);
+		while(rec->queue_count == 0 && !rec->stopping)
+			{
+#ifdef USE_WINDOWS_THREADING
+			SleepConditionVariableCS(&(rec->cv_queue), &(rec->cs_lock), INFINITE);
+#endif
+#ifdef USE_PTHREADS
+			pthread_cond_wait(&(rec->cv_queue), &(rec->cs_lock));
+#endif
+			}
+		if(rec->queue_count == 0)
+			{
+			recorder_unlock(rec);
+			break;
+			}
+		entry = rec->queue[rec->queue_head];
+		rec->queue_head = (rec->queue_head + 1) % rec->queue_size;
+		rec->queue_count--;
+		recorder_unlock(rec);
+
+		if(entry.packet == 0)
+			{
+			// new connection, pts start over and codec may have changed
+			file_close(&rec->file);
+			if(rec->par != 0)
+				avcodec_parameters_free(&rec->par);
+			rec->par = entry.par;
+			rec->time_base = entry.time_base;
+			entry.par = 0;
+			}
+		else
+			write_packet(rec, &entry);
+
+		free_entry(&entry);
+		}
+
+	file_close(&rec->file);
+	}
+
+#ifdef USE_WINDOWS_THREADING
+static UINT recorder_start_thread(LPVOID param)
+	{
+	recorder_thread((struct mt_ffmpeg_stream_recorder*)param);
+	return 0;
+	}
+#endif
+
+#ifdef USE_PTHREADS
+static void* recorder_start_thread(void* thread_argument)
+	{
+	recorder_thread((struct mt_ffmpeg_stream_recorder*)thread_argument);
+	return 0;
+	}
+#endif
+
+struct mt_ffmpeg_stream_recorder* mt_ffmpeg_stream_recorder_open(const char* path, const char* format,
+																   int segment_seconds, int max_files, int queue_size)
+	{
+	struct mt_ffmpeg_stream_recorder* rec;
+#ifdef USE_WINDOWS_THREADING
+	DWORD thread_id;
+#endif
+
+	if(path == 0 || path[0] == 0 || strlen(path) >= RECORD_PATH_SIZE)
+		return 0;
+	if(format == 0 || format[0] == 0)
+		format = "mp4";
+	if(strcmp(format, "mp4") != 0 && strcmp(format, "mkv") != 0)
+		return 0;
+
+	rec = av_mallocz(sizeof(*rec));
+	if(rec == 0)
+		return 0;
+
+	strcpy(rec->path, path);
+	strcpy(rec->format, format);
+	rec->segment_seconds = segment_seconds;
+	rec->max_files = max_files;
+	rec->queue_size = queue_size > 0 ? queue_size : RECORD_QUEUE_SIZE;
+	rec->queue = av_calloc(rec->queue_size, sizeof(rec->queue[0]));
+	if(max_files > 0)
+		rec->files = av_calloc(max_files, sizeof(rec->files[0]));
+	if(rec->queue == 0 || (max_files > 0 && rec->files == 0))
+		{
+		av_free(rec->queue);
+		av_free(rec->files);
+		av_free(rec);
+		return 0;
+		}
+
+#ifdef USE_WINDOWS_THREADING
+	InitializeCriticalSection(&(rec->cs_lock));
+	InitializeConditionVariable(&(rec->cv_queue));
+	rec->thread_handle = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)(recorder_start_thread), (LPVOID)rec, 0, &thread_id);
+#endif
+#ifdef USE_PTHREADS
+	pthread_mutex_init(&(rec->cs_lock), NULL);
+	pthread_cond_init(&(rec->cv_queue), NULL);
+	pthread_create(&(rec->thread_handle), NULL, recorder_start_thread, rec);
+#endif
+	return rec;
+	}
+
+void mt_ffmpeg_stream_recorder_close(struct mt_ffmpeg_stream_recorder* rec)
+	{
+	if(rec == 0)
+		return;
+
+	recorder_lock(rec);
+	rec->stopping = 1;
+	recorder_signal(rec);
+	recorder_unlock(rec);
+
+#ifdef USE_WINDOWS_THREADING
+	WaitForSingleObject(rec->thread_handle, INFINITE);
+	CloseHandle(rec->thread_handle);
+	DeleteCriticalSection(&(rec->cs_lock));
+#endif
+#ifdef USE_PTHREADS
+	pthread_join(rec->thread_handle, NULL);
+	pthread_cond_destroy(&(rec->cv_queue));
+	pthread_mutex_destroy(&(rec->cs_lock));
+#endif
+
+	if(rec->par != 0)
+		avcodec_parameters_free(&rec->par);
+	av_free(rec->queue);
+	av_free(rec->files);
+	av_free(rec);
+	}
+
+// called by stream thread once connection is up
+// queue full of packets of old connection means disk is stalled, they are dropped to make room
+void mt_ffmpeg_stream_recorder_start(struct mt_ffmpeg_stream_recorder* rec, const struct AVCodecParameters* par,
+									 int time_base_num, int time_base_den)
+	{
+	struct RecordEntry entry;
+	int dropped = 0;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.par = avcodec_parameters_alloc();
+	if(entry.par == 0 || avcodec_parameters_copy(entry.par, par) < 0)
+		{
+		free_entry(&entry);
+		return;
+		}
+	entry.time_base.num = time_base_num;
+	entry.time_base.den = time_base_den;
+
+	recorder_lock(rec);
+	while(rec->queue_count == rec->queue_size)
+		{
+		int last = (rec->queue_head + rec->queue_count - 1) % rec->queue_size;
+		free_entry(&rec->queue[last]);
+		rec->queue_count--;
+		dropped++;
+		}
+	rec->queue[(rec->queue_head + rec->queue_count) % rec->queue_size] = entry;
+	rec->queue_count++;
+	rec->stats.packets_dropped += dropped;
+	recorder_signal(rec);
+	recorder_unlock(rec);
+
+	rec->skip_to_key = 0;
+	}
+
+// called by stream thread for every video packet it reads
+int mt_ffmpeg_stream_recorder_write(struct mt_ffmpeg_stream_recorder* rec, const struct AVPacket* packet,
+									int64_t receive_time, int64_t capture_time)
+	{
+	struct RecordEntry entry;
+	int key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+	int queued = 0;
+
+	memset(&entry, 0, sizeof(entry));
+	if(!(rec->skip_to_key && !key))
+		{
+		entry.packet = av_packet_alloc();
+		if(entry.packet != 0 && av_packet_ref(entry.packet, packet) < 0)
+			av_packet_free(&entry.packet);
+		}
+	entry.receive_time = receive_time;
+	entry.capture_time = capture_time;
+
+	recorder_lock(rec);
+	if(entry.packet != 0 && rec->queue_count < rec->queue_size)
+		{
+		rec->queue[(rec->queue_head + rec->queue_count) % rec->queue_size] = entry;
+		rec->queue_count++;
+		recorder_signal(rec);
+		queued = 1;
+		}
+	else
+		rec->stats.packets_dropped++;
+	recorder_unlock(rec);
+
+	if(!queued)
+		free_entry(&entry);
+	rec->skip_to_key = !queued;
+	return queued ? 0 : -1;
+	}
+
+void mt_ffmpeg_stream_recorder_get_stats(struct mt_ffmpeg_stream_recorder* rec, struct mt_ffmpeg_stream_record_stats* stats)
+	{
+	recorder_lock(rec);
+	*stats = rec->stats;
+	recorder_unlock(rec);
+	}
+
+// one file out of given packets, e.g. pre-event buffer, on calling thread
+int mt_ffmpeg_stream_recorder_write_file(const char* filename, const struct AVCodecParameters* par, int time_base_num, int time_base_den,
+										 const struct mt_ffmpeg_stream_record_packet* packets, int count)
+	{
+	struct RecordFile file;
+	AVRational time_base;
+	AVPacket* packet;
+	const char* ext = strrchr(filename, '.');
+	int written = 0;
+	int i;
+
+	for(i = 0; i < count && !(packets[i].packet->flags & AV_PKT_FLAG_KEY); i++)
+		;
+	if(i == count)
+		return -1;
+
+	time_base.num = time_base_num;
+	time_base.den = time_base_den;
+	if(file_open(&file, filename, ext != 0 && strcmp(ext, ".mkv") == 0 ? "mkv" : "mp4", par, time_base) < 0)
+		return -1;
+
+	packet = av_packet_alloc();
+	for(; i < count && packet != 0; i++)
+		{
+		if(av_packet_ref(packet, packets[i].packet) < 0)
+			continue;
+		if(file_write(&file, packet, packets[i].receive_time, packets[i].capture_time) == 0)
+			written++;
+		av_packet_unref(packet);
+		}
+	av_packet_free(&packet);
+
+	file_close(&file);
+	return written;
+	}
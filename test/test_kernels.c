@@ -0,0 +1,225 @@
+// test_kernels.c -bit-exactness test of SIMD pixel kernels (ffmpeg_stream_kernels.c) against plain C reference
+// every kernel of every set this CPU runs gets random pictures of odd and even sizes, with and without padded strides,
+// in every mode (both matrices and ranges, RGB and BGR, 1 and 3 channel boxes), and has to give the very same bytes
+// destination padding is filled with a pattern beforehand, so writes beyond width show up as differences too
+//
+// usage: test_kernels [seed]		exit status 1 if any kernel differs, run by ctest (catkin_make test)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ffmpeg_stream_decoder_portable_noscaling/ffmpeg_stream_kernels.h"
+
+#define PAD_BYTE 0xa5
+
+static const int widths[] = { 1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 97, 130 };
+static const int heights[] = { 1, 2, 3, 5, 8 };
+static const int pads[] = { 0, 13 };		// bytes added to every stride
+
+static uint32_t rng_state = 1;
+static int failures = 0;
+static int cases = 0;
+
+static uint8_t random_byte(void)
+	{
+	rng_state = rng_state * 1664525u + 1013904223u;
+	return (uint8_t)(rng_state >> 24);
+	}
+
+// exact size, so reading beyond last row is caught by address sanitizer or valgrind
+static uint8_t* random_buffer(size_t size)
+	{
+	uint8_t* p = malloc(size ? size : 1);
+	size_t i;
+
+	for(i = 0; i < size; i++)
+		p[i] = random_byte();
+	return p;
+	}
+
+static uint8_t* pad_buffer(size_t size)
+	{
+	uint8_t* p = malloc(size ? size : 1);
+
+	memset(p, PAD_BYTE, size);
+	return p;
+	}
+
+// compare reference and tested output, report first difference
+static void check(const char* set, const char* kernel, const uint8_t* expected, const uint8_t* got, int stride, int rows,
+				  int width, int height, int pad, const char* mode)
+	{
+	size_t i, size = (size_t)stride * rows;
+
+	cases++;
+	for(i = 0; i < size; i++)
+		{
+		if(expected[i] != got[i])
+			{
+			printf("FAIL %s %s %dx%d pad %d %s: byte %d,%d is %d, reference has %d\n", set, kernel, width, height, pad, mode,
+				   (int)(i % stride), (int)(i / stride), got[i], expected[i]);
+			failures++;
+			return;
+			}
+		}
+	}
+
+static void test_yuv(const struct mt_ffmpeg_stream_kernels* ref, const struct mt_ffmpeg_stream_kernels* k, int width, int height, int pad)
+	{
+	int cw = (width + 1) / 2, ch = (height + 1) / 2;
+	int y_stride = width + pad, c_stride = cw + pad, uv_stride = 2 * cw + pad, dst_stride = 3 * width + pad;
+	uint8_t* y = random_buffer((size_t)y_stride * height);
+	uint8_t* u = random_buffer((size_t)c_stride * ch);
+	uint8_t* v = random_buffer((size_t)c_stride * ch);
+	uint8_t* uv = random_buffer((size_t)uv_stride * ch);
+	uint8_t* expected = pad_buffer((size_t)dst_stride * height);
+	uint8_t* got = pad_buffer((size_t)dst_stride * height);
+	int matrix, full_range, bgr;
+	char mode[64];
+
+	for(matrix = FFMPEG_STREAM_KERNEL_BT601; matrix <= FFMPEG_STREAM_KERNEL_BT709; matrix++)
+		for(full_range = 0; full_range <= 1; full_range++)
+			for(bgr = 0; bgr <= 1; bgr++)
+				{
+				snprintf(mode, sizeof(mode), "%s %s range %s", matrix == FFMPEG_STREAM_KERNEL_BT709 ? "bt709" : "bt601",
+						 full_range ? "full" : "limited", bgr ? "bgr" : "rgb");
+
+				ref->yuv420p_to_rgb(y, y_stride, u, c_stride, v, c_stride, expected, dst_stride, width, height, bgr, matrix, full_range);
+				k->yuv420p_to_rgb(y, y_stride, u, c_stride, v, c_stride, got, dst_stride, width, height, bgr, matrix, full_range);
+				check(k->name, "yuv420p_to_rgb", expected, got, dst_stride, height, width, height, pad, mode);
+
+				ref->nv12_to_rgb(y, y_stride, uv, uv_stride, expected, dst_stride, width, height, bgr, matrix, full_range);
+				k->nv12_to_rgb(y, y_stride, uv, uv_stride, got, dst_stride, width, height, bgr, matrix, full_range);
+				check(k->name, "nv12_to_rgb", expected, got, dst_stride, height, width, height, pad, mode);
+				}
+
+	free(y);
+	free(u);
+	free(v);
+	free(uv);
+	free(expected);
+	free(got);
+	}
+
+static void test_grey(const struct mt_ffmpeg_stream_kernels* ref, const struct mt_ffmpeg_stream_kernels* k, int width, int height, int pad)
+	{
+	// BT.601 and BT.709 luma weights, as decoder passes them, and a lopsided set
+	static const int weights[][3] = { { 77, 150, 29 }, { 54, 183, 19 }, { 0, 0, 256 } };
+	int src_stride = 3 * width + pad, dst_stride = width + pad;
+	uint8_t* src = random_buffer((size_t)src_stride * height);
+	uint8_t* expected = pad_buffer((size_t)dst_stride * height);
+	uint8_t* got = pad_buffer((size_t)dst_stride * height);
+	size_t i;
+	char mode[64];
+
+	for(i = 0; i < sizeof(weights) / sizeof(weights[0]); i++)
+		{
+		snprintf(mode, sizeof(mode), "weights %d,%d,%d", weights[i][0], weights[i][1], weights[i][2]);
+		ref->rgb_to_grey(src, src_stride, expected, dst_stride, width, height, weights[i][0], weights[i][1], weights[i][2]);
+		k->rgb_to_grey(src, src_stride, got, dst_stride, width, height, weights[i][0], weights[i][1], weights[i][2]);
+		check(k->name, "rgb_to_grey", expected, got, dst_stride, height, width, height, pad, mode);
+		}
+
+	free(src);
+	free(expected);
+	free(got);
+	}
+
+// width and height are output size, source is factor times that
+static void test_box(const struct mt_ffmpeg_stream_kernels* ref, const struct mt_ffmpeg_stream_kernels* k, int width, int height, int pad)
+	{
+	int factor, channels;
+	char mode[64];
+
+	for(factor = 2; factor <= 4; factor += 2)
+		for(channels = 1; channels <= 3; channels += 2)
+			{
+			int src_stride = factor * width * channels + pad, dst_stride = width * channels + pad;
+			uint8_t* src = random_buffer((size_t)src_stride * factor * height);
+			uint8_t* expected = pad_buffer((size_t)dst_stride * height);
+			uint8_t* got = pad_buffer((size_t)dst_stride * height);
+
+			snprintf(mode, sizeof(mode), "%d channel%s", channels, channels > 1 ? "s" : "");
+			if(factor == 2)
+				{
+				ref->box_2x(src, src_stride, expected, dst_stride, width, height, channels);
+				k->box_2x(src, src_stride, got, dst_stride, width, height, channels);
+				}
+			else
+				{
+				ref->box_4x(src, src_stride, expected, dst_stride, width, height, channels);
+				k->box_4x(src, src_stride, got, dst_stride, width, height, channels);
+				}
+			check(k->name, factor == 2 ? "box_2x" : "box_4x", expected, got, dst_stride, height, width, height, pad, mode);
+
+			free(src);
+			free(expected);
+			free(got);
+			}
+	}
+
+// crop out of a picture 5 pixels wider and 3 rows taller, at an odd offset
+static void test_crop(const struct mt_ffmpeg_stream_kernels* ref, const struct mt_ffmpeg_stream_kernels* k, int width, int height, int pad)
+	{
+	int bpp;
+	char mode[64];
+
+	for(bpp = 1; bpp <= 3; bpp += 2)
+		{
+		int src_stride = (width + 5) * bpp + pad, dst_stride = width * bpp + pad;
+		uint8_t* src = random_buffer((size_t)src_stride * (height + 3));
+		uint8_t* expected = pad_buffer((size_t)dst_stride * height);
+		uint8_t* got = pad_buffer((size_t)dst_stride * height);
+
+		snprintf(mode, sizeof(mode), "%d bytes per pixel", bpp);
+		ref->crop(src, src_stride, bpp, 3, 1, expected, dst_stride, width, height);
+		k->crop(src, src_stride, bpp, 3, 1, got, dst_stride, width, height);
+		check(k->name, "crop", expected, got, dst_stride, height, width, height, pad, mode);
+
+		free(src);
+		free(expected);
+		free(got);
+		}
+	}
+
+int main(int argc, char** argv)
+	{
+	static const char* sets[] = { "sse2", "avx2", "neon" };
+	const struct mt_ffmpeg_stream_kernels* ref = mt_ffmpeg_stream_kernels_scalar();
+	size_t s, w, h, p;
+	int tested = 0;
+
+	if(argc > 1)
+		rng_state = (uint32_t)strtoul(argv[1], 0, 0);
+
+	for(s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+		{
+		const struct mt_ffmpeg_stream_kernels* k = mt_ffmpeg_stream_kernels_by_name(sets[s]);
+		int failures_before = failures, cases_before = cases;
+
+		if(k == 0)
+			{
+			printf("%s: not available on this CPU or build, skipped\n", sets[s]);
+			continue;
+			}
+		tested++;
+
+		for(w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+			for(h = 0; h < sizeof(heights) / sizeof(heights[0]); h++)
+				for(p = 0; p < sizeof(pads) / sizeof(pads[0]); p++)
+					{
+					test_yuv(ref, k, widths[w], heights[h], pads[p]);
+					test_grey(ref, k, widths[w], heights[h], pads[p]);
+					test_box(ref, k, widths[w], heights[h], pads[p]);
+					test_crop(ref, k, widths[w], heights[h], pads[p]);
+					}
+
+		printf("%s: %d cases, %d differ from scalar\n", k->name, cases - cases_before, failures - failures_before);
+		}
+
+	if(tested == 0)
+		printf("no SIMD kernels on this CPU or build, nothing to compare\n");
+	return failures > 0;
+	}